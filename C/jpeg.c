@@ -0,0 +1,5602 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "jpeg.h"
+
+
+//instrumentation hooks, compiled in with -DJPEG_INSTRUMENT: counters of the entropy decoder and timed spans for
+//jpeg_get_stats and jpeg_write_trace. Without it they are empty
+#ifdef JPEG_INSTRUMENT
+#define INSTRUMENT(...) __VA_ARGS__
+#else
+#define INSTRUMENT(...)
+#endif
+
+//time stamp counter: reference cycles at the nominal frequency. Elsewhere the monotonic clock in ns stands in
+static inline uint64_t read_tsc(void)
+{
+#ifdef HAVE_X86_SIMD
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000000ULL+now.tv_nsec;
+#endif
+}
+
+
+static const char * const comp_names[4]={"Y","Cb","Cr","K"};
+
+//a failing decode longjmps back to the API call (or worker thread) that set up env
+typedef struct
+{
+	jmp_buf env;
+	jpeg_status_t status;
+	char message[256];
+} decode_error_t;
+
+__attribute__((noreturn, format(printf, 3, 4)))
+static void decode_fail(decode_error_t * const error, const jpeg_status_t status, char const * const format, ...)
+{
+	va_list ap;
+	
+	va_start(ap, format);
+	vsnprintf(error->message, sizeof(error->message), format, ap);
+	va_end(ap);
+	
+	error->status=status;
+	longjmp(error->env, 1);
+}
+
+#define ARENA_ALIGN 64 //cache line, and enough for aligned SIMD loads
+
+//bump allocator for all buffers sized by the picture. Nothing is freed while a picture is decoded, arena_reset()
+//drops it all at once. A picture that does not fit gets extra blocks; the next reset replaces them by a single
+//block of the peak size, so decoding pictures of similar size does no malloc/free after the first one
+typedef struct
+{
+	uint8_t * base;
+	size_t size;
+	size_t top; //bytes of base in use
+	size_t used; //bytes handed out since the last reset, extra blocks included
+	size_t peak; //largest used since the arena was created
+	void * overflow; //extra blocks, chained through their first bytes
+} arena_t;
+
+static void * arena_alloc(arena_t * const arena, size_t size, decode_error_t * const error)
+{
+	uint8_t * p;
+	
+	size=(size+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1);
+	
+	if(arena->top+size<=arena->size)
+	{
+		p=&arena->base[arena->top];
+		arena->top+=size;
+	}
+	else
+	{
+		void ** const block=aligned_alloc(ARENA_ALIGN, ARENA_ALIGN+size);
+		if(!block)
+			decode_fail(error, JPEG_ERROR_NOMEM, "aligned_alloc %zu bytes", ARENA_ALIGN+size);
+		*block=arena->overflow;
+		arena->overflow=block;
+		p=(uint8_t *)block+ARENA_ALIGN;
+	}
+	
+	arena->used+=size;
+	if(arena->used>arena->peak)
+		arena->peak=arena->used;
+	
+	return p;
+}
+
+static void arena_free_overflow(arena_t * const arena)
+{
+	while(arena->overflow)
+	{
+		void * const next=*(void **)arena->overflow;
+		free(arena->overflow);
+		arena->overflow=next;
+	}
+}
+
+//main block of size bytes, false if it cannot be allocated
+static bool arena_reserve(arena_t * const arena, const size_t size)
+{
+	free(arena->base);
+	arena->size=(size+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1);
+	arena->base=arena->size ? aligned_alloc(ARENA_ALIGN, arena->size) : NULL;
+	if(!arena->base)
+		arena->size=0;
+	arena->top=0;
+	return arena->base || !size;
+}
+
+//everything allocated so far is invalid afterwards
+static void arena_reset(arena_t * const arena)
+{
+	if(arena->overflow)
+	{
+		arena_free_overflow(arena);
+		arena_reserve(arena, arena->peak); //on failure the next picture runs from extra blocks again
+	}
+	
+	arena->top=0;
+	arena->used=0;
+}
+
+static void arena_free(arena_t * const arena)
+{
+	arena_free_overflow(arena);
+	free(arena->base);
+	arena->base=NULL;
+	arena->size=0;
+	arena->top=0;
+	arena->used=0;
+}
+
+typedef uint16_t quantization_table_t[64]; //natural (row-major) order
+
+typedef struct
+{
+	uint_fast8_t C; //component identifier of the frame header
+	uint_fast8_t H;
+	uint_fast8_t V;
+	uint_fast8_t Tq;
+	bool quant_latched; //quant holds table Tq as it was at the first scan of the component
+	uint_fast16_t xi;
+	uint_fast16_t yi;
+	uint_fast8_t Td; //quant table for DC
+	uint_fast8_t Ta; //quant table for AC
+	uint_fast8_t zoomX; //Hmax/H
+	uint_fast8_t zoomY; //Vmax/V
+	uint8_t * pixels; //row-major samples at the component's own resolution, padded to whole blocks
+	uint_fast32_t stride; //bytes per row of pixels
+	uint_fast32_t plane_rows; //rows of pixels, sample row y is stored at (y-plane_y0)%plane_rows
+	uint_fast32_t plane_x0; //first sample column and row held by the plane, not 0 when decoding a crop
+	uint_fast32_t plane_y0;
+	uint_fast32_t plane_width; //samples of a plane row that lie inside the picture
+	int16_t (* coefs)[64]; //keep_coefficients: quantized blocks of the MCU window instead of pixels, row by row
+	uint8_t * extents; //of each block of coefs
+	uint_fast32_t blocks_per_row;
+	quantization_table_t quant;
+} components_data_t;
+
+#define HUFF_LOOKAHEAD 9 //bits resolved by a single table lookup
+
+typedef struct
+{
+	uint_fast16_t nb_entries;
+	uint8_t bits[17]; //number of codes of each length, index 1..16
+	uint8_t huffval[256]; //symbols in order of increasing code length
+	int32_t maxcode[17]; //largest code of length k, -1 if none
+	int32_t valoffset[17]; //huffval index of the first code of length k minus that code
+	uint8_t look_nbits[1<<HUFF_LOOKAHEAD]; //code length for these leading bits, 0 if longer than HUFF_LOOKAHEAD
+	uint8_t look_sym[1<<HUFF_LOOKAHEAD];
+} huffman_table_t;
+
+//per-block and per-row kernels, picked once at startup by select_kernels()
+typedef struct
+{
+	char const * name;
+	void (*dequant_block)(int16_t const coefs[64], quantization_table_t const quant, int32_t outp[64]);
+	void (*idct_islow)(int32_t const inp[64], uint8_t outp[64]);
+	void (*color_convert_row)(uint8_t const * const Y, uint8_t const * const Cb, uint8_t const * const Cr, uint8_t * const rgb, const uint_fast32_t n);
+} kernels_t;
+
+//sampling factors of an interleaved scan that have MCU loops of their own, picked once per frame by
+//select_MCU_layout(). The others go through the generic loops
+typedef enum
+{
+	MCU_LAYOUT_GENERIC,
+	MCU_LAYOUT_GRAY, //one component
+	MCU_LAYOUT_444, //three components, all 1x1
+	MCU_LAYOUT_422, //2x1, 1x1, 1x1
+	MCU_LAYOUT_420 //2x2, 1x1, 1x1
+} MCU_layout_t;
+
+#ifdef JPEG_INSTRUMENT
+//counts of one bitstream, added to the picture's when it is done
+typedef struct
+{
+	uint_fast32_t start; //first byte of the data
+	uint64_t nb_MCUs;
+	uint64_t nb_blocks;
+	uint64_t nb_dc_only_blocks;
+	uint64_t nb_symbols;
+	uint64_t nb_stuffed_bytes;
+} entropy_counters_t;
+
+#define TRACE_MAX_EVENTS 4096
+
+typedef struct
+{
+	uint64_t start; //read_tsc
+	uint64_t end;
+	char const * name;
+	uint32_t arg;
+	uint32_t thread;
+	uint8_t span;
+} trace_event_t;
+
+//instrumentation of a picture, updated by all of its threads
+typedef struct
+{
+	atomic_uint_fast64_t nb_MCUs;
+	atomic_uint_fast64_t nb_blocks;
+	atomic_uint_fast64_t nb_dc_only_blocks;
+	atomic_uint_fast64_t nb_symbols;
+	atomic_uint_fast64_t nb_padding_bits;
+	atomic_uint_fast64_t nb_entropy_bytes;
+	atomic_uint_fast64_t nb_stuffed_bytes;
+	atomic_uint_fast64_t cycles[JPEG_NB_SPANS];
+	atomic_uint_fast32_t nb_events; //events past TRACE_MAX_EVENTS are dropped
+	uint64_t origin_tsc; //when the picture was opened, time 0 of the trace
+	struct timespec origin_time;
+	trace_event_t events[TRACE_MAX_EVENTS];
+} instrument_t;
+#endif
+
+//reader for one segment of entropy-coded data, removes stuffing and stops at the next marker
+typedef struct
+{
+	uint8_t const * data;
+	
+	uint_fast32_t end;
+	
+	uint_fast32_t pos; //next byte of data to load into bitbuf, stuffing included
+	
+	uint64_t bitbuf; //upcoming bits of the stream, MSB first, stuffing removed
+	
+	uint_fast8_t bits_in_buf;
+	
+	uint_fast16_t marker; //marker that ended the entropy-coded data, 0 while none was seen
+	
+	uint_fast32_t nb_fill_bytes; //1-bytes fed to bitbuf after that marker
+	
+	bool suspend; //end of data is not an error, more data may arrive later (streaming)
+	
+	bool starved; //end of data was reached without a marker, bitbuf holds 1-bytes instead of data
+	
+	decode_error_t * error; //of the thread reading this bitstream
+	
+#ifdef JPEG_INSTRUMENT
+	entropy_counters_t counters;
+#endif
+} bitstream_t;
+
+typedef struct
+{
+	uint8_t const * data; //the whole JPEG file, mapped or supplied by the caller, never written to
+	
+	uint_fast32_t filesize;
+	
+	void * mapping; //address to munmap, NULL if data belongs to the caller
+	
+	uint_fast32_t pos_in_file;	
+	
+	uint_fast16_t size_X;
+	uint_fast16_t size_Y;
+	
+	uint_fast8_t scale_denom; //1, 2, 4 or 8
+	
+	uint_fast8_t block_size; //samples per side of a decoded block, 8/scale_denom
+	
+	uint_fast16_t output_X; //size of the decoded picture, size_X and size_Y divided by scale_denom and rounded up
+	uint_fast16_t output_Y;
+	
+	uint_fast16_t requested_crop_X; //from the options, requested_crop_W 0 for the whole picture
+	uint_fast16_t requested_crop_Y;
+	uint_fast16_t requested_crop_W;
+	uint_fast16_t requested_crop_H;
+	
+	uint_fast16_t crop_X; //rectangle of the decoded picture handed out
+	uint_fast16_t crop_Y;
+	uint_fast16_t crop_W;
+	uint_fast16_t crop_H;
+	
+	uint_fast32_t MCU_X0; //window of MCUs that are reconstructed, columns MCU_X0..MCU_X1-1 of rows MCU_Y0..MCU_Y1-1.
+	uint_fast32_t MCU_X1; //MCUs outside it are only entropy-decoded, for the DC predictions
+	uint_fast32_t MCU_Y0;
+	uint_fast32_t MCU_Y1;
+	
+	uint_fast32_t window_width; //output samples per plane row at full resolution
+	
+	uint_fast8_t Hmax;
+	uint_fast8_t Vmax;
+	
+	uint_fast32_t MCUs_per_row;
+	
+	uint_fast32_t MCU_rows;
+	
+	uint_fast32_t nb_MCU_total;
+	
+	uint_fast32_t max_plane_MCU_rows; //0 to keep the whole picture, otherwise planes are a ring of MCU rows
+	
+	uint_fast32_t plane_MCU_rows;
+	
+	uint_fast32_t pos_compressed_pixeldata;
+	
+	uint_fast16_t restart_interval; //MCUs per restart interval, 0 if none
+	
+	uint_fast32_t nb_restart_intervals;
+	
+	uint_fast32_t * restart_offsets; //start of each interval's entropy-coded data in the file
+	
+	unsigned nb_threads;
+
+	uint_fast8_t nb_components;
+	
+	bool scan_decoded;
+	
+	bool keep_coefficients; //entropy decoding only, for lossless transforms
+	
+	bool headers_only; //probe: parsing stops at SOS, no sample planes are allocated
+	
+	bool progressive; //SOF2
+	
+	bool buffered; //progressive, or sequential with a scan per component: the scans fill the coefficient store,
+	               //samples are reconstructed after the last one
+	
+	uint_fast32_t coefs_MCU_X0; //MCU of the first block of the coefficient store
+	uint_fast32_t coefs_MCU_Y0;
+	
+	uint_fast8_t scan_nb_components; //components of the current scan, as frame component indexes
+	uint_fast8_t scan_components[4];
+	uint_fast8_t Ss; //spectral selection and successive approximation of the current scan
+	uint_fast8_t Se;
+	uint_fast8_t Ah;
+	uint_fast8_t Al;
+	uint_fast32_t scan_MCUs; //MCUs of the current scan, data units if it has a single component
+	uint_fast32_t nb_scans;
+	
+	void (* scan_done)(void * const arg); //called after each buffered scan, for previews
+	void * scan_done_arg;
+	
+	components_data_t components_data[4];
+	
+	huffman_table_t huff_tables[2][4]; //Tc (type=AC/DC), Th (destination identifier)
+	
+	quantization_table_t quant_tables[4];
+	
+	uint_fast8_t quant_tables_defined; //bit Tq set once DQT defined table Tq
+	
+	bool JFIF; //APP0 seen
+	int_fast8_t adobe_transform; //APP14 color transform, -1 without one
+	jpeg_color_space_t color_space; //known from the first scan on
+	
+	idct_method_t idct_method;
+	
+	upsampling_t upsampling;
+	
+	bool verbose;
+	
+	kernels_t kernels;
+	
+	MCU_layout_t MCU_layout;
+	
+	decode_error_t * error;
+	
+	arena_t arena; //buffers of the current picture
+	
+#ifdef JPEG_INSTRUMENT
+	instrument_t instrument;
+#endif
+} picture_t;
+
+//what the parser finds, with the verbose option
+__attribute__((format(printf, 2, 3)))
+static void log_info(picture_t const * const pic, char const * const format, ...)
+{
+	if(!pic->verbose)
+		return;
+	
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+#ifdef JPEG_INSTRUMENT
+static _Thread_local int trace_thread=-1;
+static atomic_uint trace_nb_threads;
+
+//small numbers for the trace, in the order the threads first record something
+static unsigned trace_thread_id(void)
+{
+	if(trace_thread<0)
+		trace_thread=atomic_fetch_add(&trace_nb_threads, 1);
+	return trace_thread;
+}
+
+static void instrument_reset(picture_t * const pic)
+{
+	instrument_t * const in=&pic->instrument;
+	uint_fast8_t i;
+	
+	atomic_store(&in->nb_MCUs, 0);
+	atomic_store(&in->nb_blocks, 0);
+	atomic_store(&in->nb_dc_only_blocks, 0);
+	atomic_store(&in->nb_symbols, 0);
+	atomic_store(&in->nb_padding_bits, 0);
+	atomic_store(&in->nb_entropy_bytes, 0);
+	atomic_store(&in->nb_stuffed_bytes, 0);
+	for(i=0; i<JPEG_NB_SPANS; i++)
+		atomic_store(&in->cycles[i], 0);
+	atomic_store(&in->nb_events, 0);
+	
+	clock_gettime(CLOCK_MONOTONIC, &in->origin_time);
+	in->origin_tsc=read_tsc();
+}
+
+//a span that began at read_tsc() start ends now. arg is shown with it in the trace
+static void span_end(picture_t * const pic, const jpeg_span_t span, char const * const name, const uint32_t arg, const uint64_t start)
+{
+	instrument_t * const in=&pic->instrument;
+	uint64_t const end=read_tsc();
+	
+	atomic_fetch_add(&in->cycles[span], end-start);
+	
+	uint_fast32_t const i=atomic_fetch_add(&in->nb_events, 1);
+	if(i>=TRACE_MAX_EVENTS)
+		return;
+	
+	in->events[i]=(trace_event_t){start, end, name, arg, trace_thread_id(), span};
+}
+
+//the counts of a bitstream that reached the end of its data
+static void bitstream_done(picture_t * const pic, bitstream_t const * const bs)
+{
+	instrument_t * const in=&pic->instrument;
+	
+	atomic_fetch_add(&in->nb_MCUs, bs->counters.nb_MCUs);
+	atomic_fetch_add(&in->nb_blocks, bs->counters.nb_blocks);
+	atomic_fetch_add(&in->nb_dc_only_blocks, bs->counters.nb_dc_only_blocks);
+	atomic_fetch_add(&in->nb_symbols, bs->counters.nb_symbols);
+	atomic_fetch_add(&in->nb_padding_bits, bs->bits_in_buf%8);
+	atomic_fetch_add(&in->nb_entropy_bytes, bs->pos-bs->counters.start);
+	atomic_fetch_add(&in->nb_stuffed_bytes, bs->counters.nb_stuffed_bytes);
+}
+#endif
+
+//zigzag index -> natural (row-major) index, padded so corrupt run lengths cannot write past a block
+static const uint8_t zigzag_to_natural[64+16]={	 0,  1,  8, 16,  9,  2,  3, 10,
+											17, 24, 32, 25, 18, 11,  4,  5,
+											12, 19, 26, 33, 40, 48, 41, 34,
+											27, 20, 13,  6,  7, 14, 21, 28,
+											35, 42, 49, 56, 57, 50, 43, 36,
+											29, 22, 15, 23, 30, 37, 44, 51,
+											58, 59, 52, 45, 38, 31, 39, 46,
+											53, 60, 61, 54, 47, 55, 62, 63,
+											63, 63, 63, 63, 63, 63, 63, 63,
+											63, 63, 63, 63, 63, 63, 63, 63	};
+
+//zigzag index -> size of the top-left square holding that coefficient, max(row,col)+1
+static const uint8_t zigzag_extent[64+16]={	1, 2, 2, 3, 2, 3, 4, 3,
+										3, 4, 5, 4, 3, 4, 5, 6,
+										5, 4, 4, 5, 6, 7, 6, 5,
+										4, 5, 6, 7, 8, 7, 6, 5,
+										5, 6, 7, 8, 8, 7, 6, 5,
+										6, 7, 8, 8, 7, 6, 6, 7,
+										8, 8, 7, 6, 7, 8, 8, 7,
+										7, 8, 8, 7, 8, 8, 8, 8,
+										8, 8, 8, 8, 8, 8, 8, 8,
+										8, 8, 8, 8, 8, 8, 8, 8	};
+
+//extent -> zigzag index past the last coefficient of the top-left extent x extent square
+static const uint8_t extent_zigzag_end[9]={1, 1, 5, 13, 25, 40, 52, 60, 64};
+
+static uint8_t get1i(uint8_t const * const data, uint_fast32_t * const pos)
+{
+	uint8_t val=data[*pos];
+	(*pos)++;
+	return val;
+}
+
+static uint16_t get2i(uint8_t const * const data, uint_fast32_t * const pos)
+{
+	uint16_t val=(data[*pos]<<8)|data[(*pos)+1];
+	(*pos)+=2;
+	return val;
+}
+
+static uint16_t get_marker(uint8_t const * const data, uint_fast32_t * const pos)
+{
+	return get2i(data, pos);
+}
+
+
+static uint_fast32_t ceil_to_multiple_of(const uint_fast32_t val, const uint_fast32_t multiple)
+{
+	return ((val+multiple-1)/multiple)*multiple;
+}
+
+//APPn (EXIF in APP1 among them) and COM segments this decoder has no use for
+static void skip_segment(picture_t * const pic, const uint16_t marker)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "marker 0x%04x (length %u bytes), skipping\n", marker, len);
+	if(len<2)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "marker 0x%04x: length %u", marker, len);
+	pic->pos_in_file+=len-2;
+}
+
+//Adobe: tells how the components of a 3 or 4 component picture are to be read
+static void parse_APP14(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "APP14 found (length %u bytes)\n", len);
+	
+	if(len<2)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "APP14: length %u", len);
+	
+	if(len>=14 && !memcmp(&pic->data[pic->pos_in_file], "Adobe", 5))
+	{
+		pic->adobe_transform=pic->data[pic->pos_in_file+11];
+		log_info(pic, "Adobe transform %u\n", pic->adobe_transform);
+	}
+	
+	pic->pos_in_file+=len-2;
+}
+
+//what the components are, as libjpeg guesses it: from the Adobe marker, then the JFIF marker or the identifiers
+static void set_color_space(picture_t * const pic)
+{
+	components_data_t const * const comp=pic->components_data;
+	
+	switch(pic->nb_components)
+	{
+		case 1:
+			pic->color_space=JPEG_COLOR_GRAY;
+			break;
+		case 3:
+			if(pic->adobe_transform>=0 && !pic->JFIF)
+				pic->color_space=pic->adobe_transform ? JPEG_COLOR_YCBCR : JPEG_COLOR_RGB;
+			else if(!pic->JFIF && comp[0].C=='R' && comp[1].C=='G' && comp[2].C=='B')
+				pic->color_space=JPEG_COLOR_RGB;
+			else
+				pic->color_space=JPEG_COLOR_YCBCR;
+			break;
+		case 4:
+			pic->color_space=pic->adobe_transform==2 ? JPEG_COLOR_YCCK : JPEG_COLOR_CMYK;
+			break;
+		default:
+			decode_fail(pic->error, JPEG_ERROR_UNSUPPORTED, "%u components, no known color space", pic->nb_components);
+	}
+	
+	log_info(pic, "color space %u\n", pic->color_space);
+}
+
+static void parse_APP0(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "APP0 found (length %u bytes)\n", len);
+	if(len<16)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "APP0: too short");
+	uint_fast32_t const end=pic->pos_in_file+len-2;
+	
+	uint8_t identifier[5];
+	memcpy(identifier, &pic->data[pic->pos_in_file], 5);
+	pic->pos_in_file+=5;
+	
+	uint_fast8_t version_major=get1i(pic->data, &(pic->pos_in_file));
+	uint_fast8_t version_minor=get1i(pic->data, &(pic->pos_in_file));
+	uint_fast8_t units=get1i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t Xdensity=get2i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t Ydensity=get2i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t Xthumbnail=get1i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t Ythumbnail=get1i(pic->data, &(pic->pos_in_file));
+	
+	if(memcmp(identifier, "JFIF\x00", 5))
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "APP0: invalid identifier");
+	pic->JFIF=true;
+	
+	log_info(pic, "version %u.%u\n", version_major, version_minor);
+	log_info(pic, "units %u\n", units);
+	log_info(pic, "density X %lu Y %lu\n", Xdensity, Ydensity);
+	
+	uint_fast32_t bytes_thumbnail=3*Xthumbnail*Ythumbnail;
+	
+	if(bytes_thumbnail>end-pic->pos_in_file)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "APP0: %lu x %lu thumbnail does not fit in the segment", Xthumbnail, Ythumbnail);
+	
+	if(bytes_thumbnail)
+		log_info(pic, "thumbnail %lu bytes, skipping\n", bytes_thumbnail);
+	else
+		log_info(pic, "no thumbnail\n");
+	pic->pos_in_file=end; //JFXX extensions are skipped too
+}
+
+static void parse_DQT(picture_t * const pic)
+{
+	uint16_t Lq=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "DQT found (length %u bytes)\n", Lq);
+	
+	if(Lq<2)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DQT: length %u", Lq);
+	uint_fast32_t const end=pic->pos_in_file+Lq-2;
+	
+	//any number of tables, a table redefined replaces the previous one
+	while(pic->pos_in_file<end)
+	{
+		uint8_t PqTq=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t Pq=(PqTq>>4)&0x0f;
+		uint8_t Tq=PqTq&0x0f;
+		log_info(pic, "Pq (element precision) %u -> %u bits\n", Pq, (Pq==0)?8:16);
+		log_info(pic, "Tq (table destination identifier) %u\n", Tq);
+		
+		if(Pq>1)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DQT: Pq %u>1", Pq);
+		if(Tq>3)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DQT: Tq %u>3", Tq);
+		if(end-pic->pos_in_file<64u*(1+Pq))
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DQT: table %u truncated", Tq);
+		
+		uint8_t k;
+		for(k=0; k<64; k++)
+		{
+			uint16_t Q=Pq ? get2i(pic->data, &(pic->pos_in_file)) : get1i(pic->data, &(pic->pos_in_file));
+			pic->quant_tables[Tq][zigzag_to_natural[k]]=Q;
+		}
+		pic->quant_tables_defined|=1<<Tq;
+	}
+	
+	if(pic->pos_in_file!=end)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DQT: length %u does not match the tables", Lq);
+	log_info(pic, "\n");
+}
+
+//MCUs needed for the crop rectangle (the whole picture if none was asked for). Fancy upsampling reads the chroma
+//samples next to the rectangle, so one more MCU is kept around it
+static void set_MCU_window(picture_t * const pic)
+{
+	pic->crop_X=pic->requested_crop_X;
+	pic->crop_Y=pic->requested_crop_Y;
+	pic->crop_W=pic->requested_crop_W;
+	pic->crop_H=pic->requested_crop_H;
+	
+	if(!pic->crop_W)
+	{
+		pic->crop_X=0;
+		pic->crop_Y=0;
+		pic->crop_W=pic->output_X;
+		pic->crop_H=pic->output_Y;
+	}
+	else if(pic->crop_X+pic->crop_W>pic->output_X || pic->crop_Y+pic->crop_H>pic->output_Y)
+		decode_fail(pic->error, JPEG_ERROR_ARGUMENT, "crop %lu x %lu at %lu,%lu outside the %lu x %lu picture", pic->crop_W, pic->crop_H, pic->crop_X, pic->crop_Y, pic->output_X, pic->output_Y);
+	
+	uint_fast32_t const MCU_width=pic->Hmax*pic->block_size;
+	uint_fast32_t const MCU_height=pic->Vmax*pic->block_size;
+	
+	pic->MCU_X0=pic->crop_X/MCU_width;
+	pic->MCU_X1=(pic->crop_X+pic->crop_W+MCU_width-1)/MCU_width;
+	pic->MCU_Y0=pic->crop_Y/MCU_height;
+	pic->MCU_Y1=(pic->crop_Y+pic->crop_H+MCU_height-1)/MCU_height;
+	
+	if(pic->upsampling==UPSAMPLE_FANCY && (pic->Hmax>1 || pic->Vmax>1))
+	{
+		if(pic->MCU_X0>0)
+			pic->MCU_X0--;
+		if(pic->MCU_X1<pic->MCUs_per_row)
+			pic->MCU_X1++;
+		if(pic->MCU_Y0>0)
+			pic->MCU_Y0--;
+		if(pic->MCU_Y1<pic->MCU_rows)
+			pic->MCU_Y1++;
+	}
+	
+	pic->window_width=pic->output_X-pic->MCU_X0*MCU_width;
+	if(pic->window_width>(pic->MCU_X1-pic->MCU_X0)*MCU_width)
+		pic->window_width=(pic->MCU_X1-pic->MCU_X0)*MCU_width;
+	
+	//a ring of MCU rows when streaming, which always decodes the whole picture
+	if(!pic->max_plane_MCU_rows)
+		pic->plane_MCU_rows=pic->MCU_Y1-pic->MCU_Y0;
+	
+	if(pic->crop_W!=pic->output_X || pic->crop_H!=pic->output_Y)
+		log_info(pic, "crop %lu x %lu at %lu,%lu: MCU columns %lu-%lu, rows %lu-%lu\n", pic->crop_W, pic->crop_H, pic->crop_X, pic->crop_Y, pic->MCU_X0, pic->MCU_X1-1, pic->MCU_Y0, pic->MCU_Y1-1);
+}
+
+//keep_coefficients: the blocks of the MCU window. Buffered scans need those of the whole picture: a refinement
+//scan reads the coefficients decoded so far, so every block has to be kept to stay in sync with the bitstream
+static void alloc_coefficient_store(picture_t * const pic)
+{
+	uint_fast32_t MCU_X1=pic->MCU_X1, MCU_Y1=pic->MCU_Y1;
+	pic->coefs_MCU_X0=pic->MCU_X0;
+	pic->coefs_MCU_Y0=pic->MCU_Y0;
+	if(pic->buffered)
+	{
+		pic->coefs_MCU_X0=0;
+		pic->coefs_MCU_Y0=0;
+		MCU_X1=pic->MCUs_per_row;
+		MCU_Y1=pic->MCU_rows;
+	}
+	
+	uint_fast8_t i;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		components_data_t * const comp=&pic->components_data[i];
+		
+		comp->blocks_per_row=(MCU_X1-pic->coefs_MCU_X0)*comp->H;
+		uint_fast32_t const nb_blocks=comp->blocks_per_row*(MCU_Y1-pic->coefs_MCU_Y0)*comp->V;
+		comp->coefs=arena_alloc(&pic->arena, nb_blocks*sizeof(*comp->coefs), pic->error);
+		comp->extents=arena_alloc(&pic->arena, nb_blocks, pic->error);
+		log_info(pic, "component %u (%s) %lu blocks of coefficients\n", i, comp_names[i], nb_blocks);
+		
+		//scans only add to the coefficients, and a component may have no scan at all
+		if(pic->buffered)
+		{
+			memset(comp->coefs, 0, nb_blocks*sizeof(*comp->coefs));
+			memset(comp->extents, 1, nb_blocks);
+		}
+	}
+}
+
+static const char * const MCU_layout_names[5]={"generic", "gray", "4:4:4", "4:2:2", "4:2:0"};
+
+static void select_MCU_layout(picture_t * const pic)
+{
+	components_data_t const * const comps=pic->components_data;
+	
+	pic->MCU_layout=MCU_LAYOUT_GENERIC;
+	if(pic->nb_components==1)
+		pic->MCU_layout=MCU_LAYOUT_GRAY;
+	else if(pic->nb_components==3 && comps[1].H==1 && comps[1].V==1 && comps[2].H==1 && comps[2].V==1)
+	{
+		if(comps[0].H==1 && comps[0].V==1)
+			pic->MCU_layout=MCU_LAYOUT_444;
+		else if(comps[0].H==2 && comps[0].V==1)
+			pic->MCU_layout=MCU_LAYOUT_422;
+		else if(comps[0].H==2 && comps[0].V==2)
+			pic->MCU_layout=MCU_LAYOUT_420;
+	}
+	
+	//JPEG_MCU_LAYOUT=generic sends every frame through the generic loops, to compare them with the others (for testing)
+	char const * const force=getenv("JPEG_MCU_LAYOUT");
+	if(force && !strcmp(force, "generic"))
+		pic->MCU_layout=MCU_LAYOUT_GENERIC;
+	
+	log_info(pic, "MCU layout %s\n", MCU_layout_names[pic->MCU_layout]);
+}
+
+static void parse_SOF0(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "SOF%u found (length %u bytes)\n", pic->progressive ? 2 : 0, len);
+	
+	if(pic->nb_components)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF: second frame header");
+	
+	pic->buffered=pic->progressive;
+	
+	if(len<8)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF0: length %u", len);
+	
+	uint_fast8_t P=get1i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t Y=get2i(pic->data, &(pic->pos_in_file));
+	uint_fast16_t X=get2i(pic->data, &(pic->pos_in_file));
+	uint_fast8_t Nf=get1i(pic->data, &(pic->pos_in_file));
+	
+	if(P!=8)
+		decode_fail(pic->error, JPEG_ERROR_UNSUPPORTED, "SOF0: P!=8 unsupported");
+	
+	if(Y==0)
+		decode_fail(pic->error, JPEG_ERROR_UNSUPPORTED, "SOF0: Y==0 unsupported");
+	
+	log_info(pic, "P %u (must be 8)\n", P);
+	log_info(pic, "imagesize X %lu Y %lu\n", X, Y);
+	log_info(pic, "Nf (number of components) %u\n", Nf);
+	
+	if(Nf<1 || Nf>4)
+		decode_fail(pic->error, JPEG_ERROR_UNSUPPORTED, "SOF0: %u components, 1 to 4 are supported", Nf);
+	if(len!=8+3*Nf)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF0: length %u for %u components", len, Nf);
+	
+	pic->size_X=X;
+	pic->size_Y=Y;
+	
+	uint_fast8_t i;
+	for(i=0; i<Nf; i++)
+	{
+		uint8_t C=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t HV=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t H=(HV>>4)&0x0f;
+		uint8_t V=HV&0x0f;
+		uint8_t Tq=get1i(pic->data, &(pic->pos_in_file));
+		
+		if(H<1 || H>4 || V<1 || V>4)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF0: component %u: H %u V %u out of range", i, H, V);
+		if(Tq>3)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF0: component %u: Tq %u>3", i, Tq);
+		
+		uint_fast8_t j;
+		for(j=0; j<i; j++)
+			if(pic->components_data[j].C==C)
+				decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOF0: component identifier %u used twice", C);
+		
+		//the scan of a single component is not interleaved, its MCU is one block whatever H and V say (A.2.2)
+		if(Nf==1)
+			H=V=1;
+		
+		pic->components_data[i].C=C;
+		pic->components_data[i].H=H;
+		pic->components_data[i].V=V;
+		pic->components_data[i].Tq=Tq;
+		pic->components_data[i].quant_latched=false;
+		
+		log_info(pic, "component %u (%s) C %u, H %u, V %u, Tq %u\n", i, comp_names[i], C, H, V, Tq);
+	}
+	
+	pic->nb_components=Nf;
+	
+	uint_fast8_t Hmax=0,Vmax=0;
+
+	for(i=0; i<pic->nb_components; i++)
+	{
+		if(pic->components_data[i].H>Hmax)
+			Hmax=pic->components_data[i].H;
+		if(pic->components_data[i].V>Vmax)
+			Vmax=pic->components_data[i].V;
+	}
+	
+	pic->Hmax=Hmax;
+	pic->Vmax=Vmax;
+	
+	select_MCU_layout(pic);
+	
+	pic->MCUs_per_row=ceil_to_multiple_of(pic->size_X, 8*Hmax)/(8*Hmax);
+	pic->MCU_rows=ceil_to_multiple_of(pic->size_Y, 8*Vmax)/(8*Vmax);
+	pic->nb_MCU_total=pic->MCUs_per_row*pic->MCU_rows;
+	
+	pic->plane_MCU_rows=pic->MCU_rows;
+	if(pic->max_plane_MCU_rows && pic->max_plane_MCU_rows<pic->MCU_rows)
+		pic->plane_MCU_rows=pic->max_plane_MCU_rows;
+	
+	//scaled decoding: blocks are decoded to block_size x block_size samples, every plane shrinks by scale_denom
+	uint_fast8_t const scale=pic->scale_denom;
+	pic->block_size=8/scale;
+	pic->output_X=(pic->size_X+scale-1)/scale;
+	pic->output_Y=(pic->size_Y+scale-1)/scale;
+	
+	log_info(pic, "Hmax %u Vmax %u\n", Hmax, Vmax);
+	log_info(pic, "MCU_total %lu\n", pic->nb_MCU_total);
+	if(scale>1)
+		log_info(pic, "scaled 1/%u to %lu x %lu\n", scale, pic->output_X, pic->output_Y);
+	
+	if(pic->headers_only)
+		return;
+	
+	set_MCU_window(pic);
+	
+	if(pic->keep_coefficients || pic->buffered)
+		alloc_coefficient_store(pic);
+	
+	uint16_t xi,yi;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		components_data_t * const comp=&pic->components_data[i];
+		
+		xi=(pic->size_X*comp->H+Hmax*scale-1)/(Hmax*scale);
+		yi=(pic->size_Y*comp->V+Vmax*scale-1)/(Vmax*scale);
+		
+		comp->xi=xi;
+		comp->yi=yi;
+		comp->zoomX=Hmax/comp->H;
+		comp->zoomY=Vmax/comp->V;
+		
+		log_info(pic, "component %u (%s) xi %u yi %u\n", i, comp_names[i], xi, yi);
+		
+		//whole MCUs are stored, so no bounds checks are needed while storing blocks
+		comp->stride=(pic->MCU_X1-pic->MCU_X0)*comp->H*pic->block_size;
+		comp->plane_rows=pic->plane_MCU_rows*comp->V*pic->block_size;
+		comp->plane_x0=pic->MCU_X0*comp->H*pic->block_size;
+		comp->plane_y0=pic->MCU_Y0*comp->V*pic->block_size;
+		comp->plane_width=xi-comp->plane_x0;
+		if(comp->plane_width>comp->stride)
+			comp->plane_width=comp->stride;
+		uint_fast32_t const plane_size=comp->stride*comp->plane_rows;
+		
+		if(pic->keep_coefficients)
+			continue;
+		
+		comp->pixels=arena_alloc(&pic->arena, plane_size, pic->error);
+		
+		log_info(pic, "component %u (%s) %lu bytes of pixels\n", i, comp_names[i], plane_size);
+	}
+}
+
+static void huff_build_lookup(huffman_table_t * const table)
+{
+	uint_fast8_t l;
+	uint_fast16_t i;
+	int32_t code=0;
+	int32_t k=0;
+	
+	//canonical codes: maxcode/valoffset for the slow path
+	for(l=1; l<=16; l++)
+	{
+		if(table->bits[l])
+		{
+			table->valoffset[l]=k-code;
+			code+=table->bits[l];
+			k+=table->bits[l];
+			table->maxcode[l]=code-1;
+		}
+		else
+			table->maxcode[l]=-1;
+		code<<=1;
+	}
+	
+	//every HUFF_LOOKAHEAD-bit pattern starting with a short code maps directly to it
+	memset(table->look_nbits, 0, sizeof(table->look_nbits));
+	
+	code=0;
+	k=0;
+	for(l=1; l<=HUFF_LOOKAHEAD; l++)
+	{
+		for(i=0; i<table->bits[l]; i++, k++)
+		{
+			uint_fast16_t lookbits=code<<(HUFF_LOOKAHEAD-l);
+			uint_fast16_t ctr;
+			for(ctr=1<<(HUFF_LOOKAHEAD-l); ctr>0; ctr--, lookbits++)
+			{
+				table->look_nbits[lookbits]=l;
+				table->look_sym[lookbits]=table->huffval[k];
+			}
+			code++;
+		}
+		code<<=1;
+	}
+}
+
+static void parse_DHT(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "DHT found (length %u bytes)\n", len);
+	
+	if(len<2)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: length %u", len);
+	uint_fast32_t const end=pic->pos_in_file+len-2;
+	
+	//any number of tables, a table redefined replaces the previous one
+	while(pic->pos_in_file<end)
+	{
+		if(end-pic->pos_in_file<17)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: table header truncated");
+		
+		uint8_t TcTh=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t Tc=(TcTh>>4)&0x0f;
+		uint8_t Th=TcTh&0x0f;
+		
+		log_info(pic, "Tc %u (%s table)\n", Tc, (Tc==0)?"DC":"AC");
+		log_info(pic, "Th (table destination identifier) %u\n", Th);
+		
+		if(Tc>1 || Th>3)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: Tc %u Th %u", Tc, Th);
+		
+		uint8_t L[16];
+		uint_fast16_t mt=0;
+		uint_fast32_t codes=1; //code space left, in units of codes of the current length
+		uint8_t i;
+		for(i=0; i<16; i++)
+		{
+			L[i]=get1i(pic->data, &(pic->pos_in_file));
+			mt+=L[i];
+			
+			codes*=2;
+			if(L[i]>codes)
+				decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: more codes of length %u than fit", i+1);
+			codes-=L[i];
+		}
+		
+		log_info(pic, "total %lu codes\n", mt);
+		
+		if(mt>256 || end-pic->pos_in_file<mt)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: %lu codes", mt);
+		
+		huffman_table_t * const table=&pic->huff_tables[Tc][Th];
+		
+		table->bits[0]=0;
+		for(i=0; i<16; i++)
+			table->bits[i+1]=L[i];
+		
+		uint_fast16_t k;
+		for(k=0; k<mt; k++)
+			table->huffval[k]=get1i(pic->data, &(pic->pos_in_file));
+		
+		table->nb_entries=mt;
+		
+		huff_build_lookup(table);
+	}
+	
+	if(pic->pos_in_file!=end)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DHT: length %u does not match the tables", len);
+}
+
+static void parse_DRI(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "DRI found (length %u bytes)\n", len);
+	
+	if(len!=4)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "DRI: length!=4");
+	
+	pic->restart_interval=get2i(pic->data, &(pic->pos_in_file));
+	
+	log_info(pic, "Ri (restart interval) %lu MCU\n", pic->restart_interval);
+}
+
+static void parse_SOS(picture_t * const pic)
+{
+	uint16_t len=get2i(pic->data, &(pic->pos_in_file)); //without actual bitmap data
+	log_info(pic, "SOS found (length %u bytes)\n", len);
+	
+	if(len<3)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: length %u", len);
+	
+	uint8_t Ns=get1i(pic->data, &(pic->pos_in_file));
+	log_info(pic, "Ns %u\n", Ns);
+	
+	if(!pic->nb_components)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS before SOF0");
+	if(Ns<1 || Ns>pic->nb_components)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: %u components in the scan, the frame has %u", Ns, pic->nb_components);
+	if(len!=6+2*Ns)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: length %u for %u components", len, Ns);
+	
+	//scan components are frame components in frame order, found by their identifier
+	uint8_t j;
+	uint_fast8_t next_component=0;
+	for(j=0; j<Ns; j++)
+	{
+		uint8_t Cs=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t TdTa=get1i(pic->data, &(pic->pos_in_file));
+		uint8_t Td=(TdTa>>4)&0x0f;
+		uint8_t Ta=TdTa&0x0f;
+		
+		while(next_component<pic->nb_components && pic->components_data[next_component].C!=Cs)
+			next_component++;
+		if(next_component==pic->nb_components)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: component Cs %u is not in the frame, or out of order", Cs);
+		
+		log_info(pic, "component %u (%s) Cs %u Td %u Ta %u\n", next_component, comp_names[next_component], Cs, Td, Ta);
+		if(Td>3 || Ta>3)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: Td %u Ta %u", Td, Ta);
+		pic->components_data[next_component].Td=Td; //DC
+		pic->components_data[next_component].Ta=Ta; //AC
+		pic->scan_components[j]=next_component++;
+	}
+	pic->scan_nb_components=Ns;
+	
+	uint8_t Ss=get1i(pic->data, &(pic->pos_in_file));
+	uint8_t Se=get1i(pic->data, &(pic->pos_in_file));
+	uint8_t AhAl=get1i(pic->data, &(pic->pos_in_file));
+	uint8_t Ah=(AhAl>>4)&0x0f;
+	uint8_t Al=AhAl&0x0f;
+	
+	log_info(pic, "Ss %u Se %u Ah %u Al %u\n", Ss, Se, Ah, Al);
+	
+	if(!pic->progressive)
+	{
+		if(Ss!=0 || Se!=63 || Ah!=0 || Al!=0)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: Ss %u Se %u Ah %u Al %u in a sequential scan", Ss, Se, Ah, Al);
+	}
+	else
+	{
+		//DC scans may interleave components, AC scans have a single one. A refinement adds one bit (G.1.1.1)
+		if(Ss==0 ? Se!=0 : (Se<Ss || Se>63 || Ns!=1))
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: spectral selection %u..%u with %u components", Ss, Se, Ns);
+		if(Al>13 || (Ah && Al!=Ah-1))
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: successive approximation Ah %u Al %u", Ah, Al);
+	}
+	
+	pic->Ss=Ss;
+	pic->Se=Se;
+	pic->Ah=Ah;
+	pic->Al=Al;
+	
+	//the tables this scan decodes with. DC refinement reads raw bits only
+	for(j=0; j<Ns; j++)
+	{
+		components_data_t const * const comp=&pic->components_data[pic->scan_components[j]];
+		
+		if(Ss==0 && Ah==0 && !pic->huff_tables[0][comp->Td].nb_entries)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: component %u uses DC Huffman table %u, which was not defined", pic->scan_components[j], comp->Td);
+		if(Se>0 && !pic->huff_tables[1][comp->Ta].nb_entries)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: component %u uses AC Huffman table %u, which was not defined", pic->scan_components[j], comp->Ta);
+		if(!(pic->quant_tables_defined&(1<<comp->Tq)))
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: component %u uses quantization table %u, which was not defined", pic->scan_components[j], comp->Tq);
+	}
+	
+	//a component keeps the quantization table of its first scan, a DQT after it is for other components (as libjpeg)
+	for(j=0; j<Ns; j++)
+	{
+		components_data_t * const comp=&pic->components_data[pic->scan_components[j]];
+		
+		if(!comp->quant_latched)
+		{
+			memcpy(comp->quant, pic->quant_tables[comp->Tq], sizeof(comp->quant));
+			comp->quant_latched=true;
+		}
+	}
+	
+	//sequential scans of some of the components: the picture is complete only after the last one
+	if(!pic->progressive && Ns<pic->nb_components && !pic->buffered)
+	{
+		if(pic->scan_decoded)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "SOS: scan of %u components after one of all %u", Ns, pic->nb_components);
+		pic->buffered=true;
+		if(!pic->headers_only)
+			alloc_coefficient_store(pic);
+	}
+	
+	if(!pic->pos_compressed_pixeldata)
+		set_color_space(pic);
+	
+	//a scan of one component covers its own blocks only, not those padding the MCUs (A.2.2)
+	if(Ns==1)
+	{
+		components_data_t const * const comp=&pic->components_data[pic->scan_components[0]];
+		uint_fast32_t const blocks_X=(pic->size_X*comp->H+8*pic->Hmax-1)/(8*pic->Hmax);
+		uint_fast32_t const blocks_Y=(pic->size_Y*comp->V+8*pic->Vmax-1)/(8*pic->Vmax);
+		pic->scan_MCUs=blocks_X*blocks_Y;
+	}
+	else
+		pic->scan_MCUs=pic->nb_MCU_total;
+	
+	pic->pos_compressed_pixeldata=pic->pos_in_file;
+	
+	log_info(pic, "compressed pixeldata starts at pos %lu\n\n", pic->pos_compressed_pixeldata);
+}
+
+static int16_t convert_to_neg(uint16_t bits, const uint8_t sz)
+{
+	int16_t ret=-((bits^0xFFFF)&((1<<sz)-1));
+	return ret;
+}
+
+
+static void bitstream_init(bitstream_t * const bs, uint8_t const * const data, const uint_fast32_t start, const uint_fast32_t end, decode_error_t * const error)
+{
+	bs->data=data;
+	bs->end=end;
+	bs->pos=start;
+	bs->bitbuf=0;
+	bs->bits_in_buf=0;
+	bs->marker=0;
+	bs->nb_fill_bytes=0;
+	bs->suspend=false;
+	bs->starved=false;
+	bs->error=error;
+	INSTRUMENT(memset(&bs->counters, 0, sizeof(bs->counters)); bs->counters.start=start;)
+}
+
+static void bitstream_refill(bitstream_t * const bs)
+{
+	//fast path: load 8 bytes at once and keep as many whole bytes as fit, unless one of them is 0xFF
+	if(bs->pos+8<=bs->end)
+	{
+		uint8_t const * const p=&bs->data[bs->pos];
+		uint64_t word=((uint64_t)p[0]<<56)|((uint64_t)p[1]<<48)|((uint64_t)p[2]<<40)|((uint64_t)p[3]<<32)|
+						((uint64_t)p[4]<<24)|((uint64_t)p[5]<<16)|((uint64_t)p[6]<<8)|(uint64_t)p[7];
+		
+		if(!(((~word)-0x0101010101010101ULL)&word&0x8080808080808080ULL))
+		{
+			uint_fast8_t nb_bytes=(63-bs->bits_in_buf)>>3;
+			
+			//bits below the last whole byte are the correct upcoming bits, the next refill ORs the same values in again
+			bs->bitbuf|=word>>bs->bits_in_buf;
+			bs->pos+=nb_bytes;
+			bs->bits_in_buf+=8*nb_bytes;
+			return;
+		}
+	}
+	
+	//byte by byte: remove stuffing, stop at a marker and feed 1-bits (like padding) after it
+	while(bs->bits_in_buf<=56)
+	{
+		uint8_t byte=0xFF;
+		
+		if(!bs->marker && !bs->starved && bs->pos+1>=bs->end)
+		{
+			if(!bs->suspend)
+				decode_fail(bs->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+			bs->starved=true;
+		}
+		
+		if(!bs->marker && !bs->starved)
+		{
+			byte=bs->data[bs->pos];
+			if(byte==0xFF)
+			{
+				uint8_t byte2=bs->data[bs->pos+1];
+				if(byte2==0x00)
+				{
+					bs->pos+=2;
+					INSTRUMENT(bs->counters.nb_stuffed_bytes++;)
+				}
+				else
+					bs->marker=(byte<<8)|byte2;
+			}
+			else
+				bs->pos++;
+		}
+		
+		if(bs->marker || bs->starved)
+			bs->nb_fill_bytes++;
+		
+		bs->bitbuf|=(uint64_t)byte<<(56-bs->bits_in_buf);
+		bs->bits_in_buf+=8;
+	}
+}
+
+//bits of actual data left in bitbuf, negative once fill bits after a marker were consumed
+static int_fast32_t bitstream_bits_left(bitstream_t const * const bs)
+{
+	return (int_fast32_t)bs->bits_in_buf-8*(int_fast32_t)bs->nb_fill_bytes;
+}
+
+//after the last MCU: position of the marker following the entropy-coded data, false if it is not in the data yet
+static bool bitstream_find_marker(bitstream_t const * const bs, uint_fast32_t * const marker_pos)
+{
+	uint_fast32_t pos=bs->pos;
+	
+	if(!bs->marker)
+	{
+		while(pos+1<bs->end && !(bs->data[pos]==0xFF && bs->data[pos+1]!=0x00))
+			pos++;
+		
+		if(pos+1>=bs->end)
+			return false;
+	}
+	
+	*marker_pos=pos;
+	return true;
+}
+
+static uint_fast32_t bitstream_skip_to_marker(bitstream_t const * const bs)
+{
+	uint_fast32_t pos;
+	
+	if(!bitstream_find_marker(bs, &pos))
+		decode_fail(bs->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+	
+	return pos;
+}
+
+static uint16_t bitstream_peek_bits(bitstream_t * const bs, const uint_fast8_t nb_bits)
+{
+	if(nb_bits>16)
+		decode_fail(bs->error, JPEG_ERROR_CORRUPT, "bitstream_peek_bits: >16 bits requested");
+	
+	if(bs->bits_in_buf<nb_bits)
+		bitstream_refill(bs);
+	
+	return (nb_bits==0)?0:(uint16_t)(bs->bitbuf>>(64-nb_bits));
+}
+
+static void bitstream_remove_bits(bitstream_t * const bs, const uint_fast8_t nb_bits)
+{
+	bs->bitbuf<<=nb_bits;
+	bs->bits_in_buf-=nb_bits;
+}
+
+static uint16_t bitstream_get_bits(bitstream_t * const bs, const uint_fast8_t nb_bits)
+{
+	uint16_t ret=bitstream_peek_bits(bs, nb_bits);
+	bitstream_remove_bits(bs, nb_bits);
+	return ret;
+}
+
+//read a SSSS-bit magnitude and sign-extend it (F.2.2.1 EXTEND)
+static int16_t bitstream_get_extended(bitstream_t * const bs, const uint_fast8_t SSSS)
+{
+	if(!SSSS)
+		return 0;
+	
+	uint16_t bits=bitstream_get_bits(bs, SSSS);
+	
+	if(bits&(1<<(SSSS-1)))
+		return bits;
+	else
+		return convert_to_neg(bits, SSSS);
+}
+
+
+static bool bitstream_get_next_decoded_element(bitstream_t * const bs, huffman_table_t const * const table, uint8_t * const decoded, uint_fast8_t * const nb_bits)
+{	
+	while(true)
+	{
+		if(bs->bits_in_buf<16)
+			bitstream_refill(bs);
+		
+		if(bitstream_bits_left(bs)<=0)
+			break;
+		
+		//fast path: short codes are resolved with one lookup
+		uint16_t look=bs->bitbuf>>(64-HUFF_LOOKAHEAD);
+		
+		*nb_bits=table->look_nbits[look];
+		
+		if(*nb_bits)
+			(*decoded)=table->look_sym[look];
+		else
+		{
+			//slow path: extend the code bit by bit until it fits a code length
+			int32_t code=0;
+			for(*nb_bits=HUFF_LOOKAHEAD+1; *nb_bits<=16; (*nb_bits)++)
+			{
+				code=bs->bitbuf>>(64-*nb_bits);
+				if(code<=table->maxcode[*nb_bits])
+					break;
+			}
+			
+			if(*nb_bits>16)
+			{
+				//check if it's padding, else error
+				if((bs->bitbuf>>48)==0xFFFF)
+				{
+					bitstream_remove_bits(bs, 16);
+					continue;
+				}
+				if(bs->starved) //1-bytes past the end of the data so far
+					break;
+				decode_fail(bs->error, JPEG_ERROR_CORRUPT, "unknown code in bitstream before pos %lu bits 0x%04x", bs->pos, (unsigned)(bs->bitbuf>>48));
+			}
+			
+			(*decoded)=table->huffval[table->valoffset[*nb_bits]+code];
+		}
+		
+		if(bitstream_bits_left(bs)<*nb_bits)
+		{
+			if(bs->starved)
+				break;
+			decode_fail(bs->error, JPEG_ERROR_CORRUPT, "end of stream, requested to many bits");
+		}
+		
+		bitstream_remove_bits(bs, *nb_bits);
+		INSTRUMENT(bs->counters.nb_symbols++;)
+		return true;
+	}
+
+	return false;
+}
+
+
+//data holds block_size rows of block_size samples
+static void store_data_unit_YCbCr(picture_t * const pic, const uint_fast32_t MCU, const uint_fast8_t component, const uint_fast8_t data_unit, uint8_t const data[64])
+{
+	components_data_t const * const comp=&pic->components_data[component];
+	uint_fast8_t const n=pic->block_size;
+	
+	uint_fast32_t const blockX=(MCU%pic->MCUs_per_row-pic->MCU_X0)*comp->H+data_unit%comp->H;
+	uint_fast32_t const blockY=((MCU/pic->MCUs_per_row-pic->MCU_Y0)%pic->plane_MCU_rows)*comp->V+data_unit/comp->H;
+	
+	uint8_t * dst=&comp->pixels[n*blockY*comp->stride+n*blockX];
+	uint_fast8_t y;
+	
+	if(n==8)
+	{
+		for(y=0; y<8; y++, dst+=comp->stride)
+			memcpy(dst, &data[y*8], 8);
+		return;
+	}
+	
+	for(y=0; y<n; y++, dst+=comp->stride)
+		memcpy(dst, &data[y*n], n);
+}
+
+
+//An 8 bit picture's DCT coefficients are at most 1024, rounding to a multiple of an 8 bit quantizer adds at most 127.
+//Anything larger comes from corrupt data and is clamped, which keeps every integer IDCT within 32 bits
+#define DEQUANT_LIMIT 1151
+
+static inline int32_t dequant_coef(const int16_t coef, const uint16_t quant)
+{
+	int32_t const v=(int32_t)coef*quant;
+	if(v>DEQUANT_LIMIT)
+		return DEQUANT_LIMIT;
+	if(v<-DEQUANT_LIMIT)
+		return -DEQUANT_LIMIT;
+	return v;
+}
+
+static void dequant_block(int16_t const coefs[64], quantization_table_t const quant, int32_t outp[64])
+{
+	uint_fast8_t i;
+	
+	for(i=0; i<64; i++)
+		outp[i]=dequant_coef(coefs[i], quant[i]);
+}
+
+static uint8_t clamp_int(const int32_t v)
+{
+	if(v<0)
+		return 0;
+	if(v>255)
+		return 255;
+	
+	return (uint8_t)v;
+}
+
+#define a_c 0.9807
+#define b_c 0.8314
+#define c_c 0.5555
+#define d_c 0.1950
+#define e_c 0.9238
+#define f_c 0.3826
+#define g_c 0.7071
+
+
+static float tab_coefs[8][8] = {{0.7071,  a_c,  e_c,  b_c,  g_c,  c_c,  f_c,  d_c},
+                                {0.7071,  b_c,  f_c, -d_c, -g_c, -a_c, -e_c, -c_c},
+                                {0.7071,  c_c, -f_c, -a_c, -g_c,  d_c,  e_c,  b_c},
+                                {0.7071,  d_c, -e_c, -c_c,  g_c,  b_c, -f_c, -a_c},
+                                {0.7071, -d_c, -e_c,  c_c,  g_c, -b_c, -f_c,  a_c},
+                                {0.7071, -c_c, -f_c,  a_c, -g_c, -d_c,  e_c, -b_c},
+                                {0.7071, -b_c,  f_c,  d_c, -g_c,  a_c, -e_c,  c_c},
+                                {0.7071, -a_c,  e_c, -b_c,  g_c, -c_c,  f_c, -d_c}};
+
+
+static void data_unit_do_idct_float(int32_t const inp[64], uint8_t outp[64])
+{
+    double rxy=0;
+  
+    uint_fast8_t x, y;
+    uint_fast8_t u, v;
+        
+    for(y=0; y<8; y++)
+    {
+        for(x=0; x<8; x++)
+        {
+        rxy=0;
+
+        for(u=0; u<=7; u++)
+        {
+            for(v=0; v<=7; v++)
+            {
+            double Svu=inp[v*8+u];
+
+            rxy+= Svu*tab_coefs[x][u]*tab_coefs[y][v];
+            }
+        }
+                
+        rxy*=0.25;
+        rxy+=128;
+
+        outp[y*8+x]=clamp_int((int32_t)lround(rxy));
+        }
+    }
+}
+
+//fixed point helpers shared by the integer IDCTs
+#define DESCALE(x,n) (((x)+((int32_t)1<<((n)-1)))>>(n))
+#define LEFT_SHIFT(x,n) ((int32_t)((uint32_t)(x)<<(n))) //through unsigned, shifting a negative value left is undefined
+
+//accurate integer IDCT (Loeffler-Ligtenberg-Moschytz, as libjpeg's jidctint.c): 13 bit constants, 2 extra bits between passes
+#define ISLOW_CONST_BITS 13
+#define ISLOW_PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+static void data_unit_do_idct_islow(int32_t const inp[64], uint8_t outp[64])
+{
+	int32_t ws[8][8];
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	uint_fast8_t x, y;
+	
+	//pass 1: columns, inp[v*8+u] -> ws[y][u]
+	for(x=0; x<8; x++)
+	{
+		if(inp[1*8+x]==0 && inp[2*8+x]==0 && inp[3*8+x]==0 && inp[4*8+x]==0 && inp[5*8+x]==0 && inp[6*8+x]==0 && inp[7*8+x]==0)
+		{
+			int32_t dcval=LEFT_SHIFT(inp[0*8+x], ISLOW_PASS1_BITS);
+			for(y=0; y<8; y++)
+				ws[y][x]=dcval;
+			continue;
+		}
+		
+		//even part
+		z2=inp[2*8+x];
+		z3=inp[6*8+x];
+		z1=(z2+z3)*FIX_0_541196100;
+		tmp2=z1-z3*FIX_1_847759065;
+		tmp3=z1+z2*FIX_0_765366865;
+		
+		z2=inp[0*8+x];
+		z3=inp[4*8+x];
+		tmp0=LEFT_SHIFT(z2+z3, ISLOW_CONST_BITS);
+		tmp1=LEFT_SHIFT(z2-z3, ISLOW_CONST_BITS);
+		
+		tmp10=tmp0+tmp3;
+		tmp13=tmp0-tmp3;
+		tmp11=tmp1+tmp2;
+		tmp12=tmp1-tmp2;
+		
+		//odd part
+		tmp0=inp[7*8+x];
+		tmp1=inp[5*8+x];
+		tmp2=inp[3*8+x];
+		tmp3=inp[1*8+x];
+		
+		z1=tmp0+tmp3;
+		z2=tmp1+tmp2;
+		z3=tmp0+tmp2;
+		z4=tmp1+tmp3;
+		z5=(z3+z4)*FIX_1_175875602;
+		
+		tmp0*=FIX_0_298631336;
+		tmp1*=FIX_2_053119869;
+		tmp2*=FIX_3_072711026;
+		tmp3*=FIX_1_501321110;
+		z1*=-FIX_0_899976223;
+		z2*=-FIX_2_562915447;
+		z3=z3*-FIX_1_961570560+z5;
+		z4=z4*-FIX_0_390180644+z5;
+		
+		tmp0+=z1+z3;
+		tmp1+=z2+z4;
+		tmp2+=z2+z3;
+		tmp3+=z1+z4;
+		
+		ws[0][x]=DESCALE(tmp10+tmp3, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[7][x]=DESCALE(tmp10-tmp3, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[1][x]=DESCALE(tmp11+tmp2, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[6][x]=DESCALE(tmp11-tmp2, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[2][x]=DESCALE(tmp12+tmp1, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[5][x]=DESCALE(tmp12-tmp1, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[3][x]=DESCALE(tmp13+tmp0, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[4][x]=DESCALE(tmp13-tmp0, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+	}
+	
+	//pass 2: rows, ws[y][u] -> outp[y*8+x]
+	for(y=0; y<8; y++)
+	{
+		int32_t const * const w=ws[y];
+		
+		z2=w[2];
+		z3=w[6];
+		z1=(z2+z3)*FIX_0_541196100;
+		tmp2=z1-z3*FIX_1_847759065;
+		tmp3=z1+z2*FIX_0_765366865;
+		
+		tmp0=LEFT_SHIFT(w[0]+w[4], ISLOW_CONST_BITS);
+		tmp1=LEFT_SHIFT(w[0]-w[4], ISLOW_CONST_BITS);
+		
+		tmp10=tmp0+tmp3;
+		tmp13=tmp0-tmp3;
+		tmp11=tmp1+tmp2;
+		tmp12=tmp1-tmp2;
+		
+		tmp0=w[7];
+		tmp1=w[5];
+		tmp2=w[3];
+		tmp3=w[1];
+		
+		z1=tmp0+tmp3;
+		z2=tmp1+tmp2;
+		z3=tmp0+tmp2;
+		z4=tmp1+tmp3;
+		z5=(z3+z4)*FIX_1_175875602;
+		
+		tmp0*=FIX_0_298631336;
+		tmp1*=FIX_2_053119869;
+		tmp2*=FIX_3_072711026;
+		tmp3*=FIX_1_501321110;
+		z1*=-FIX_0_899976223;
+		z2*=-FIX_2_562915447;
+		z3=z3*-FIX_1_961570560+z5;
+		z4=z4*-FIX_0_390180644+z5;
+		
+		tmp0+=z1+z3;
+		tmp1+=z2+z4;
+		tmp2+=z2+z3;
+		tmp3+=z1+z4;
+		
+		outp[y*8+0]=clamp_int(DESCALE(tmp10+tmp3, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+7]=clamp_int(DESCALE(tmp10-tmp3, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+1]=clamp_int(DESCALE(tmp11+tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+6]=clamp_int(DESCALE(tmp11-tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+2]=clamp_int(DESCALE(tmp12+tmp1, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+5]=clamp_int(DESCALE(tmp12-tmp1, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+3]=clamp_int(DESCALE(tmp13+tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+4]=clamp_int(DESCALE(tmp13-tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+	}
+}
+
+//islow for blocks whose nonzero coefficients all lie in the top-left 4x4, identical results with less work
+static void data_unit_do_idct_islow_4x4(int16_t const coefs[64], quantization_table_t const quant, uint8_t outp[64])
+{
+	int32_t ws[8][4];
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	uint_fast8_t x, y;
+	
+	//pass 1: columns 0-3, coefficients 4-7 are zero
+	for(x=0; x<4; x++)
+	{
+		int32_t in0=dequant_coef(coefs[0*8+x], quant[0*8+x]);
+		int32_t in1=dequant_coef(coefs[1*8+x], quant[1*8+x]);
+		int32_t in2=dequant_coef(coefs[2*8+x], quant[2*8+x]);
+		int32_t in3=dequant_coef(coefs[3*8+x], quant[3*8+x]);
+		
+		if(in1==0 && in2==0 && in3==0)
+		{
+			for(y=0; y<8; y++)
+				ws[y][x]=LEFT_SHIFT(in0, ISLOW_PASS1_BITS);
+			continue;
+		}
+		
+		//even part
+		z1=in2*FIX_0_541196100;
+		tmp2=z1;
+		tmp3=z1+in2*FIX_0_765366865;
+		
+		tmp0=LEFT_SHIFT(in0, ISLOW_CONST_BITS);
+		
+		tmp10=tmp0+tmp3;
+		tmp13=tmp0-tmp3;
+		tmp11=tmp0+tmp2;
+		tmp12=tmp0-tmp2;
+		
+		//odd part
+		z5=(in3+in1)*FIX_1_175875602;
+		
+		z1=in1*-FIX_0_899976223;
+		z2=in3*-FIX_2_562915447;
+		z3=in3*-FIX_1_961570560+z5;
+		z4=in1*-FIX_0_390180644+z5;
+		
+		tmp0=z1+z3;
+		tmp1=z2+z4;
+		tmp2=in3*FIX_3_072711026+z2+z3;
+		tmp3=in1*FIX_1_501321110+z1+z4;
+		
+		ws[0][x]=DESCALE(tmp10+tmp3, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[7][x]=DESCALE(tmp10-tmp3, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[1][x]=DESCALE(tmp11+tmp2, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[6][x]=DESCALE(tmp11-tmp2, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[2][x]=DESCALE(tmp12+tmp1, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[5][x]=DESCALE(tmp12-tmp1, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[3][x]=DESCALE(tmp13+tmp0, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		ws[4][x]=DESCALE(tmp13-tmp0, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+	}
+	
+	//pass 2: rows, only w[0..3] can be nonzero
+	for(y=0; y<8; y++)
+	{
+		int32_t const * const w=ws[y];
+		
+		z1=w[2]*FIX_0_541196100;
+		tmp2=z1;
+		tmp3=z1+w[2]*FIX_0_765366865;
+		
+		tmp0=LEFT_SHIFT(w[0], ISLOW_CONST_BITS);
+		
+		tmp10=tmp0+tmp3;
+		tmp13=tmp0-tmp3;
+		tmp11=tmp0+tmp2;
+		tmp12=tmp0-tmp2;
+		
+		z5=(w[3]+w[1])*FIX_1_175875602;
+		
+		z1=w[1]*-FIX_0_899976223;
+		z2=w[3]*-FIX_2_562915447;
+		z3=w[3]*-FIX_1_961570560+z5;
+		z4=w[1]*-FIX_0_390180644+z5;
+		
+		tmp0=z1+z3;
+		tmp1=z2+z4;
+		tmp2=w[3]*FIX_3_072711026+z2+z3;
+		tmp3=w[1]*FIX_1_501321110+z1+z4;
+		
+		outp[y*8+0]=clamp_int(DESCALE(tmp10+tmp3, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+7]=clamp_int(DESCALE(tmp10-tmp3, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+1]=clamp_int(DESCALE(tmp11+tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+6]=clamp_int(DESCALE(tmp11-tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+2]=clamp_int(DESCALE(tmp12+tmp1, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+5]=clamp_int(DESCALE(tmp12-tmp1, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+3]=clamp_int(DESCALE(tmp13+tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*8+4]=clamp_int(DESCALE(tmp13-tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+	}
+}
+
+//DC-only block: both integer IDCTs reduce to DESCALE(DC,3)+128 everywhere
+static void data_unit_fill_dc(const int32_t dc_dequant, uint8_t outp[64])
+{
+	memset(outp, clamp_int(DESCALE(dc_dequant, 3)+128), 64);
+}
+
+//reduced-size IDCTs for scaled decoding (libjpeg's jidctint.c): an N-point IDCT of the top-left NxN coefficients
+//is the block downscaled by 8/N, the other coefficients are not even read. For 1/8 only the DC is left
+
+//4x4 samples
+static void data_unit_do_idct_reduced4(int16_t const coefs[64], quantization_table_t const quant, uint8_t outp[16])
+{
+	int32_t ws[4][4];
+	int32_t tmp0, tmp2, tmp10, tmp12;
+	int32_t z1, z2, z3;
+	uint_fast8_t x, y;
+	
+	//pass 1: columns, the even part is a 2-point butterfly, the odd part the rotation of the 8x8 even part
+	for(x=0; x<4; x++)
+	{
+		tmp0=dequant_coef(coefs[0*8+x], quant[0*8+x]);
+		tmp2=dequant_coef(coefs[2*8+x], quant[2*8+x]);
+		tmp10=LEFT_SHIFT(tmp0+tmp2, ISLOW_PASS1_BITS);
+		tmp12=LEFT_SHIFT(tmp0-tmp2, ISLOW_PASS1_BITS);
+		
+		z2=dequant_coef(coefs[1*8+x], quant[1*8+x]);
+		z3=dequant_coef(coefs[3*8+x], quant[3*8+x]);
+		z1=(z2+z3)*FIX_0_541196100;
+		tmp0=DESCALE(z1+z2*FIX_0_765366865, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		tmp2=DESCALE(z1-z3*FIX_1_847759065, ISLOW_CONST_BITS-ISLOW_PASS1_BITS);
+		
+		ws[0][x]=tmp10+tmp0;
+		ws[3][x]=tmp10-tmp0;
+		ws[1][x]=tmp12+tmp2;
+		ws[2][x]=tmp12-tmp2;
+	}
+	
+	//pass 2: rows
+	for(y=0; y<4; y++)
+	{
+		int32_t const * const w=ws[y];
+		
+		tmp10=LEFT_SHIFT(w[0]+w[2], ISLOW_CONST_BITS);
+		tmp12=LEFT_SHIFT(w[0]-w[2], ISLOW_CONST_BITS);
+		
+		z1=(w[1]+w[3])*FIX_0_541196100;
+		tmp0=z1+w[1]*FIX_0_765366865;
+		tmp2=z1-w[3]*FIX_1_847759065;
+		
+		outp[y*4+0]=clamp_int(DESCALE(tmp10+tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*4+3]=clamp_int(DESCALE(tmp10-tmp0, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*4+1]=clamp_int(DESCALE(tmp12+tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+		outp[y*4+2]=clamp_int(DESCALE(tmp12-tmp2, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)+128);
+	}
+}
+
+//2x2 samples
+static void data_unit_do_idct_reduced2(int16_t const coefs[64], quantization_table_t const quant, uint8_t outp[4])
+{
+	int32_t const c00=dequant_coef(coefs[0], quant[0]);
+	int32_t const c01=dequant_coef(coefs[1], quant[1]);
+	int32_t const c10=dequant_coef(coefs[8], quant[8]);
+	int32_t const c11=dequant_coef(coefs[9], quant[9]);
+	
+	int32_t const tmp0=c00+c01;
+	int32_t const tmp2=c00-c01;
+	int32_t const tmp1=c10+c11;
+	int32_t const tmp3=c10-c11;
+	
+	outp[0]=clamp_int(DESCALE(tmp0+tmp1, 3)+128);
+	outp[1]=clamp_int(DESCALE(tmp2+tmp3, 3)+128);
+	outp[2]=clamp_int(DESCALE(tmp0-tmp1, 3)+128);
+	outp[3]=clamp_int(DESCALE(tmp2-tmp3, 3)+128);
+}
+
+//fast, less accurate integer IDCT (Arai-Agui-Nakajima, as libjpeg's jidctfst.c): 8 bit constants
+#define IFAST_CONST_BITS 8
+#define IFAST_PASS1_BITS 2
+
+#define IFAST_FIX_1_082392200 277
+#define IFAST_FIX_1_414213562 362
+#define IFAST_FIX_1_847759065 473
+#define IFAST_FIX_2_613125930 669
+
+#define IFAST_MULTIPLY(v,c) DESCALE((v)*(c), IFAST_CONST_BITS)
+
+//AAN prescale factors, 16384*s[v]*s[u] with s[0]=1 and s[k]=cos(k*pi/16)*sqrt(2)
+static const int32_t ifast_aanscales[8][8]={	{16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520},
+										{22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270},
+										{21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906},
+										{19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315},
+										{16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520},
+										{12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552},
+										{ 8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446},
+										{ 4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247}	};
+
+static void data_unit_do_idct_ifast(int32_t const inp[64], uint8_t outp[64])
+{
+	int32_t in[8][8];
+	int32_t ws[8][8];
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z5, z10, z11, z12, z13;
+	uint_fast8_t u, v, x, y;
+	
+	//prescale, leaves the coefficients scaled up by IFAST_PASS1_BITS
+	for(v=0; v<8; v++)
+		for(u=0; u<8; u++)
+			in[v][u]=DESCALE(inp[v*8+u]*ifast_aanscales[v][u], 14-IFAST_PASS1_BITS);
+	
+	//pass 1: columns
+	for(x=0; x<8; x++)
+	{
+		if(in[1][x]==0 && in[2][x]==0 && in[3][x]==0 && in[4][x]==0 && in[5][x]==0 && in[6][x]==0 && in[7][x]==0)
+		{
+			for(y=0; y<8; y++)
+				ws[y][x]=in[0][x];
+			continue;
+		}
+		
+		//even part
+		tmp10=in[0][x]+in[4][x];
+		tmp11=in[0][x]-in[4][x];
+		tmp13=in[2][x]+in[6][x];
+		tmp12=IFAST_MULTIPLY(in[2][x]-in[6][x], IFAST_FIX_1_414213562)-tmp13;
+		
+		tmp0=tmp10+tmp13;
+		tmp3=tmp10-tmp13;
+		tmp1=tmp11+tmp12;
+		tmp2=tmp11-tmp12;
+		
+		//odd part
+		z13=in[5][x]+in[3][x];
+		z10=in[5][x]-in[3][x];
+		z11=in[1][x]+in[7][x];
+		z12=in[1][x]-in[7][x];
+		
+		tmp7=z11+z13;
+		tmp11=IFAST_MULTIPLY(z11-z13, IFAST_FIX_1_414213562);
+		z5=IFAST_MULTIPLY(z10+z12, IFAST_FIX_1_847759065);
+		tmp10=IFAST_MULTIPLY(z12, IFAST_FIX_1_082392200)-z5;
+		tmp12=z5-IFAST_MULTIPLY(z10, IFAST_FIX_2_613125930);
+		
+		tmp6=tmp12-tmp7;
+		tmp5=tmp11-tmp6;
+		tmp4=tmp10+tmp5;
+		
+		ws[0][x]=tmp0+tmp7;
+		ws[7][x]=tmp0-tmp7;
+		ws[1][x]=tmp1+tmp6;
+		ws[6][x]=tmp1-tmp6;
+		ws[2][x]=tmp2+tmp5;
+		ws[5][x]=tmp2-tmp5;
+		ws[4][x]=tmp3+tmp4;
+		ws[3][x]=tmp3-tmp4;
+	}
+	
+	//pass 2: rows, ws[y][u] -> outp[y*8+x]
+	for(y=0; y<8; y++)
+	{
+		int32_t const * const w=ws[y];
+		
+		tmp10=w[0]+w[4];
+		tmp11=w[0]-w[4];
+		tmp13=w[2]+w[6];
+		tmp12=IFAST_MULTIPLY(w[2]-w[6], IFAST_FIX_1_414213562)-tmp13;
+		
+		tmp0=tmp10+tmp13;
+		tmp3=tmp10-tmp13;
+		tmp1=tmp11+tmp12;
+		tmp2=tmp11-tmp12;
+		
+		z13=w[5]+w[3];
+		z10=w[5]-w[3];
+		z11=w[1]+w[7];
+		z12=w[1]-w[7];
+		
+		tmp7=z11+z13;
+		tmp11=IFAST_MULTIPLY(z11-z13, IFAST_FIX_1_414213562);
+		z5=IFAST_MULTIPLY(z10+z12, IFAST_FIX_1_847759065);
+		tmp10=IFAST_MULTIPLY(z12, IFAST_FIX_1_082392200)-z5;
+		tmp12=z5-IFAST_MULTIPLY(z10, IFAST_FIX_2_613125930);
+		
+		tmp6=tmp12-tmp7;
+		tmp5=tmp11-tmp6;
+		tmp4=tmp10+tmp5;
+		
+		outp[y*8+0]=clamp_int(DESCALE(tmp0+tmp7, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+7]=clamp_int(DESCALE(tmp0-tmp7, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+1]=clamp_int(DESCALE(tmp1+tmp6, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+6]=clamp_int(DESCALE(tmp1-tmp6, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+2]=clamp_int(DESCALE(tmp2+tmp5, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+5]=clamp_int(DESCALE(tmp2-tmp5, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+4]=clamp_int(DESCALE(tmp3+tmp4, IFAST_PASS1_BITS+3)+128);
+		outp[y*8+3]=clamp_int(DESCALE(tmp3-tmp4, IFAST_PASS1_BITS+3)+128);
+	}
+}
+
+//YCbCr->RGB in fixed point (JFIF), 14 bit constants so the SIMD versions can use 16 bit multiplies
+#define CC_SCALEBITS 14
+#define CC_ONE_HALF (1<<(CC_SCALEBITS-1))
+#define CC_FIX_1_40200 22970
+#define CC_FIX_1_77200 29032
+#define CC_FIX_0_34414 5638
+#define CC_FIX_0_71414 11700
+
+static void color_convert_row_scalar(uint8_t const * const Y, uint8_t const * const Cb, uint8_t const * const Cr, uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+	{
+		int32_t y=Y[x];
+		int32_t cb=Cb[x]-128;
+		int32_t cr=Cr[x]-128;
+		
+		rgb[3*x+0]=clamp_int(y+((CC_FIX_1_40200*cr+CC_ONE_HALF)>>CC_SCALEBITS));
+		rgb[3*x+1]=clamp_int(y+((-CC_FIX_0_34414*cb-CC_FIX_0_71414*cr+CC_ONE_HALF)>>CC_SCALEBITS));
+		rgb[3*x+2]=clamp_int(y+((CC_FIX_1_77200*cb+CC_ONE_HALF)>>CC_SCALEBITS));
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+//two int16 constants for _mm_madd_epi16/_mm256_madd_epi16, lo multiplies the even element
+#define PAIR16(lo,hi) ((int32_t)(((uint32_t)(uint16_t)(hi)<<16)|(uint16_t)(lo)))
+
+__attribute__((target("sse2")))
+static void dequant_block_sse2(int16_t const coefs[64], quantization_table_t const quant, int32_t outp[64])
+{
+	uint_fast8_t i;
+	
+	//signed coefficient times unsigned quantizer (16 bit DQT goes up to 65535): the unsigned high half,
+	//minus q where c is negative. The clamp to DEQUANT_LIMIT is done on the saturated 16 bit products
+	for(i=0; i<64; i+=8)
+	{
+		__m128i c=_mm_loadu_si128((__m128i const *)&coefs[i]);
+		__m128i q=_mm_loadu_si128((__m128i const *)&quant[i]);
+		__m128i lo=_mm_mullo_epi16(c, q);
+		__m128i hi=_mm_sub_epi16(_mm_mulhi_epu16(c, q), _mm_and_si128(q, _mm_srai_epi16(c, 15)));
+		__m128i v=_mm_packs_epi32(_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi));
+		
+		v=_mm_max_epi16(_mm_min_epi16(v, _mm_set1_epi16(DEQUANT_LIMIT)), _mm_set1_epi16(-DEQUANT_LIMIT));
+		_mm_storeu_si128((__m128i *)&outp[i], _mm_unpacklo_epi16(v, _mm_srai_epi16(v, 15)));
+		_mm_storeu_si128((__m128i *)&outp[i+4], _mm_unpackhi_epi16(v, _mm_srai_epi16(v, 15)));
+	}
+}
+
+__attribute__((target("avx2")))
+static void dequant_block_avx2(int16_t const coefs[64], quantization_table_t const quant, int32_t outp[64])
+{
+	uint_fast8_t i;
+	
+	for(i=0; i<64; i+=8)
+	{
+		__m256i c=_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i const *)&coefs[i]));
+		__m256i q=_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *)&quant[i]));
+		
+		__m256i v=_mm256_mullo_epi32(c, q);
+		
+		v=_mm256_max_epi32(_mm256_min_epi32(v, _mm256_set1_epi32(DEQUANT_LIMIT)), _mm256_set1_epi32(-DEQUANT_LIMIT));
+		_mm256_storeu_si256((__m256i *)&outp[i], v);
+	}
+}
+
+//SSE2 has no 32 bit mullo, build it from two 32x32->64 multiplies
+__attribute__((target("sse2")))
+static inline __m128i mullo_epi32_sse2(const __m128i a, const __m128i b)
+{
+	__m128i even=_mm_mul_epu32(a, b);
+	__m128i odd=_mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+//one islow pass on 4 lines at once, v[k] holds coefficient k of each line, replaced by sample k
+__attribute__((target("sse2")))
+static inline void idct_islow_1d_sse2(__m128i v[8], const int shift, const int32_t bias)
+{
+	__m128i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	__m128i z1, z2, z3, z4, z5;
+	__m128i const count=_mm_cvtsi32_si128(shift);
+	__m128i const rnd=_mm_set1_epi32(bias);
+	
+	//even part
+	z1=mullo_epi32_sse2(_mm_add_epi32(v[2], v[6]), _mm_set1_epi32(FIX_0_541196100));
+	tmp2=_mm_sub_epi32(z1, mullo_epi32_sse2(v[6], _mm_set1_epi32(FIX_1_847759065)));
+	tmp3=_mm_add_epi32(z1, mullo_epi32_sse2(v[2], _mm_set1_epi32(FIX_0_765366865)));
+	
+	tmp0=_mm_slli_epi32(_mm_add_epi32(v[0], v[4]), ISLOW_CONST_BITS);
+	tmp1=_mm_slli_epi32(_mm_sub_epi32(v[0], v[4]), ISLOW_CONST_BITS);
+	
+	tmp10=_mm_add_epi32(tmp0, tmp3);
+	tmp13=_mm_sub_epi32(tmp0, tmp3);
+	tmp11=_mm_add_epi32(tmp1, tmp2);
+	tmp12=_mm_sub_epi32(tmp1, tmp2);
+	
+	//odd part
+	tmp0=v[7];
+	tmp1=v[5];
+	tmp2=v[3];
+	tmp3=v[1];
+	
+	z1=_mm_add_epi32(tmp0, tmp3);
+	z2=_mm_add_epi32(tmp1, tmp2);
+	z3=_mm_add_epi32(tmp0, tmp2);
+	z4=_mm_add_epi32(tmp1, tmp3);
+	z5=mullo_epi32_sse2(_mm_add_epi32(z3, z4), _mm_set1_epi32(FIX_1_175875602));
+	
+	tmp0=mullo_epi32_sse2(tmp0, _mm_set1_epi32(FIX_0_298631336));
+	tmp1=mullo_epi32_sse2(tmp1, _mm_set1_epi32(FIX_2_053119869));
+	tmp2=mullo_epi32_sse2(tmp2, _mm_set1_epi32(FIX_3_072711026));
+	tmp3=mullo_epi32_sse2(tmp3, _mm_set1_epi32(FIX_1_501321110));
+	z1=mullo_epi32_sse2(z1, _mm_set1_epi32(-FIX_0_899976223));
+	z2=mullo_epi32_sse2(z2, _mm_set1_epi32(-FIX_2_562915447));
+	z3=_mm_add_epi32(mullo_epi32_sse2(z3, _mm_set1_epi32(-FIX_1_961570560)), z5);
+	z4=_mm_add_epi32(mullo_epi32_sse2(z4, _mm_set1_epi32(-FIX_0_390180644)), z5);
+	
+	tmp0=_mm_add_epi32(tmp0, _mm_add_epi32(z1, z3));
+	tmp1=_mm_add_epi32(tmp1, _mm_add_epi32(z2, z4));
+	tmp2=_mm_add_epi32(tmp2, _mm_add_epi32(z2, z3));
+	tmp3=_mm_add_epi32(tmp3, _mm_add_epi32(z1, z4));
+	
+	tmp10=_mm_add_epi32(tmp10, rnd);
+	tmp11=_mm_add_epi32(tmp11, rnd);
+	tmp12=_mm_add_epi32(tmp12, rnd);
+	tmp13=_mm_add_epi32(tmp13, rnd);
+	
+	v[0]=_mm_sra_epi32(_mm_add_epi32(tmp10, tmp3), count);
+	v[7]=_mm_sra_epi32(_mm_sub_epi32(tmp10, tmp3), count);
+	v[1]=_mm_sra_epi32(_mm_add_epi32(tmp11, tmp2), count);
+	v[6]=_mm_sra_epi32(_mm_sub_epi32(tmp11, tmp2), count);
+	v[2]=_mm_sra_epi32(_mm_add_epi32(tmp12, tmp1), count);
+	v[5]=_mm_sra_epi32(_mm_sub_epi32(tmp12, tmp1), count);
+	v[3]=_mm_sra_epi32(_mm_add_epi32(tmp13, tmp0), count);
+	v[4]=_mm_sra_epi32(_mm_sub_epi32(tmp13, tmp0), count);
+}
+
+__attribute__((target("sse2")))
+static inline void transpose4x4_epi32_sse2(__m128i * const a, __m128i * const b, __m128i * const c, __m128i * const d)
+{
+	__m128i t0=_mm_unpacklo_epi32(*a, *b);
+	__m128i t1=_mm_unpacklo_epi32(*c, *d);
+	__m128i t2=_mm_unpackhi_epi32(*a, *b);
+	__m128i t3=_mm_unpackhi_epi32(*c, *d);
+	
+	*a=_mm_unpacklo_epi64(t0, t1);
+	*b=_mm_unpackhi_epi64(t0, t1);
+	*c=_mm_unpacklo_epi64(t2, t3);
+	*d=_mm_unpackhi_epi64(t2, t3);
+}
+
+//8x8 block as left (columns 0-3) and right (columns 4-7) halves of each row
+__attribute__((target("sse2")))
+static inline void transpose8x8_epi32_sse2(__m128i l[8], __m128i r[8])
+{
+	__m128i tmp[4];
+	
+	transpose4x4_epi32_sse2(&l[0], &l[1], &l[2], &l[3]);
+	transpose4x4_epi32_sse2(&r[4], &r[5], &r[6], &r[7]);
+	transpose4x4_epi32_sse2(&r[0], &r[1], &r[2], &r[3]);
+	transpose4x4_epi32_sse2(&l[4], &l[5], &l[6], &l[7]);
+	
+	//the off-diagonal quarters swap places
+	memcpy(tmp, &r[0], sizeof(tmp));
+	memcpy(&r[0], &l[4], sizeof(tmp));
+	memcpy(&l[4], tmp, sizeof(tmp));
+}
+
+__attribute__((target("sse2")))
+static void data_unit_do_idct_islow_sse2(int32_t const inp[64], uint8_t outp[64])
+{
+	__m128i l[8], r[8];
+	uint_fast8_t i;
+	
+	for(i=0; i<8; i++)
+	{
+		l[i]=_mm_loadu_si128((__m128i const *)&inp[i*8]);
+		r[i]=_mm_loadu_si128((__m128i const *)&inp[i*8+4]);
+	}
+	
+	//columns, then rows, the output bias of 128 is folded into the rounding constant
+	idct_islow_1d_sse2(l, ISLOW_CONST_BITS-ISLOW_PASS1_BITS, 1<<(ISLOW_CONST_BITS-ISLOW_PASS1_BITS-1));
+	idct_islow_1d_sse2(r, ISLOW_CONST_BITS-ISLOW_PASS1_BITS, 1<<(ISLOW_CONST_BITS-ISLOW_PASS1_BITS-1));
+	transpose8x8_epi32_sse2(l, r);
+	idct_islow_1d_sse2(l, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3, (1<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+2))+(128<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)));
+	idct_islow_1d_sse2(r, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3, (1<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+2))+(128<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)));
+	transpose8x8_epi32_sse2(l, r);
+	
+	//saturating packs do the range limiting
+	for(i=0; i<8; i+=2)
+	{
+		__m128i row0=_mm_packs_epi32(l[i], r[i]);
+		__m128i row1=_mm_packs_epi32(l[i+1], r[i+1]);
+		
+		_mm_storeu_si128((__m128i *)&outp[i*8], _mm_packus_epi16(row0, row1));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void idct_islow_1d_avx2(__m256i v[8], const int shift, const int32_t bias)
+{
+	__m256i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	__m256i z1, z2, z3, z4, z5;
+	__m128i const count=_mm_cvtsi32_si128(shift);
+	__m256i const rnd=_mm256_set1_epi32(bias);
+	
+	//even part
+	z1=_mm256_mullo_epi32(_mm256_add_epi32(v[2], v[6]), _mm256_set1_epi32(FIX_0_541196100));
+	tmp2=_mm256_sub_epi32(z1, _mm256_mullo_epi32(v[6], _mm256_set1_epi32(FIX_1_847759065)));
+	tmp3=_mm256_add_epi32(z1, _mm256_mullo_epi32(v[2], _mm256_set1_epi32(FIX_0_765366865)));
+	
+	tmp0=_mm256_slli_epi32(_mm256_add_epi32(v[0], v[4]), ISLOW_CONST_BITS);
+	tmp1=_mm256_slli_epi32(_mm256_sub_epi32(v[0], v[4]), ISLOW_CONST_BITS);
+	
+	tmp10=_mm256_add_epi32(tmp0, tmp3);
+	tmp13=_mm256_sub_epi32(tmp0, tmp3);
+	tmp11=_mm256_add_epi32(tmp1, tmp2);
+	tmp12=_mm256_sub_epi32(tmp1, tmp2);
+	
+	//odd part
+	tmp0=v[7];
+	tmp1=v[5];
+	tmp2=v[3];
+	tmp3=v[1];
+	
+	z1=_mm256_add_epi32(tmp0, tmp3);
+	z2=_mm256_add_epi32(tmp1, tmp2);
+	z3=_mm256_add_epi32(tmp0, tmp2);
+	z4=_mm256_add_epi32(tmp1, tmp3);
+	z5=_mm256_mullo_epi32(_mm256_add_epi32(z3, z4), _mm256_set1_epi32(FIX_1_175875602));
+	
+	tmp0=_mm256_mullo_epi32(tmp0, _mm256_set1_epi32(FIX_0_298631336));
+	tmp1=_mm256_mullo_epi32(tmp1, _mm256_set1_epi32(FIX_2_053119869));
+	tmp2=_mm256_mullo_epi32(tmp2, _mm256_set1_epi32(FIX_3_072711026));
+	tmp3=_mm256_mullo_epi32(tmp3, _mm256_set1_epi32(FIX_1_501321110));
+	z1=_mm256_mullo_epi32(z1, _mm256_set1_epi32(-FIX_0_899976223));
+	z2=_mm256_mullo_epi32(z2, _mm256_set1_epi32(-FIX_2_562915447));
+	z3=_mm256_add_epi32(_mm256_mullo_epi32(z3, _mm256_set1_epi32(-FIX_1_961570560)), z5);
+	z4=_mm256_add_epi32(_mm256_mullo_epi32(z4, _mm256_set1_epi32(-FIX_0_390180644)), z5);
+	
+	tmp0=_mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+	tmp1=_mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+	tmp2=_mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+	tmp3=_mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+	
+	tmp10=_mm256_add_epi32(tmp10, rnd);
+	tmp11=_mm256_add_epi32(tmp11, rnd);
+	tmp12=_mm256_add_epi32(tmp12, rnd);
+	tmp13=_mm256_add_epi32(tmp13, rnd);
+	
+	v[0]=_mm256_sra_epi32(_mm256_add_epi32(tmp10, tmp3), count);
+	v[7]=_mm256_sra_epi32(_mm256_sub_epi32(tmp10, tmp3), count);
+	v[1]=_mm256_sra_epi32(_mm256_add_epi32(tmp11, tmp2), count);
+	v[6]=_mm256_sra_epi32(_mm256_sub_epi32(tmp11, tmp2), count);
+	v[2]=_mm256_sra_epi32(_mm256_add_epi32(tmp12, tmp1), count);
+	v[5]=_mm256_sra_epi32(_mm256_sub_epi32(tmp12, tmp1), count);
+	v[3]=_mm256_sra_epi32(_mm256_add_epi32(tmp13, tmp0), count);
+	v[4]=_mm256_sra_epi32(_mm256_sub_epi32(tmp13, tmp0), count);
+}
+
+__attribute__((target("avx2")))
+static inline void transpose8x8_epi32_avx2(__m256i v[8])
+{
+	__m256i t[8], u[8];
+	uint_fast8_t i;
+	
+	for(i=0; i<8; i+=2)
+	{
+		t[i]=_mm256_unpacklo_epi32(v[i], v[i+1]);
+		t[i+1]=_mm256_unpackhi_epi32(v[i], v[i+1]);
+	}
+	for(i=0; i<8; i+=4)
+	{
+		u[i]=_mm256_unpacklo_epi64(t[i], t[i+2]);
+		u[i+1]=_mm256_unpackhi_epi64(t[i], t[i+2]);
+		u[i+2]=_mm256_unpacklo_epi64(t[i+1], t[i+3]);
+		u[i+3]=_mm256_unpackhi_epi64(t[i+1], t[i+3]);
+	}
+	for(i=0; i<4; i++)
+	{
+		v[i]=_mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+		v[i+4]=_mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+static void data_unit_do_idct_islow_avx2(int32_t const inp[64], uint8_t outp[64])
+{
+	__m256i v[8];
+	uint_fast8_t i;
+	
+	for(i=0; i<8; i++)
+		v[i]=_mm256_loadu_si256((__m256i const *)&inp[i*8]);
+	
+	//columns, then rows, the output bias of 128 is folded into the rounding constant
+	idct_islow_1d_avx2(v, ISLOW_CONST_BITS-ISLOW_PASS1_BITS, 1<<(ISLOW_CONST_BITS-ISLOW_PASS1_BITS-1));
+	transpose8x8_epi32_avx2(v);
+	idct_islow_1d_avx2(v, ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3, (1<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+2))+(128<<(ISLOW_CONST_BITS+ISLOW_PASS1_BITS+3)));
+	transpose8x8_epi32_avx2(v);
+	
+	//saturating packs do the range limiting, the permutes undo their per-lane interleaving
+	__m256i p01=_mm256_permute4x64_epi64(_mm256_packs_epi32(v[0], v[1]), 0xD8);
+	__m256i p23=_mm256_permute4x64_epi64(_mm256_packs_epi32(v[2], v[3]), 0xD8);
+	__m256i p45=_mm256_permute4x64_epi64(_mm256_packs_epi32(v[4], v[5]), 0xD8);
+	__m256i p67=_mm256_permute4x64_epi64(_mm256_packs_epi32(v[6], v[7]), 0xD8);
+	
+	_mm256_storeu_si256((__m256i *)&outp[0], _mm256_permute4x64_epi64(_mm256_packus_epi16(p01, p23), 0xD8));
+	_mm256_storeu_si256((__m256i *)&outp[32], _mm256_permute4x64_epi64(_mm256_packus_epi16(p45, p67), 0xD8));
+}
+
+__attribute__((target("sse2")))
+static void color_convert_row_sse2(uint8_t const * const Y, uint8_t const * const Cb, uint8_t const * const Cr, uint8_t * const rgb, const uint_fast32_t n)
+{
+	__m128i const zero=_mm_setzero_si128();
+	__m128i const c128=_mm_set1_epi16(128);
+	__m128i const one=_mm_set1_epi16(1);
+	__m128i const half=_mm_set1_epi32(CC_ONE_HALF);
+	__m128i const k_r=_mm_set1_epi32(PAIR16(CC_FIX_1_40200, CC_ONE_HALF));
+	__m128i const k_g=_mm_set1_epi32(PAIR16(-CC_FIX_0_34414, -CC_FIX_0_71414));
+	__m128i const k_b=_mm_set1_epi32(PAIR16(CC_FIX_1_77200, CC_ONE_HALF));
+	
+	uint8_t r[8], g[8], b[8];
+	uint_fast32_t x;
+	uint_fast8_t i;
+	
+	for(x=0; x+8<=n; x+=8)
+	{
+		__m128i y=_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)&Y[x]), zero);
+		__m128i cb=_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)&Cb[x]), zero), c128);
+		__m128i cr=_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *)&Cr[x]), zero), c128);
+		
+		__m128i r_lo=_mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, one), k_r), CC_SCALEBITS);
+		__m128i r_hi=_mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, one), k_r), CC_SCALEBITS);
+		__m128i g_lo=_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), k_g), half), CC_SCALEBITS);
+		__m128i g_hi=_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), k_g), half), CC_SCALEBITS);
+		__m128i b_lo=_mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, one), k_b), CC_SCALEBITS);
+		__m128i b_hi=_mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, one), k_b), CC_SCALEBITS);
+		
+		_mm_storel_epi64((__m128i *)r, _mm_packus_epi16(_mm_add_epi16(y, _mm_packs_epi32(r_lo, r_hi)), zero));
+		_mm_storel_epi64((__m128i *)g, _mm_packus_epi16(_mm_add_epi16(y, _mm_packs_epi32(g_lo, g_hi)), zero));
+		_mm_storel_epi64((__m128i *)b, _mm_packus_epi16(_mm_add_epi16(y, _mm_packs_epi32(b_lo, b_hi)), zero));
+		
+		for(i=0; i<8; i++)
+		{
+			rgb[3*(x+i)+0]=r[i];
+			rgb[3*(x+i)+1]=g[i];
+			rgb[3*(x+i)+2]=b[i];
+		}
+	}
+	
+	color_convert_row_scalar(&Y[x], &Cb[x], &Cr[x], &rgb[3*x], n-x);
+}
+
+__attribute__((target("avx2")))
+static void color_convert_row_avx2(uint8_t const * const Y, uint8_t const * const Cb, uint8_t const * const Cr, uint8_t * const rgb, const uint_fast32_t n)
+{
+	__m256i const c128=_mm256_set1_epi16(128);
+	__m256i const one=_mm256_set1_epi16(1);
+	__m256i const half=_mm256_set1_epi32(CC_ONE_HALF);
+	__m256i const k_r=_mm256_set1_epi32(PAIR16(CC_FIX_1_40200, CC_ONE_HALF));
+	__m256i const k_g=_mm256_set1_epi32(PAIR16(-CC_FIX_0_34414, -CC_FIX_0_71414));
+	__m256i const k_b=_mm256_set1_epi32(PAIR16(CC_FIX_1_77200, CC_ONE_HALF));
+	
+	uint8_t r[16], g[16], b[16];
+	uint_fast32_t x;
+	uint_fast8_t i;
+	
+	for(x=0; x+16<=n; x+=16)
+	{
+		__m256i y=_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *)&Y[x]));
+		__m256i cb=_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *)&Cb[x])), c128);
+		__m256i cr=_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *)&Cr[x])), c128);
+		
+		//unpack and pack both work within 128 bit lanes, so the pixel order survives
+		__m256i r_lo=_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cr, one), k_r), CC_SCALEBITS);
+		__m256i r_hi=_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cr, one), k_r), CC_SCALEBITS);
+		__m256i g_lo=_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cb, cr), k_g), half), CC_SCALEBITS);
+		__m256i g_hi=_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cb, cr), k_g), half), CC_SCALEBITS);
+		__m256i b_lo=_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(cb, one), k_b), CC_SCALEBITS);
+		__m256i b_hi=_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(cb, one), k_b), CC_SCALEBITS);
+		
+		__m256i r8=_mm256_packus_epi16(_mm256_add_epi16(y, _mm256_packs_epi32(r_lo, r_hi)), y);
+		__m256i g8=_mm256_packus_epi16(_mm256_add_epi16(y, _mm256_packs_epi32(g_lo, g_hi)), y);
+		__m256i b8=_mm256_packus_epi16(_mm256_add_epi16(y, _mm256_packs_epi32(b_lo, b_hi)), y);
+		
+		_mm_storeu_si128((__m128i *)r, _mm256_castsi256_si128(_mm256_permute4x64_epi64(r8, 0x08)));
+		_mm_storeu_si128((__m128i *)g, _mm256_castsi256_si128(_mm256_permute4x64_epi64(g8, 0x08)));
+		_mm_storeu_si128((__m128i *)b, _mm256_castsi256_si128(_mm256_permute4x64_epi64(b8, 0x08)));
+		
+		for(i=0; i<16; i++)
+		{
+			rgb[3*(x+i)+0]=r[i];
+			rgb[3*(x+i)+1]=g[i];
+			rgb[3*(x+i)+2]=b[i];
+		}
+	}
+	
+	color_convert_row_scalar(&Y[x], &Cb[x], &Cr[x], &rgb[3*x], n-x);
+}
+
+#endif //HAVE_X86_SIMD
+
+//pick the widest kernels the CPU supports, JPEG_SIMD=scalar|sse2|avx2 caps the choice (for testing), other values are ignored
+static void select_kernels(kernels_t * const kernels)
+{
+	kernels->name="scalar";
+	kernels->dequant_block=dequant_block;
+	kernels->idct_islow=data_unit_do_idct_islow;
+	kernels->color_convert_row=color_convert_row_scalar;
+	
+	char const * const force=getenv("JPEG_SIMD");
+	
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	
+	if(force && !strcmp(force, "scalar"))
+		return;
+	
+	if(__builtin_cpu_supports("sse2"))
+	{
+		kernels->name="sse2";
+		kernels->dequant_block=dequant_block_sse2;
+		kernels->idct_islow=data_unit_do_idct_islow_sse2;
+		kernels->color_convert_row=color_convert_row_sse2;
+	}
+	
+	if(force && !strcmp(force, "sse2"))
+		return;
+	
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernels->name="avx2";
+		kernels->dequant_block=dequant_block_avx2;
+		kernels->idct_islow=data_unit_do_idct_islow_avx2;
+		kernels->color_convert_row=color_convert_row_avx2;
+	}
+#endif
+}
+
+static void data_unit_do_idct(picture_t const * const pic, int32_t const inp[64], uint8_t outp[64])
+{
+	switch(pic->idct_method)
+	{
+		case IDCT_FLOAT:	data_unit_do_idct_float(inp, outp); break;
+		case IDCT_ISLOW:	pic->kernels.idct_islow(inp, outp); break;
+		case IDCT_IFAST:	data_unit_do_idct_ifast(inp, outp); break;
+	}
+}
+
+//the block goes through dequant_block and a full 8x8 IDCT, the other paths of data_unit_reconstruct dequantize
+//the few coefficients they read themselves
+static bool data_unit_full_idct(picture_t const * const pic, const uint_fast8_t extent)
+{
+	if(pic->block_size!=8)
+		return false;
+	if(pic->idct_method==IDCT_FLOAT)
+		return true;
+	return extent>4 || (extent>1 && pic->idct_method!=IDCT_ISLOW);
+}
+
+//dequantization and IDCT of one block, extent is the size of the top-left square holding all nonzero coefficients.
+//Scaled decoding always uses the reduced integer IDCTs, as libjpeg does
+static void data_unit_reconstruct(picture_t const * const pic, int16_t const coefs[64], const uint_fast8_t extent, quantization_table_t const quant, uint8_t outp[64])
+{
+	int32_t coefs_dequant[64];
+	
+	if(data_unit_full_idct(pic, extent))
+	{
+		pic->kernels.dequant_block(coefs, quant, coefs_dequant);
+		data_unit_do_idct(pic, coefs_dequant, outp);
+		return;
+	}
+	
+	switch(pic->block_size)
+	{
+		case 1:
+			outp[0]=clamp_int(DESCALE(dequant_coef(coefs[0], quant[0]), 3)+128);
+			return;
+		case 2:
+			data_unit_do_idct_reduced2(coefs, quant, outp);
+			return;
+		case 4:
+			if(extent==1)
+				memset(outp, clamp_int(DESCALE(dequant_coef(coefs[0], quant[0]), 3)+128), 16);
+			else
+				data_unit_do_idct_reduced4(coefs, quant, outp);
+			return;
+	}
+	
+	if(extent==1)
+		data_unit_fill_dc(dequant_coef(coefs[0], quant[0]), outp);
+	else
+		data_unit_do_idct_islow_4x4(coefs, quant, outp);
+}
+
+//entropy-decode one data unit into coefs (natural order, zeroed first), returns the extent of its nonzero coefficients
+static uint_fast8_t decode_block(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t * const precedent_DC, int16_t coefs[64])
+{
+	uint_fast8_t nb_bits;
+	uint_fast8_t ac_count;
+	uint_fast8_t extent=1;
+	
+	memset(coefs, 0, 64*sizeof(int16_t));
+	
+	uint8_t SSSS;
+	int16_t DC;
+	if(!bitstream_get_next_decoded_element(bs, &pic->huff_tables[0][pic->components_data[component].Td], &SSSS, &nb_bits))
+	{
+		if(bs->starved)
+			return 1; //the caller retries with more data
+		decode_fail(bs->error, JPEG_ERROR_CORRUPT, "no DC data");
+	}
+	DC=precedent_DC[component]+bitstream_get_extended(bs, SSSS);
+	
+	coefs[0]=DC;
+	precedent_DC[component]=DC;
+
+	int16_t AC;
+	for(ac_count=0; ac_count<63; )
+	{
+		uint8_t RRRRSSSS;
+		if(!bitstream_get_next_decoded_element(bs, &pic->huff_tables[1][pic->components_data[component].Ta], &RRRRSSSS, &nb_bits))
+		{
+			if(bs->starved)
+				return extent;
+			decode_fail(bs->error, JPEG_ERROR_CORRUPT, "no AC data");
+		}
+		
+		uint8_t RRRR=(RRRRSSSS>>4); //number of preceding 0 samples
+		uint8_t SSSS=RRRRSSSS&0x0f; //category
+		
+		if(RRRR==0 && SSSS==0)
+		{
+
+			break;
+		}
+		else if(RRRR==0x0F && SSSS==0)
+		{
+			ac_count+=16;
+
+		}
+		else
+		{
+			ac_count+=RRRR;
+			
+			AC=bitstream_get_extended(bs, SSSS);
+			
+			coefs[zigzag_to_natural[ac_count+1]]=AC;
+			if(zigzag_extent[ac_count+1]>extent)
+				extent=zigzag_extent[ac_count+1];
+			ac_count++;
+
+		}
+	}
+	
+	INSTRUMENT(bs->counters.nb_blocks++; bs->counters.nb_dc_only_blocks+=extent==1;)
+	return extent;
+}
+
+static uint_fast8_t blocks_per_MCU(picture_t const * const pic)
+{
+	uint_fast8_t component;
+	uint_fast8_t nb_blocks=0;
+	
+	for(component=0; component<pic->nb_components; component++)
+		nb_blocks+=pic->components_data[component].V*pic->components_data[component].H;
+	
+	return nb_blocks;
+}
+
+//entropy-decode all data units of one MCU, in the order they appear in the bitstream
+static void decode_MCU_coefs_generic(picture_t const * const pic, bitstream_t * const bs, int16_t * const precedent_DC, int16_t (* const coefs)[64], uint8_t * const extents)
+{
+	uint_fast8_t component;
+	uint_fast8_t data_unit;
+	uint_fast8_t block=0;
+	
+	for(component=0; component<pic->nb_components; component++)
+		for(data_unit=0; data_unit<(pic->components_data[component].V*pic->components_data[component].H); data_unit++, block++)
+			extents[block]=decode_block(pic, bs, component, precedent_DC, coefs[block]);
+}
+
+//the same for a layout of select_MCU_layout(): H x V luma blocks, then one block of each other component.
+//Called with constants, so the loops have fixed trip counts once inlined
+static inline __attribute__((always_inline)) void decode_MCU_coefs_layout(picture_t const * const pic, bitstream_t * const bs, int16_t * const precedent_DC, int16_t (* const coefs)[64], uint8_t * const extents, const uint_fast8_t nb_components, const uint_fast8_t H, const uint_fast8_t V)
+{
+	uint_fast8_t block;
+	uint_fast8_t component;
+	
+	for(block=0; block<H*V; block++)
+		extents[block]=decode_block(pic, bs, 0, precedent_DC, coefs[block]);
+	for(component=1; component<nb_components; component++, block++)
+		extents[block]=decode_block(pic, bs, component, precedent_DC, coefs[block]);
+}
+
+static void decode_MCU_coefs(picture_t const * const pic, bitstream_t * const bs, int16_t * const precedent_DC, int16_t (* const coefs)[64], uint8_t * const extents)
+{
+	switch(pic->MCU_layout)
+	{
+		case MCU_LAYOUT_GRAY:
+			decode_MCU_coefs_layout(pic, bs, precedent_DC, coefs, extents, 1, 1, 1);
+			break;
+		case MCU_LAYOUT_444:
+			decode_MCU_coefs_layout(pic, bs, precedent_DC, coefs, extents, 3, 1, 1);
+			break;
+		case MCU_LAYOUT_422:
+			decode_MCU_coefs_layout(pic, bs, precedent_DC, coefs, extents, 3, 2, 1);
+			break;
+		case MCU_LAYOUT_420:
+			decode_MCU_coefs_layout(pic, bs, precedent_DC, coefs, extents, 3, 2, 2);
+			break;
+		default:
+			decode_MCU_coefs_generic(pic, bs, precedent_DC, coefs, extents);
+	}
+	
+	INSTRUMENT(bs->counters.nb_MCUs++;)
+}
+
+//dequantization, IDCT and storage of all data units of one MCU
+static void reconstruct_MCU_generic(picture_t * const pic, const uint_fast32_t MCU, int16_t (* const coefs)[64], uint8_t const * const extents)
+{
+	uint_fast8_t component;
+	uint_fast8_t data_unit;
+	uint_fast8_t block=0;
+	uint8_t samples[64];
+	
+	for(component=0; component<pic->nb_components; component++)
+	{
+		for(data_unit=0; data_unit<(pic->components_data[component].V*pic->components_data[component].H); data_unit++, block++)
+		{
+			data_unit_reconstruct(pic, coefs[block], extents[block], pic->components_data[component].quant, samples);
+			store_data_unit_YCbCr(pic, MCU, component, data_unit, samples);
+		}
+	}
+}
+
+//n x n samples of a block to a plane
+static inline void store_samples(uint8_t * dst, const uint_fast32_t stride, uint8_t const samples[64], const uint_fast8_t n)
+{
+	uint_fast8_t y;
+	
+	if(n==8)
+	{
+		for(y=0; y<8; y++, dst+=stride)
+			memcpy(dst, &samples[y*8], 8);
+		return;
+	}
+	
+	for(y=0; y<n; y++, dst+=stride)
+		memcpy(dst, &samples[y*n], n);
+}
+
+//reconstruct_MCU for a layout of select_MCU_layout(): the position of the MCU in the planes is worked out
+//once instead of for every block as store_data_unit_YCbCr does
+static inline __attribute__((always_inline)) void reconstruct_MCU_layout(picture_t * const pic, const uint_fast32_t MCU, int16_t (* const coefs)[64], uint8_t const * const extents, const uint_fast8_t nb_components, const uint_fast8_t H, const uint_fast8_t V)
+{
+	uint_fast8_t const n=pic->block_size;
+	uint_fast32_t const col=MCU%pic->MCUs_per_row-pic->MCU_X0;
+	uint_fast32_t const row=(MCU/pic->MCUs_per_row-pic->MCU_Y0)%pic->plane_MCU_rows;
+	uint8_t samples[64];
+	uint_fast8_t block;
+	uint_fast8_t component;
+	
+	components_data_t const * comp=&pic->components_data[0];
+	uint8_t * const luma=&comp->pixels[n*(row*V*comp->stride+col*H)];
+	for(block=0; block<H*V; block++)
+	{
+		data_unit_reconstruct(pic, coefs[block], extents[block], comp->quant, samples);
+		store_samples(&luma[n*((block/H)*comp->stride+block%H)], comp->stride, samples, n);
+	}
+	
+	for(component=1; component<nb_components; component++, block++)
+	{
+		comp=&pic->components_data[component];
+		data_unit_reconstruct(pic, coefs[block], extents[block], comp->quant, samples);
+		store_samples(&comp->pixels[n*(row*comp->stride+col)], comp->stride, samples, n);
+	}
+}
+
+static void reconstruct_MCU(picture_t * const pic, const uint_fast32_t MCU, int16_t (* const coefs)[64], uint8_t const * const extents)
+{
+	switch(pic->MCU_layout)
+	{
+		case MCU_LAYOUT_GRAY:
+			reconstruct_MCU_layout(pic, MCU, coefs, extents, 1, 1, 1);
+			break;
+		case MCU_LAYOUT_444:
+			reconstruct_MCU_layout(pic, MCU, coefs, extents, 3, 1, 1);
+			break;
+		case MCU_LAYOUT_422:
+			reconstruct_MCU_layout(pic, MCU, coefs, extents, 3, 2, 1);
+			break;
+		case MCU_LAYOUT_420:
+			reconstruct_MCU_layout(pic, MCU, coefs, extents, 3, 2, 2);
+			break;
+		default:
+			reconstruct_MCU_generic(pic, MCU, coefs, extents);
+	}
+}
+
+static bool MCU_in_window(picture_t const * const pic, const uint_fast32_t MCU)
+{
+	uint_fast32_t const col=MCU%pic->MCUs_per_row;
+	uint_fast32_t const row=MCU/pic->MCUs_per_row;
+	
+	return col>=pic->MCU_X0 && col<pic->MCU_X1 && row>=pic->MCU_Y0 && row<pic->MCU_Y1;
+}
+
+//of the nb_MCUs MCUs starting with first_MCU, how many must be decoded to reach the last one in the window,
+//0 if none of them is in it
+static uint_fast32_t MCUs_to_decode(picture_t const * const pic, const uint_fast32_t first_MCU, const uint_fast32_t nb_MCUs)
+{
+	uint_fast32_t const W=pic->MCUs_per_row;
+	uint_fast32_t const end=first_MCU+nb_MCUs;
+	uint_fast32_t row=(end-1)/W;
+	
+	if(row>=pic->MCU_Y1)
+		row=pic->MCU_Y1-1;
+	
+	//from the last row of the range up
+	while(row>=pic->MCU_Y0 && row*W+W>first_MCU)
+	{
+		uint_fast32_t first=row*W+pic->MCU_X0;
+		uint_fast32_t last=row*W+pic->MCU_X1;
+		if(first<first_MCU)
+			first=first_MCU;
+		if(last>end)
+			last=end;
+		if(first<last)
+			return last-first_MCU;
+		
+		if(!row)
+			break;
+		row--;
+	}
+	
+	return 0;
+}
+
+//keep_coefficients: the blocks of one MCU go to the coefficient grids of their components
+static void store_MCU_coefs(picture_t * const pic, const uint_fast32_t MCU, int16_t (* const coefs)[64], uint8_t const * const extents)
+{
+	uint_fast8_t component;
+	uint_fast8_t data_unit;
+	uint_fast8_t block=0;
+	
+	for(component=0; component<pic->nb_components; component++)
+	{
+		components_data_t const * const comp=&pic->components_data[component];
+		
+		for(data_unit=0; data_unit<comp->V*comp->H; data_unit++, block++)
+		{
+			uint_fast32_t const blockX=(MCU%pic->MCUs_per_row-pic->coefs_MCU_X0)*comp->H+data_unit%comp->H;
+			uint_fast32_t const blockY=(MCU/pic->MCUs_per_row-pic->coefs_MCU_Y0)*comp->V+data_unit/comp->H;
+			memcpy(comp->coefs[blockY*comp->blocks_per_row+blockX], coefs[block], sizeof(coefs[block]));
+			comp->extents[blockY*comp->blocks_per_row+blockX]=extents[block];
+		}
+	}
+}
+
+//decode nb_MCUs MCUs starting with MCU first_MCU, DC predictions start at 0 (start of scan or restart interval)
+static void decode_MCUs(picture_t * const pic, bitstream_t * const bs, const uint_fast32_t first_MCU, const uint_fast32_t nb_MCUs)
+{
+	int16_t precedent_DC[4]={0,0,0,0};
+	
+	uint_fast32_t nb_MCU=0;
+
+	int16_t coefs[4*4*4][64]; //up to 4 components of 4x4 data units
+	uint8_t extents[4*4*4];
+	
+	for(nb_MCU=first_MCU; nb_MCU<first_MCU+nb_MCUs; nb_MCU++)
+	{
+		decode_MCU_coefs(pic, bs, precedent_DC, coefs, extents);
+		if(!MCU_in_window(pic, nb_MCU))
+			continue;
+		if(pic->keep_coefficients)
+			store_MCU_coefs(pic, nb_MCU, coefs, extents);
+		else
+			reconstruct_MCU(pic, nb_MCU, coefs, extents);
+	}
+}
+
+//two stage pipeline without restart markers: this thread entropy-decodes MCU rows into a ring of
+//coefficient buffers, worker threads do dequantization, IDCT and storage of finished rows
+typedef struct
+{
+	picture_t * pic;
+	
+	uint_fast32_t MCUs_per_row;
+	uint_fast32_t nb_rows;
+	uint_fast8_t blocks_per_MCU;
+	
+	unsigned nb_slots;
+	int16_t (* coefs)[64]; //nb_slots rows of MCUs_per_row*blocks_per_MCU blocks
+	uint8_t * extents;
+	bool * slot_in_use; //decoded, not reconstructed yet
+	
+	uint_fast32_t rows_decoded;
+	uint_fast32_t next_row; //next row a worker takes
+	
+	pthread_mutex_t lock;
+	pthread_cond_t row_ready;
+	pthread_cond_t slot_free;
+} MCU_pipeline_t;
+
+static void * pipeline_worker(void * const arg)
+{
+	MCU_pipeline_t * const pl=arg;
+	
+	pthread_mutex_lock(&pl->lock);
+	while(true)
+	{
+		while(pl->next_row>=pl->rows_decoded && pl->next_row<pl->nb_rows)
+			pthread_cond_wait(&pl->row_ready, &pl->lock);
+		
+		if(pl->next_row>=pl->nb_rows)
+			break;
+		
+		uint_fast32_t const row=pl->next_row++;
+		unsigned const slot=row%pl->nb_slots;
+		pthread_mutex_unlock(&pl->lock);
+		INSTRUMENT(uint64_t const start=read_tsc();)
+		
+		uint_fast32_t const first_MCU=row*pl->MCUs_per_row;
+		uint_fast32_t i;
+		for(i=0; i<pl->MCUs_per_row && first_MCU+i<pl->pic->nb_MCU_total; i++)
+		{
+			uint_fast32_t const block=(slot*pl->MCUs_per_row+i)*pl->blocks_per_MCU;
+			if(MCU_in_window(pl->pic, first_MCU+i))
+				reconstruct_MCU(pl->pic, first_MCU+i, &pl->coefs[block], &pl->extents[block]);
+		}
+		
+		//one span per row, the time spent waiting for rows is not counted
+		INSTRUMENT(span_end(pl->pic, JPEG_SPAN_RECONSTRUCT, "MCU row", row, start);)
+		pthread_mutex_lock(&pl->lock);
+		pl->slot_in_use[slot]=false;
+		pthread_cond_signal(&pl->slot_free);
+	}
+	pthread_mutex_unlock(&pl->lock);
+	
+	return NULL;
+}
+
+//entropy decoding side of the pipeline, errors are caught here so the workers can be stopped first
+static bool pipeline_produce(MCU_pipeline_t * const pl, bitstream_t * const bs, decode_error_t * const error)
+{
+	picture_t const * const pic=pl->pic;
+	int16_t precedent_DC[4]={0,0,0,0};
+	uint_fast32_t row;
+	
+	if(setjmp(error->env))
+		return false;
+	bs->error=error;
+	
+	for(row=0; row<pl->nb_rows; row++)
+	{
+		unsigned const slot=row%pl->nb_slots;
+		
+		pthread_mutex_lock(&pl->lock);
+		while(pl->slot_in_use[slot])
+			pthread_cond_wait(&pl->slot_free, &pl->lock);
+		pthread_mutex_unlock(&pl->lock);
+		
+		uint_fast32_t const first_MCU=row*pl->MCUs_per_row;
+		uint_fast32_t i;
+		for(i=0; i<pl->MCUs_per_row && first_MCU+i<pic->nb_MCU_total; i++)
+		{
+			uint_fast32_t const block=(slot*pl->MCUs_per_row+i)*pl->blocks_per_MCU;
+			decode_MCU_coefs(pic, bs, precedent_DC, &pl->coefs[block], &pl->extents[block]);
+		}
+		
+		pthread_mutex_lock(&pl->lock);
+		pl->slot_in_use[slot]=true;
+		pl->rows_decoded=row+1;
+		pthread_cond_broadcast(&pl->row_ready);
+		pthread_mutex_unlock(&pl->lock);
+	}
+	
+	return true;
+}
+
+static void decode_MCUs_pipelined(picture_t * const pic, bitstream_t * const bs, unsigned nb_workers)
+{
+	MCU_pipeline_t pl;
+	
+	pl.pic=pic;
+	pl.MCUs_per_row=pic->MCUs_per_row;
+	pl.nb_rows=(MCUs_to_decode(pic, 0, pic->nb_MCU_total)+pl.MCUs_per_row-1)/pl.MCUs_per_row; //none after the window
+	pl.blocks_per_MCU=blocks_per_MCU(pic);
+	pl.nb_slots=2*nb_workers;
+	pl.coefs=arena_alloc(&pic->arena, pl.nb_slots*pl.MCUs_per_row*pl.blocks_per_MCU*sizeof(*pl.coefs), pic->error);
+	pl.extents=arena_alloc(&pic->arena, pl.nb_slots*pl.MCUs_per_row*pl.blocks_per_MCU, pic->error);
+	pl.slot_in_use=arena_alloc(&pic->arena, pl.nb_slots*sizeof(bool), pic->error);
+	memset(pl.slot_in_use, 0, pl.nb_slots*sizeof(bool));
+	pl.rows_decoded=0;
+	pl.next_row=0;
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.row_ready, NULL);
+	pthread_cond_init(&pl.slot_free, NULL);
+	
+	//fewer workers if not all of them can be started, none at all: decode on this thread only
+	pthread_t threads[nb_workers];
+	unsigned t;
+	for(t=0; t<nb_workers; t++)
+		if(pthread_create(&threads[t], NULL, pipeline_worker, &pl))
+			break;
+	nb_workers=t;
+	
+	decode_error_t error;
+	bool ok=true;
+	
+	if(nb_workers)
+		ok=pipeline_produce(&pl, bs, &error);
+	
+	if(!ok)
+	{
+		//workers finish the rows already decoded, then stop
+		pthread_mutex_lock(&pl.lock);
+		pl.nb_rows=pl.rows_decoded;
+		pthread_cond_broadcast(&pl.row_ready);
+		pthread_mutex_unlock(&pl.lock);
+	}
+	
+	for(t=0; t<nb_workers; t++)
+		pthread_join(threads[t], NULL);
+	
+	pthread_mutex_destroy(&pl.lock);
+	pthread_cond_destroy(&pl.row_ready);
+	pthread_cond_destroy(&pl.slot_free);
+	
+	bs->error=pic->error;
+	
+	if(!ok)
+		decode_fail(pic->error, error.status, "%s", error.message);
+	
+	if(!nb_workers)
+		decode_MCUs(pic, bs, 0, MCUs_to_decode(pic, 0, pic->nb_MCU_total));
+}
+
+//buffered scans. Progressive decoding (G.1.2): each scan adds a band of coefficients, or one more bit of them, to
+//the coefficient store. Sequential scans of some of the components decode whole blocks into it.
+//A scan of a single component has its blocks in raster order over the component instead of in MCUs
+
+typedef struct
+{
+	int16_t precedent_DC[4];
+	uint_fast32_t EOBRUN; //blocks left that end before the band of this scan
+} progressive_state_t;
+
+static uint8_t progressive_decode_symbol(bitstream_t * const bs, huffman_table_t const * const table)
+{
+	uint8_t symbol;
+	uint_fast8_t nb_bits;
+	
+	if(!bitstream_get_next_decoded_element(bs, table, &symbol, &nb_bits))
+		decode_fail(bs->error, JPEG_ERROR_CORRUPT, "invalid Huffman code before pos %lu", bs->pos);
+	
+	return symbol;
+}
+
+static void decode_DC_first(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t coefs[64], uint8_t * const extent, progressive_state_t * const state)
+{
+	(void)extent;
+	
+	uint8_t const SSSS=progressive_decode_symbol(bs, &pic->huff_tables[0][pic->components_data[component].Td]);
+	state->precedent_DC[component]+=bitstream_get_extended(bs, SSSS);
+	coefs[0]=state->precedent_DC[component]*(1<<pic->Al);
+}
+
+static void decode_DC_refine(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t coefs[64], uint8_t * const extent, progressive_state_t * const state)
+{
+	(void)component;
+	(void)extent;
+	(void)state;
+	
+	if(bitstream_get_bits(bs, 1))
+		coefs[0]|=1<<pic->Al;
+}
+
+static void decode_AC_first(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t coefs[64], uint8_t * const extent, progressive_state_t * const state)
+{
+	if(state->EOBRUN)
+	{
+		state->EOBRUN--;
+		return;
+	}
+	
+	huffman_table_t const * const table=&pic->huff_tables[1][pic->components_data[component].Ta];
+	uint_fast8_t k;
+	
+	for(k=pic->Ss; k<=pic->Se; k++)
+	{
+		uint8_t const RRRRSSSS=progressive_decode_symbol(bs, table);
+		uint8_t const RRRR=RRRRSSSS>>4;
+		uint8_t const SSSS=RRRRSSSS&0x0f;
+		
+		if(SSSS)
+		{
+			k+=RRRR;
+			coefs[zigzag_to_natural[k]]=bitstream_get_extended(bs, SSSS)*(1<<pic->Al);
+			if(zigzag_extent[k]>*extent)
+				*extent=zigzag_extent[k];
+		}
+		else if(RRRR==15)
+			k+=15; //ZRL
+		else
+		{
+			//EOBn: this block and the next 2^RRRR-1+extra bits have nothing more in the band
+			state->EOBRUN=(1<<RRRR)-1;
+			if(RRRR)
+				state->EOBRUN+=bitstream_get_bits(bs, RRRR);
+			break;
+		}
+	}
+}
+
+//coefficients that are already nonzero get one correction bit each, in the order they are passed (G.1.2.3)
+static void refine_nonzero_AC(picture_t const * const pic, bitstream_t * const bs, int16_t * const coef)
+{
+	int16_t const bit=1<<pic->Al;
+	
+	if(bitstream_get_bits(bs, 1) && !(*coef&bit))
+		*coef+=*coef>=0 ? bit : -bit;
+}
+
+static void decode_AC_refine(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t coefs[64], uint8_t * const extent, progressive_state_t * const state)
+{
+	huffman_table_t const * const table=&pic->huff_tables[1][pic->components_data[component].Ta];
+	int16_t const bit=1<<pic->Al;
+	uint_fast8_t k=pic->Ss;
+	
+	if(!state->EOBRUN)
+	{
+		for(; k<=pic->Se; k++)
+		{
+			uint8_t const RRRRSSSS=progressive_decode_symbol(bs, table);
+			int_fast8_t zeros=RRRRSSSS>>4;
+			int16_t value=0;
+			
+			if(RRRRSSSS&0x0f) //a coefficient that becomes nonzero, its magnitude is always 1 (libjpeg also reads 1 bit if not)
+				value=bitstream_get_bits(bs, 1) ? bit : -bit;
+			else if(zeros!=15)
+			{
+				//the rest of the band of this block only refines coefficients, as do the next 2^RRRR-1+extra blocks
+				state->EOBRUN=1<<zeros;
+				if(zeros)
+					state->EOBRUN+=bitstream_get_bits(bs, zeros);
+				break;
+			}
+			
+			//skip zeros zero coefficients, and refine the nonzero ones on the way
+			for(; k<=pic->Se; k++)
+			{
+				int16_t * const coef=&coefs[zigzag_to_natural[k]];
+				if(*coef)
+					refine_nonzero_AC(pic, bs, coef);
+				else if(--zeros<0)
+					break;
+			}
+			
+			if(value)
+			{
+				coefs[zigzag_to_natural[k]]=value;
+				if(zigzag_extent[k]>*extent)
+					*extent=zigzag_extent[k];
+			}
+		}
+	}
+	
+	if(state->EOBRUN)
+	{
+		for(; k<=pic->Se; k++)
+			if(coefs[zigzag_to_natural[k]])
+				refine_nonzero_AC(pic, bs, &coefs[zigzag_to_natural[k]]);
+		state->EOBRUN--;
+	}
+}
+
+static void decode_block_sequential(picture_t const * const pic, bitstream_t * const bs, const uint_fast8_t component, int16_t coefs[64], uint8_t * const extent, progressive_state_t * const state)
+{
+	*extent=decode_block(pic, bs, component, state->precedent_DC, coefs);
+}
+
+//decode nb_MCUs MCUs of the current scan starting with first_MCU, into the coefficient store. DC predictions and
+//end-of-band runs start at 0 (start of scan or restart interval)
+static void decode_buffered_MCUs(picture_t * const pic, bitstream_t * const bs, const uint_fast32_t first_MCU, const uint_fast32_t nb_MCUs)
+{
+	progressive_state_t state={{0,0,0,0}, 0};
+	
+	void (* decode)(picture_t const * const, bitstream_t * const, const uint_fast8_t, int16_t [64], uint8_t * const, progressive_state_t * const)=
+		pic->Ss==0 ? (pic->Ah ? decode_DC_refine : decode_DC_first) : (pic->Ah ? decode_AC_refine : decode_AC_first);
+	if(!pic->progressive)
+		decode=decode_block_sequential;
+	
+	//sequential blocks are counted by decode_block
+	INSTRUMENT(bs->counters.nb_MCUs+=nb_MCUs;)
+	
+	uint_fast32_t MCU;
+	
+	if(pic->scan_nb_components==1)
+	{
+		uint_fast8_t const component=pic->scan_components[0];
+		components_data_t const * const comp=&pic->components_data[component];
+		uint_fast32_t const blocks_X=(pic->size_X*comp->H+8*pic->Hmax-1)/(8*pic->Hmax);
+		
+		for(MCU=first_MCU; MCU<first_MCU+nb_MCUs; MCU++)
+		{
+			uint_fast32_t const block=MCU/blocks_X*comp->blocks_per_row+MCU%blocks_X;
+			decode(pic, bs, component, comp->coefs[block], &comp->extents[block], &state);
+			INSTRUMENT(bs->counters.nb_blocks+=pic->progressive;)
+		}
+		return;
+	}
+	
+	for(MCU=first_MCU; MCU<first_MCU+nb_MCUs; MCU++)
+	{
+		uint_fast8_t j;
+		for(j=0; j<pic->scan_nb_components; j++)
+		{
+			uint_fast8_t const component=pic->scan_components[j];
+			components_data_t const * const comp=&pic->components_data[component];
+			uint_fast8_t data_unit;
+			
+			for(data_unit=0; data_unit<comp->V*comp->H; data_unit++)
+			{
+				uint_fast32_t const blockX=MCU%pic->MCUs_per_row*comp->H+data_unit%comp->H;
+				uint_fast32_t const blockY=MCU/pic->MCUs_per_row*comp->V+data_unit/comp->H;
+				uint_fast32_t const block=blockY*comp->blocks_per_row+blockX;
+				decode(pic, bs, component, comp->coefs[block], &comp->extents[block], &state);
+				INSTRUMENT(bs->counters.nb_blocks+=pic->progressive;)
+			}
+		}
+	}
+}
+
+//the RSTn markers are not needed to skip a scan, only where it ends
+static uint_fast32_t skip_scan_data(picture_t const * const pic)
+{
+	uint_fast32_t pos=pic->pos_compressed_pixeldata;
+	
+	while(true)
+	{
+		uint8_t const * const ff=memchr(&pic->data[pos], 0xFF, pic->filesize-pos);
+		if(!ff || (uint_fast32_t)(ff-pic->data)+1>=pic->filesize)
+			decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+		
+		pos=ff-pic->data;
+		uint8_t const byte2=pic->data[pos+1];
+		
+		if(byte2==0x00 || byte2==0xFF || (byte2>=0xD0 && byte2<=0xD7))
+			pos++;
+		else
+			return pos;
+	}
+}
+
+//samples of the MCU window from the coefficient store, MCU rows are shared out among the threads
+typedef struct
+{
+	picture_t * pic;
+	atomic_uint_fast32_t next_row;
+} reconstruct_pool_t;
+
+static void * reconstruct_worker(void * const arg)
+{
+	reconstruct_pool_t * const pool=arg;
+	picture_t * const pic=pool->pic;
+	
+	int16_t coefs[4*4*4][64];
+	uint8_t extents[4*4*4];
+	uint_fast32_t row;
+	INSTRUMENT(uint64_t const start=read_tsc(); uint32_t nb_rows=0;)
+	
+	while((row=atomic_fetch_add(&pool->next_row, 1))<pic->MCU_Y1)
+	{
+		INSTRUMENT(nb_rows++;)
+		uint_fast32_t MCU_X;
+		for(MCU_X=pic->MCU_X0; MCU_X<pic->MCU_X1; MCU_X++)
+		{
+			uint_fast8_t component;
+			uint_fast8_t data_unit;
+			uint_fast8_t block=0;
+			
+			for(component=0; component<pic->nb_components; component++)
+			{
+				components_data_t const * const comp=&pic->components_data[component];
+				
+				for(data_unit=0; data_unit<comp->V*comp->H; data_unit++, block++)
+				{
+					uint_fast32_t const blockX=MCU_X*comp->H+data_unit%comp->H;
+					uint_fast32_t const blockY=row*comp->V+data_unit/comp->H;
+					memcpy(coefs[block], comp->coefs[blockY*comp->blocks_per_row+blockX], sizeof(coefs[block]));
+					extents[block]=comp->extents[blockY*comp->blocks_per_row+blockX];
+				}
+			}
+			
+			reconstruct_MCU(pic, row*pic->MCUs_per_row+MCU_X, coefs, extents);
+		}
+	}
+	
+	INSTRUMENT(span_end(pic, JPEG_SPAN_RECONSTRUCT, "reconstruction", nb_rows, start);)
+	return NULL;
+}
+
+static void reconstruct_from_coefficients(picture_t * const pic)
+{
+	reconstruct_pool_t pool;
+	pool.pic=pic;
+	atomic_init(&pool.next_row, pic->MCU_Y0);
+	
+	unsigned nb_threads=pic->nb_threads;
+	if(nb_threads>pic->MCU_Y1-pic->MCU_Y0)
+		nb_threads=pic->MCU_Y1-pic->MCU_Y0;
+	
+	pthread_t threads[nb_threads];
+	unsigned t;
+	for(t=1; t<nb_threads; t++)
+		if(pthread_create(&threads[t], NULL, reconstruct_worker, &pool))
+			break;
+	nb_threads=t;
+	
+	reconstruct_worker(&pool);
+	
+	for(t=1; t<nb_threads; t++)
+		pthread_join(threads[t], NULL);
+	
+	log_info(pic, "%lu scans reconstructed on %u threads\n", pic->nb_scans, nb_threads);
+}
+
+//find the RSTn markers of the current scan, pic->restart_offsets[i] is where interval i starts
+static void index_restart_intervals(picture_t * const pic)
+{
+	uint_fast32_t const nb_intervals=(pic->scan_MCUs+pic->restart_interval-1)/pic->restart_interval;
+	
+	pic->restart_offsets=arena_alloc(&pic->arena, nb_intervals*sizeof(uint_fast32_t), pic->error);
+	
+	pic->restart_offsets[0]=pic->pos_compressed_pixeldata;
+	pic->nb_restart_intervals=1;
+	
+	uint_fast32_t pos=pic->pos_compressed_pixeldata;
+	
+	while(true)
+	{
+		uint8_t const * const ff=memchr(&pic->data[pos], 0xFF, pic->filesize-pos);
+		if(!ff || (uint_fast32_t)(ff-pic->data)+1>=pic->filesize)
+			decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+		
+		pos=ff-pic->data;
+		uint8_t byte2=pic->data[pos+1];
+		
+		if(byte2==0x00 || byte2==0xFF) //stuffing or fill byte
+			pos++;
+		else if(byte2>=0xD0 && byte2<=0xD7)
+		{
+			if(byte2!=0xD0+(pic->nb_restart_intervals-1)%8)
+				decode_fail(pic->error, JPEG_ERROR_CORRUPT, "restart marker 0xFF%02X out of sequence at pos %lu", byte2, pos);
+			if(pic->nb_restart_intervals>=nb_intervals)
+				decode_fail(pic->error, JPEG_ERROR_CORRUPT, "more restart markers than restart intervals");
+			
+			pos+=2;
+			pic->restart_offsets[pic->nb_restart_intervals++]=pos;
+		}
+		else
+			break;
+	}
+	
+	if(pic->nb_restart_intervals!=nb_intervals)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "%lu restart intervals found, %lu expected", pic->nb_restart_intervals, nb_intervals);
+	
+	pic->pos_in_file=pos;
+}
+
+typedef struct
+{
+	picture_t * pic;
+	atomic_uint_fast32_t next_interval;
+	atomic_bool failed;
+	decode_error_t error; //of the first worker that failed
+} restart_pool_t;
+
+//thread pool worker: decode restart intervals until none are left
+static void * restart_worker(void * const arg)
+{
+	restart_pool_t * const pool=arg;
+	picture_t * const pic=pool->pic;
+	decode_error_t error;
+	uint_fast32_t i;
+	INSTRUMENT(uint64_t const start=read_tsc(); uint32_t nb_intervals=0;)
+	
+	if(setjmp(error.env))
+	{
+		//the other workers stop before their next interval
+		if(!atomic_exchange(&pool->failed, true))
+			pool->error=error;
+		return NULL;
+	}
+	
+	while(!atomic_load(&pool->failed) && (i=atomic_fetch_add(&pool->next_interval, 1))<pic->nb_restart_intervals)
+	{
+		uint_fast32_t const first_MCU=i*pic->restart_interval;
+		uint_fast32_t nb_MCUs=pic->scan_MCUs-first_MCU;
+		if(nb_MCUs>pic->restart_interval)
+			nb_MCUs=pic->restart_interval;
+		
+		bitstream_t bs;
+		bitstream_init(&bs, pic->data, pic->restart_offsets[i], pic->filesize, &error);
+		INSTRUMENT(nb_intervals++;)
+		
+		if(pic->buffered)
+		{
+			decode_buffered_MCUs(pic, &bs, first_MCU, nb_MCUs);
+			INSTRUMENT(bitstream_done(pic, &bs);)
+			continue;
+		}
+		
+		//intervals without an MCU in the window are skipped without any Huffman decoding
+		nb_MCUs=MCUs_to_decode(pic, first_MCU, nb_MCUs);
+		if(nb_MCUs)
+			decode_MCUs(pic, &bs, first_MCU, nb_MCUs);
+		INSTRUMENT(bitstream_done(pic, &bs);)
+	}
+	
+	INSTRUMENT(span_end(pic, JPEG_SPAN_ENTROPY, "restart intervals", nb_intervals, start);)
+	return NULL;
+}
+
+//restart intervals are independent: decode them on a pool of threads
+static void decode_restart_intervals(picture_t * const pic)
+{
+	index_restart_intervals(pic);
+	
+	restart_pool_t pool;
+	pool.pic=pic;
+	atomic_init(&pool.next_interval, 0);
+	atomic_init(&pool.failed, false);
+	
+	unsigned nb_threads=pic->nb_threads;
+	if(nb_threads>pic->nb_restart_intervals)
+		nb_threads=pic->nb_restart_intervals;
+	
+	//fewer threads if not all of them can be started
+	pthread_t threads[nb_threads];
+	unsigned t;
+	for(t=1; t<nb_threads; t++)
+		if(pthread_create(&threads[t], NULL, restart_worker, &pool))
+			break;
+	nb_threads=t;
+	
+	restart_worker(&pool);
+	
+	for(t=1; t<nb_threads; t++)
+		pthread_join(threads[t], NULL);
+	
+	if(atomic_load(&pool.failed))
+		decode_fail(pic->error, pool.error.status, "%s", pool.error.message);
+	
+	log_info(pic, "%lu restart intervals of %lu MCU decoded on %u threads\n", pic->nb_restart_intervals, pic->restart_interval, nb_threads);
+}
+
+//one buffered scan into the coefficient store
+static void decode_buffered_scan(picture_t * const pic)
+{
+	pic->nb_scans++;
+	
+	//at 1/8 scale only DC is used. At 1/4 and 1/2 AC bands are not skipped: a later refinement scan starting
+	//inside the used coefficients would need the ones of the skipped band to stay in sync
+	if(pic->Ss>0 && pic->block_size==1 && !pic->keep_coefficients && !pic->scan_done)
+	{
+		pic->pos_in_file=skip_scan_data(pic);
+		log_info(pic, "AC scan %u..%u not needed at 1/8 scale, skipped\n", pic->Ss, pic->Se);
+	}
+	else if(!pic->restart_interval)
+	{
+		INSTRUMENT(uint64_t const start=read_tsc();)
+		bitstream_t bs;
+		bitstream_init(&bs, pic->data, pic->pos_compressed_pixeldata, pic->filesize, pic->error);
+		decode_buffered_MCUs(pic, &bs, 0, pic->scan_MCUs);
+		pic->pos_in_file=bitstream_skip_to_marker(&bs);
+		INSTRUMENT(bitstream_done(pic, &bs); span_end(pic, JPEG_SPAN_ENTROPY, "scan", pic->nb_scans, start);)
+	}
+	else
+		decode_restart_intervals(pic);
+	
+	pic->scan_decoded=true;
+	
+	log_info(pic, "scan %lu: %lu bytes of entropy-coded data with stuffing\n", pic->nb_scans, pic->pos_in_file-pic->pos_compressed_pixeldata);
+	
+	if(pic->scan_done)
+		pic->scan_done(pic->scan_done_arg);
+}
+
+static void parse_bitmap_data(picture_t * const pic)
+{
+	if(pic->buffered)
+	{
+		decode_buffered_scan(pic);
+		return;
+	}
+	
+	log_info(pic, "parsing bitstream...\n");
+	
+	if(!pic->restart_interval)
+	{
+		INSTRUMENT(uint64_t const start=read_tsc();)
+		bitstream_t bs;
+		bitstream_init(&bs, pic->data, pic->pos_compressed_pixeldata, pic->filesize, pic->error);
+		if(pic->nb_threads>1 && !pic->keep_coefficients)
+		{
+			decode_MCUs_pipelined(pic, &bs, pic->nb_threads-1);
+			log_info(pic, "entropy decoding pipelined with %u reconstruction threads\n", pic->nb_threads-1);
+		}
+		else
+			decode_MCUs(pic, &bs, 0, MCUs_to_decode(pic, 0, pic->nb_MCU_total));
+		//the MCUs after the window are not decoded, their data is skipped here
+		pic->pos_in_file=bitstream_skip_to_marker(&bs);
+		INSTRUMENT(bitstream_done(pic, &bs); span_end(pic, JPEG_SPAN_ENTROPY, "MCUs", bs.counters.nb_MCUs, start);)
+	}
+	else
+		decode_restart_intervals(pic);
+	
+	pic->scan_decoded=true;
+	
+	log_info(pic, "%lu bytes of entropy-coded data with stuffing\n", pic->pos_in_file-pic->pos_compressed_pixeldata);
+	log_info(pic, "parsed %lu MCU\n", pic->nb_MCU_total);
+}
+
+
+//reset the parser state, the input must already be set. The buffers of the previous picture are dropped,
+//their memory is reused
+static void init_picture(picture_t * const picture)
+{
+	arena_reset(&picture->arena);
+	INSTRUMENT(instrument_reset(picture);)
+	
+	picture->pos_in_file=0;
+	
+	picture->nb_components=0;
+	picture->scan_decoded=false;
+	picture->pos_compressed_pixeldata=0;
+	picture->progressive=false;
+	picture->buffered=false;
+	picture->nb_scans=0;
+	picture->JFIF=false;
+	picture->adobe_transform=-1;
+	picture->scan_done=NULL;
+	picture->quant_tables_defined=0;
+	
+	picture->restart_interval=0;
+	picture->nb_restart_intervals=0;
+	
+	uint_fast8_t i;
+	for(i=0; i<4; i++)
+	{
+		picture->huff_tables[0][i].nb_entries=0;
+		picture->huff_tables[1][i].nb_entries=0;
+	}
+}
+
+//decode from memory the caller keeps alive while parsing, nothing is copied
+static void open_picture_from_memory(uint8_t const * const data, const uint_fast32_t size, picture_t * const picture)
+{
+	if(size<2)
+		decode_fail(picture->error, JPEG_ERROR_TRUNCATED, "%lu bytes of input, not a JPEG file", size);
+	
+	picture->data=data;
+	picture->filesize=size;
+	picture->mapping=NULL;
+	
+	init_picture(picture);
+}
+
+//map the file read-only, markers and entropy-coded data are read straight from the page cache
+static void open_new_picture(char const * const name, picture_t * const picture)
+{
+	int fd=open(name, O_RDONLY);
+	if(fd<0)
+		decode_fail(picture->error, JPEG_ERROR_IO, "open %s failed: %m", name);
+	
+	struct stat st;
+	if(fstat(fd, &st))
+	{
+		close(fd);
+		decode_fail(picture->error, JPEG_ERROR_IO, "fstat %s failed: %m", name);
+	}
+	if(st.st_size<2)
+	{
+		close(fd);
+		decode_fail(picture->error, JPEG_ERROR_TRUNCATED, "%s: not a JPEG file", name);
+	}
+	
+	void * const mapping=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping==MAP_FAILED)
+		decode_fail(picture->error, JPEG_ERROR_IO, "mmap %s failed: %m", name);
+	
+	//only a hint, the restart interval workers read the file in parallel but each of them sequentially
+	madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+	
+	log_info(picture, "%lu bytes mapped from %s\n\n", (uint_fast32_t)st.st_size, name);
+	
+	picture->data=mapping;
+	picture->filesize=st.st_size;
+	picture->mapping=mapping;
+	
+	init_picture(picture);
+}
+
+//the input is not needed anymore once the picture is decoded
+static void release_input(picture_t * const picture)
+{
+	if(picture->mapping)
+		munmap(picture->mapping, picture->filesize);
+	
+	picture->mapping=NULL;
+	picture->data=NULL;
+	picture->filesize=0;
+}
+
+static void free_picture(picture_t * const picture)
+{
+	release_input(picture);
+	
+	arena_free(&picture->arena);
+}
+
+//one marker segment, pos_in_file is just after the marker. The entropy-coded data after SOS is left to the caller
+static void parse_segment(picture_t * const picture, const uint16_t marker)
+{
+	INSTRUMENT(uint64_t const start=read_tsc();)
+	
+	//the callers made sure the whole segment is in the data, each parser has to stop at its end
+	uint_fast32_t end=picture->pos_in_file;
+	if(marker!=0xFFD8 && marker!=0xFFD9)
+		end+=(picture->data[picture->pos_in_file]<<8)|picture->data[picture->pos_in_file+1];
+	
+	switch(marker)
+	{
+		case 0xFFD8:	log_info(picture, "SOI found\n"); break;
+		
+		case 0xFFE0:	parse_APP0(picture); break;
+		case 0xFFDB:	parse_DQT(picture); break;
+		case 0xFFC0:	parse_SOF0(picture); break;
+		case 0xFFC1:	parse_SOF0(picture); break; //extended sequential: 4 tables of each kind, 16 bit DQT, as in SOF0 here
+		case 0xFFC2:	picture->progressive=true; parse_SOF0(picture); break;
+		case 0xFFC4:	parse_DHT(picture); break;
+		case 0xFFDD:	parse_DRI(picture); break;
+		case 0xFFDA:	parse_SOS(picture); break;
+		
+		case 0xFFEE:	parse_APP14(picture); break;
+		
+		case 0xFFD9:	log_info(picture, "EOI found\n"); break;
+		
+		default:
+			if((marker>=0xFFE1 && marker<=0xFFEF) || marker==0xFFFE) //APPn, COM
+				skip_segment(picture, marker);
+			else
+				decode_fail(picture->error, JPEG_ERROR_UNSUPPORTED, "unknown marker 0x%04x pos %lu", marker, picture->pos_in_file);
+			break;
+	}
+	
+	if(picture->pos_in_file!=end)
+		decode_fail(picture->error, JPEG_ERROR_CORRUPT, "marker 0x%04x: segment length does not match its contents", marker);
+	
+	INSTRUMENT(span_end(picture, JPEG_SPAN_HEADERS, "marker segment", marker, start);)
+}
+
+static void parse_picture(picture_t * const picture)
+{
+	while(picture->pos_in_file<=picture->filesize-2)
+	{
+		uint16_t marker;
+		
+		marker=get_marker(picture->data, &(picture->pos_in_file));
+		log_info(picture, "marker: %d\n",marker);
+		
+		//the segment parsers trust the length field, check it against the data first
+		if(marker!=0xFFD8 && marker!=0xFFD9)
+		{
+			if(picture->pos_in_file+2>picture->filesize || picture->pos_in_file+((picture->data[picture->pos_in_file]<<8)|picture->data[picture->pos_in_file+1])>picture->filesize)
+				decode_fail(picture->error, JPEG_ERROR_TRUNCATED, "segment of marker 0x%04x at pos %lu truncated", marker, picture->pos_in_file-2);
+		}
+		
+		parse_segment(picture, marker);
+		if(marker==0xFFDA)
+		{
+			if(picture->headers_only)
+				break;
+			parse_bitmap_data(picture);
+		}
+		
+		log_info(picture, "\n");
+		
+		if(marker==0xFFD9)
+			break;
+	}
+	
+	//with a scan_done callback the last scan was already reconstructed for it
+	if(picture->buffered && picture->scan_decoded && !picture->keep_coefficients && !picture->scan_done)
+		reconstruct_from_coefficients(picture);
+}
+
+//chroma upsampling, one output row at a time
+//the fancy filters weight the nearest input sample by 3/4 and its neighbour by 1/4 (libjpeg's jdsample.c),
+//edge samples are replicated. w is the input width, 2*w samples are written
+
+static void upsample_h2_nearest(uint8_t const * const inp, uint8_t * const outp, const uint_fast32_t w)
+{
+	uint_fast32_t i;
+	
+	for(i=0; i<w; i++)
+	{
+		outp[2*i+0]=inp[i];
+		outp[2*i+1]=inp[i];
+	}
+}
+
+//4:2:2
+static void upsample_h2v1_fancy(uint8_t const * const inp, uint8_t * const outp, const uint_fast32_t w)
+{
+	uint_fast32_t i;
+	
+	if(w==1)
+	{
+		outp[0]=outp[1]=inp[0];
+		return;
+	}
+	
+	outp[0]=inp[0];
+	outp[1]=(inp[0]*3+inp[1]+2)>>2;
+	
+	for(i=1; i<w-1; i++)
+	{
+		int_fast32_t const v=inp[i]*3;
+		outp[2*i+0]=(v+inp[i-1]+1)>>2;
+		outp[2*i+1]=(v+inp[i+1]+2)>>2;
+	}
+	
+	outp[2*i+0]=(inp[i]*3+inp[i-1]+1)>>2;
+	outp[2*i+1]=inp[i];
+}
+
+//4:2:0, near is the input row closest to the output row, far the one on the other side of it
+static void upsample_h2v2_fancy(uint8_t const * const near, uint8_t const * const far, uint8_t * const outp, const uint_fast32_t w)
+{
+	uint_fast32_t i;
+	int_fast32_t last, this, next;
+	
+	this=near[0]*3+far[0];
+	
+	if(w==1)
+	{
+		outp[0]=(this*4+8)>>4;
+		outp[1]=(this*4+7)>>4;
+		return;
+	}
+	
+	next=near[1]*3+far[1];
+	outp[0]=(this*4+8)>>4;
+	outp[1]=(this*3+next+7)>>4;
+	
+	for(i=1; i<w-1; i++)
+	{
+		last=this;
+		this=next;
+		next=near[i+1]*3+far[i+1];
+		outp[2*i+0]=(this*3+last+8)>>4;
+		outp[2*i+1]=(this*3+next+7)>>4;
+	}
+	
+	outp[2*i+0]=(next*3+this+8)>>4;
+	outp[2*i+1]=(next*4+7)>>4;
+}
+
+//4:4:0, bottom tells whether the output row is the lower one of its pair
+static void upsample_h1v2_fancy(uint8_t const * const near, uint8_t const * const far, const bool bottom, uint8_t * const outp, const uint_fast32_t w)
+{
+	uint_fast32_t i;
+	uint_fast8_t const bias=bottom ? 2 : 1;
+	
+	for(i=0; i<w; i++)
+		outp[i]=(near[i]*3+far[i]+bias)>>2;
+}
+
+//row y of a component at full resolution, for the columns of the MCU window, either straight from its plane or
+//upsampled into buf (which must hold 2*stride of the luma component). Ratios other than 1 and 2 are always replicated
+static uint8_t const * upsample_row(picture_t const * const pic, const uint_fast8_t component, const uint_fast32_t y, uint8_t * const buf)
+{
+	components_data_t const * const comp=&pic->components_data[component];
+	uint_fast32_t const row=y/comp->zoomY;
+	uint8_t const * const src=&comp->pixels[((row-comp->plane_y0)%comp->plane_rows)*comp->stride];
+	uint_fast32_t x;
+	
+	if(comp->zoomX==1 && comp->zoomY==1)
+		return src;
+	
+	if(pic->upsampling==UPSAMPLE_FANCY && comp->zoomX<=2 && comp->zoomY<=2)
+	{
+		if(comp->zoomY==1)
+		{
+			upsample_h2v1_fancy(src, buf, comp->plane_width);
+			return buf;
+		}
+		
+		//the neighbouring row is above for the upper output row of a pair, below for the lower one
+		uint_fast32_t far_row=row;
+		if(y&1)
+		{
+			if(row+1<comp->yi)
+				far_row=row+1;
+		}
+		else if(row>0)
+			far_row=row-1;
+		uint8_t const * const far=&comp->pixels[((far_row-comp->plane_y0)%comp->plane_rows)*comp->stride];
+		
+		if(comp->zoomX==2)
+			upsample_h2v2_fancy(src, far, buf, comp->plane_width);
+		else
+			upsample_h1v2_fancy(src, far, y&1, buf, comp->plane_width);
+		return buf;
+	}
+	
+	if(comp->zoomX==1)
+		return src;
+	
+	if(comp->zoomX==2)
+	{
+		upsample_h2_nearest(src, buf, comp->plane_width);
+		return buf;
+	}
+	
+	for(x=0; x<pic->window_width; x++)
+		buf[x]=src[x/comp->zoomX];
+	
+	return buf;
+}
+
+//a*b/255 rounded, for 8 bit a and b
+static inline uint8_t mul_div255(const uint_fast32_t a, const uint_fast32_t b)
+{
+	uint_fast32_t const t=a*b+128;
+	return (t+(t>>8))>>8;
+}
+
+static void gray_to_rgb_row(uint8_t const * const Y, uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+		rgb[3*x+0]=rgb[3*x+1]=rgb[3*x+2]=Y[x];
+}
+
+static void interleave_rgb_row(uint8_t const * const R, uint8_t const * const G, uint8_t const * const B, uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+	{
+		rgb[3*x+0]=R[x];
+		rgb[3*x+1]=G[x];
+		rgb[3*x+2]=B[x];
+	}
+}
+
+//Adobe CMYK is stored inverted, 255 for no ink, as Photoshop writes it: the red of a naive render is C*K/255
+static void cmyk_to_rgb_row(uint8_t const * const C, uint8_t const * const M, uint8_t const * const Y, uint8_t const * const K, uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+	{
+		rgb[3*x+0]=mul_div255(C[x], K[x]);
+		rgb[3*x+1]=mul_div255(M[x], K[x]);
+		rgb[3*x+2]=mul_div255(Y[x], K[x]);
+	}
+}
+
+//YCCK: the YCbCr conversion gave 255 minus the inverted CMY (libjpeg's ycck_cmyk_convert), then as CMYK
+static void ycck_apply_black_row(uint8_t * const rgb, uint8_t const * const K, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+	{
+		rgb[3*x+0]=mul_div255(255-rgb[3*x+0], K[x]);
+		rgb[3*x+1]=mul_div255(255-rgb[3*x+1], K[x]);
+		rgb[3*x+2]=mul_div255(255-rgb[3*x+2], K[x]);
+	}
+}
+
+//row y of the crop rectangle of every component at full resolution, upsampled into bufs where needed
+static void picture_row_upsample(picture_t const * const pic, const uint_fast32_t y, uint8_t * const bufs[4], uint8_t const * row[4])
+{
+	uint_fast32_t const x0=pic->crop_X-pic->MCU_X0*pic->Hmax*pic->block_size;
+	uint_fast8_t i;
+	
+	for(i=0; i<pic->nb_components; i++)
+		row[i]=&upsample_row(pic, i, pic->crop_Y+y, bufs[i])[x0];
+}
+
+static void picture_row_convert(picture_t const * const pic, uint8_t const * const row[4], uint8_t * const rgb)
+{
+	uint_fast32_t const n=pic->crop_W;
+	
+	switch(pic->color_space)
+	{
+		case JPEG_COLOR_GRAY:
+			gray_to_rgb_row(row[0], rgb, n);
+			break;
+		case JPEG_COLOR_RGB:
+			interleave_rgb_row(row[0], row[1], row[2], rgb, n);
+			break;
+		case JPEG_COLOR_CMYK:
+			cmyk_to_rgb_row(row[0], row[1], row[2], row[3], rgb, n);
+			break;
+		case JPEG_COLOR_YCCK:
+			pic->kernels.color_convert_row(row[0], row[1], row[2], rgb, n);
+			ycck_apply_black_row(rgb, row[3], n);
+			break;
+		default:
+			pic->kernels.color_convert_row(row[0], row[1], row[2], rgb, n);
+	}
+}
+
+//upsampling and color conversion of row y of the crop rectangle, done back to back so the chroma rows stay in L1
+static void picture_row_to_rgb(picture_t const * const pic, const uint_fast32_t y, uint8_t * const bufs[4], uint8_t * const rgb)
+{
+	uint8_t const * row[4];
+	
+	picture_row_upsample(pic, y, bufs, row);
+	picture_row_convert(pic, row, rgb);
+}
+
+//RGB -> BGR in place
+static void swap_red_blue_row(uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=0; x<n; x++)
+	{
+		uint8_t const r=rgb[3*x+0];
+		rgb[3*x+0]=rgb[3*x+2];
+		rgb[3*x+2]=r;
+	}
+}
+
+//RGB -> RGBA with opaque alpha, in place: rgb must hold 4*n bytes, walks backwards so nothing is overwritten before use
+static void expand_to_rgba_row(uint8_t * const rgb, const uint_fast32_t n)
+{
+	uint_fast32_t x;
+	
+	for(x=n; x-->0; )
+	{
+		rgb[4*x+3]=255;
+		rgb[4*x+2]=rgb[3*x+2];
+		rgb[4*x+1]=rgb[3*x+1];
+		rgb[4*x+0]=rgb[3*x+0];
+	}
+}
+
+
+//one output row in the requested pixel format, out must hold jpeg_bytes_per_pixel(format)*crop_W bytes
+static void picture_row_to_format(picture_t const * const pic, const uint_fast32_t y, uint8_t * const bufs[4], const jpeg_pixel_format_t format, uint8_t * const out)
+{
+	picture_row_to_rgb(pic, y, bufs, out);
+	
+	if(format==JPEG_PIXEL_BGR)
+		swap_red_blue_row(out, pic->crop_W);
+	else if(format==JPEG_PIXEL_RGBA)
+		expand_to_rgba_row(out, pic->crop_W);
+}
+
+//upsampling row buffers, wide enough for the current picture
+static void picture_alloc_row_buffers(picture_t * const pic, uint8_t * bufs[4])
+{
+	uint_fast32_t const size=2*pic->MCUs_per_row*pic->Hmax*pic->block_size;
+	uint_fast8_t i;
+	
+	for(i=0; i<pic->nb_components; i++)
+		bufs[i]=arena_alloc(&pic->arena, size, pic->error);
+}
+
+
+void jpeg_default_options(jpeg_options_t * const options)
+{
+	options->idct_method=IDCT_ISLOW;
+	options->upsampling=UPSAMPLE_FANCY;
+	options->nb_threads=1;
+	options->arena_bytes=0;
+	options->scale_denom=1;
+	options->crop_x=0;
+	options->crop_y=0;
+	options->crop_width=0;
+	options->crop_height=0;
+	options->verbose=false;
+	options->preview=NULL;
+	options->preview_user=NULL;
+}
+
+char const * jpeg_status_string(const jpeg_status_t status)
+{
+	switch(status)
+	{
+		case JPEG_OK:					return "no error";
+		case JPEG_ERROR_IO:				return "I/O error";
+		case JPEG_ERROR_NOMEM:			return "out of memory";
+		case JPEG_ERROR_UNSUPPORTED:	return "unsupported JPEG feature";
+		case JPEG_ERROR_CORRUPT:		return "corrupt JPEG data";
+		case JPEG_ERROR_TRUNCATED:		return "JPEG data truncated";
+		case JPEG_ERROR_ARGUMENT:		return "invalid argument";
+	}
+	return "unknown error";
+}
+
+uint_fast8_t jpeg_bytes_per_pixel(const jpeg_pixel_format_t format)
+{
+	return format==JPEG_PIXEL_RGBA ? 4 : 3;
+}
+
+static bool options_valid(jpeg_options_t const * const options)
+{
+	uint_fast8_t const scale=options->scale_denom;
+	
+	return options->idct_method<=IDCT_IFAST && options->upsampling<=UPSAMPLE_FANCY && options->nb_threads>=1
+		&& (scale==1 || scale==2 || scale==4 || scale==8) && (options->crop_width>0)==(options->crop_height>0)
+		&& options->crop_x+options->crop_width<=UINT16_MAX && options->crop_y+options->crop_height<=UINT16_MAX;
+}
+
+static void picture_set_options(picture_t * const pic, jpeg_options_t const * const options)
+{
+	pic->idct_method=options->idct_method;
+	pic->upsampling=options->upsampling;
+	pic->nb_threads=options->nb_threads;
+	pic->scale_denom=options->scale_denom;
+	pic->requested_crop_X=options->crop_x;
+	pic->requested_crop_Y=options->crop_y;
+	pic->requested_crop_W=options->crop_width;
+	pic->requested_crop_H=options->crop_height;
+	pic->verbose=options->verbose;
+	select_kernels(&pic->kernels);
+}
+
+
+//JPEG writing, for the lossless transforms
+typedef struct
+{
+	uint8_t * buf;
+	size_t size;
+	size_t capacity; //kept from one picture to the next
+	uint64_t acc; //pending bits of the entropy-coded data, the last nb_bits of it
+	uint_fast8_t nb_bits;
+	decode_error_t * error;
+} jpeg_writer_t;
+
+static void writer_reserve(jpeg_writer_t * const w, const size_t nb_bytes)
+{
+	if(w->size+nb_bytes<=w->capacity)
+		return;
+	
+	size_t capacity=w->capacity ? 2*w->capacity : 65536;
+	while(capacity<w->size+nb_bytes)
+		capacity*=2;
+	
+	uint8_t * const buf=realloc(w->buf, capacity);
+	if(!buf)
+		decode_fail(w->error, JPEG_ERROR_NOMEM, "realloc %zu bytes of output", capacity);
+	w->buf=buf;
+	w->capacity=capacity;
+}
+
+//marker segments, the caller reserves the space
+static void writer_byte(jpeg_writer_t * const w, const uint8_t byte)
+{
+	w->buf[w->size++]=byte;
+}
+
+static void writer_word(jpeg_writer_t * const w, const uint16_t word)
+{
+	w->buf[w->size++]=word>>8;
+	w->buf[w->size++]=word&0xFF;
+}
+
+//one byte of entropy-coded data, 0xFF is followed by a stuffed 0x00
+static void writer_stuffed_byte(jpeg_writer_t * const w, const uint8_t byte)
+{
+	w->buf[w->size++]=byte;
+	if(byte==0xFF)
+		w->buf[w->size++]=0x00;
+}
+
+//entropy-coded data, up to 16 bits at a time. Whole 32 bit words are written at once unless they hold a 0xFF byte
+static void writer_bits(jpeg_writer_t * const w, const uint_fast32_t bits, const uint_fast8_t nb_bits)
+{
+	w->acc=(w->acc<<nb_bits)|bits;
+	w->nb_bits+=nb_bits;
+	
+	if(w->nb_bits<32)
+		return;
+	
+	w->nb_bits-=32;
+	uint32_t const word=w->acc>>w->nb_bits;
+	uint32_t const inverted=~word;
+	
+	if(!((inverted-0x01010101)&~inverted&0x80808080)) //no zero byte in ~word
+	{
+		uint32_t const big_endian=__builtin_bswap32(word);
+		memcpy(&w->buf[w->size], &big_endian, 4);
+		w->size+=4;
+	}
+	else
+	{
+		writer_stuffed_byte(w, word>>24);
+		writer_stuffed_byte(w, (word>>16)&0xFF);
+		writer_stuffed_byte(w, (word>>8)&0xFF);
+		writer_stuffed_byte(w, word&0xFF);
+	}
+}
+
+//the bits left, the last byte is padded with 1-bits
+static void writer_flush_bits(jpeg_writer_t * const w)
+{
+	if(w->nb_bits%8)
+		writer_bits(w, (1<<(8-w->nb_bits%8))-1, 8-w->nb_bits%8);
+	
+	while(w->nb_bits)
+	{
+		w->nb_bits-=8;
+		writer_stuffed_byte(w, (w->acc>>w->nb_bits)&0xFF);
+	}
+}
+
+typedef struct
+{
+	uint32_t freq[256]; //symbol counts of the first pass
+	uint8_t bits[17]; //number of codes of each length, index 1..16
+	uint8_t huffval[256];
+	uint_fast16_t nb_values;
+	uint16_t code[256];
+	uint8_t size[256]; //code length, 0 if the symbol does not occur
+} huffman_encoder_t;
+
+//optimal code lengths limited to 16 bits, from the symbol counts (JPEG standard K.2 and K.3, as libjpeg's
+//jpeg_gen_optimal_table). A reserved symbol keeps any code from being all 1-bits
+static void huff_build_encoder(huffman_encoder_t * const table)
+{
+	uint32_t freq[257];
+	uint_fast16_t codesize[257];
+	int_fast16_t others[257];
+	uint_fast16_t bits[258];
+	int_fast16_t i, j, c1, c2;
+	
+	memcpy(freq, table->freq, sizeof(table->freq));
+	freq[256]=1;
+	memset(codesize, 0, sizeof(codesize));
+	memset(bits, 0, sizeof(bits));
+	for(i=0; i<257; i++)
+		others[i]=-1;
+	
+	while(true)
+	{
+		//the two least frequent subtrees, the larger symbol first on ties
+		uint32_t v=UINT32_MAX;
+		c1=-1;
+		for(i=0; i<257; i++)
+		{
+			if(freq[i] && freq[i]<=v)
+			{
+				v=freq[i];
+				c1=i;
+			}
+		}
+		
+		v=UINT32_MAX;
+		c2=-1;
+		for(i=0; i<257; i++)
+		{
+			if(freq[i] && freq[i]<=v && i!=c1)
+			{
+				v=freq[i];
+				c2=i;
+			}
+		}
+		
+		if(c2<0)
+			break;
+		
+		freq[c1]+=freq[c2];
+		freq[c2]=0;
+		
+		codesize[c1]++;
+		while(others[c1]>=0)
+		{
+			c1=others[c1];
+			codesize[c1]++;
+		}
+		others[c1]=c2;
+		
+		codesize[c2]++;
+		while(others[c2]>=0)
+		{
+			c2=others[c2];
+			codesize[c2]++;
+		}
+	}
+	
+	for(i=0; i<257; i++)
+		if(codesize[i])
+			bits[codesize[i]]++;
+	
+	//codes longer than 16 bits: a pair of the longest ones is replaced by a code one bit shorter
+	for(i=256; i>16; i--)
+	{
+		while(bits[i]>0)
+		{
+			j=i-2;
+			while(bits[j]==0)
+				j--;
+			
+			bits[i]-=2;
+			bits[i-1]++;
+			bits[j+1]+=2;
+			bits[j]--;
+		}
+	}
+	
+	//the reserved symbol has one of the longest codes
+	for(i=16; bits[i]==0; i--)
+		;
+	bits[i]--;
+	
+	table->nb_values=0;
+	table->bits[0]=0;
+	for(i=1; i<=16; i++)
+	{
+		table->bits[i]=bits[i];
+		table->nb_values+=bits[i];
+	}
+	
+	//symbols by code length before limiting, then canonical codes
+	uint_fast16_t k=0;
+	for(i=1; i<=256 && k<table->nb_values; i++)
+		for(j=0; j<256; j++)
+			if(codesize[j]==(uint_fast16_t)i)
+				table->huffval[k++]=j;
+	
+	memset(table->size, 0, sizeof(table->size));
+	uint_fast16_t code=0;
+	k=0;
+	for(i=1; i<=16; i++)
+	{
+		for(j=0; j<table->bits[i]; j++, k++)
+		{
+			table->code[table->huffval[k]]=code++;
+			table->size[table->huffval[k]]=i;
+		}
+		code<<=1;
+	}
+}
+
+//entropy coding of a scan, twice: first the symbols are counted to build the tables, then written
+typedef struct
+{
+	jpeg_writer_t * w; //NULL while counting
+	huffman_encoder_t dc[4];
+	huffman_encoder_t ac[4];
+	decode_error_t * error;
+} scan_encoder_t;
+
+static uint_fast8_t magnitude_category(const int_fast32_t v)
+{
+	uint_fast32_t const a=v<0 ? -v : v;
+	
+	return a ? 32-__builtin_clz(a) : 0;
+}
+
+static void encode_symbol(scan_encoder_t * const enc, huffman_encoder_t * const table, const uint8_t symbol)
+{
+	if(enc->w)
+		writer_bits(enc->w, table->code[symbol], table->size[symbol]);
+	else
+		table->freq[symbol]++;
+}
+
+//the SSSS low bits of v, negative values as v-1 (F.1.2.1)
+static void encode_extra_bits(scan_encoder_t * const enc, const int_fast32_t v, const uint_fast8_t SSSS)
+{
+	if(enc->w && SSSS)
+		writer_bits(enc->w, (v<0 ? v-1 : v)&((1<<SSSS)-1), SSSS);
+}
+
+//one block of quantized coefficients, coefficient k in zigzag order is coefs[order[k]] negated where negate[k] is -1.
+//The AC coefficients inside the block's extent are gathered first with a mask of the non-zero ones, so the runs
+//of zeros cost no branches
+static void encode_block(scan_encoder_t * const enc, int16_t const coefs[64], const uint8_t extent, uint8_t const order[64], int16_t const negate[64], int16_t * const last_DC, huffman_encoder_t * const dc_table, huffman_encoder_t * const ac_table)
+{
+	int_fast32_t const diff=coefs[0]-*last_DC; //the DC coefficient never moves
+	uint_fast8_t SSSS=magnitude_category(diff);
+	int16_t zigzag[64];
+	uint64_t nonzero=0;
+	uint_fast8_t k, last=0;
+	
+	*last_DC=coefs[0];
+	
+	if(SSSS>11)
+		decode_fail(enc->error, JPEG_ERROR_CORRUPT, "DC difference %ld out of range", diff);
+	encode_symbol(enc, dc_table, SSSS);
+	encode_extra_bits(enc, diff, SSSS);
+	
+	uint_fast8_t const end=extent_zigzag_end[extent];
+	for(k=1; k<end; k++)
+	{
+		zigzag[k]=(coefs[order[k]]^negate[k])-negate[k];
+		nonzero|=(uint64_t)(zigzag[k]!=0)<<k;
+	}
+	
+	while(nonzero)
+	{
+		k=__builtin_ctzll(nonzero);
+		nonzero&=nonzero-1;
+		
+		uint_fast8_t run=k-last-1;
+		for(; run>15; run-=16)
+			encode_symbol(enc, ac_table, 0xF0); //ZRL
+		
+		SSSS=magnitude_category(zigzag[k]);
+		if(SSSS>10)
+			decode_fail(enc->error, JPEG_ERROR_CORRUPT, "AC coefficient %d out of range", zigzag[k]);
+		encode_symbol(enc, ac_table, (run<<4)|SSSS);
+		encode_extra_bits(enc, zigzag[k], SSSS);
+		last=k;
+	}
+	
+	if(last<63)
+		encode_symbol(enc, ac_table, 0x00); //EOB
+}
+
+struct jpeg_decoder
+{
+	picture_t pic; //keeps its buffers from one picture to the next
+	
+	decode_error_t error;
+	
+	bool decoded; //pic holds a complete picture
+	
+	uint8_t * bufs[4]; //upsampling, NULL until allocated for the current picture
+	
+	jpeg_writer_t writer; //output of the lossless transforms
+	
+	void (* preview)(jpeg_decoder_t * const dec, const unsigned scan, void * const user);
+	void * preview_user;
+};
+
+jpeg_decoder_t * jpeg_decoder_create(jpeg_options_t const * const options)
+{
+	if(!options_valid(options))
+		return NULL;
+	
+	jpeg_decoder_t * const dec=calloc(1, sizeof(jpeg_decoder_t));
+	if(!dec)
+		return NULL;
+	
+	picture_set_options(&dec->pic, options);
+	dec->pic.error=&dec->error;
+	dec->writer.error=&dec->error;
+	dec->preview=options->preview;
+	dec->preview_user=options->preview_user;
+	
+	if(!arena_reserve(&dec->pic.arena, options->arena_bytes))
+	{
+		free(dec);
+		return NULL;
+	}
+	
+	return dec;
+}
+
+void jpeg_decoder_destroy(jpeg_decoder_t * const dec)
+{
+	if(!dec)
+		return;
+	
+	free_picture(&dec->pic);
+	free(dec->writer.buf);
+	free(dec);
+}
+
+//decode from data or, if it is NULL, from the file filename
+//progressive (or other buffered) picture: the picture so far is handed to the preview callback after each scan
+static void decoder_preview(void * const arg)
+{
+	jpeg_decoder_t * const dec=arg;
+	
+	reconstruct_from_coefficients(&dec->pic);
+	if(!dec->bufs[0])
+		picture_alloc_row_buffers(&dec->pic, dec->bufs);
+	
+	dec->decoded=true;
+	dec->preview(dec, dec->pic.nb_scans, dec->preview_user);
+	dec->decoded=false;
+}
+
+static jpeg_status_t decoder_run(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, char const * const filename)
+{
+	picture_t * const pic=&dec->pic;
+	
+	dec->decoded=false;
+	dec->bufs[0]=NULL;
+	dec->error.status=JPEG_OK;
+	dec->error.message[0]='\0';
+	
+	if(setjmp(dec->error.env))
+	{
+		release_input(pic);
+		return dec->error.status;
+	}
+	
+	if(data)
+		open_picture_from_memory(data, size, pic);
+	else
+		open_new_picture(filename, pic);
+	
+	if(dec->preview)
+	{
+		pic->scan_done=decoder_preview;
+		pic->scan_done_arg=dec;
+	}
+	
+	parse_picture(pic);
+	
+	if(!pic->scan_decoded)
+		decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "no scan in the data");
+	
+	if(!dec->bufs[0])
+		picture_alloc_row_buffers(pic, dec->bufs);
+	
+	release_input(pic);
+	dec->decoded=true;
+	return JPEG_OK;
+}
+
+jpeg_status_t jpeg_decode_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size)
+{
+	if(!data)
+		return JPEG_ERROR_ARGUMENT;
+	
+	return decoder_run(dec, data, size, NULL);
+}
+
+jpeg_status_t jpeg_decode_file(jpeg_decoder_t * const dec, char const * const filename)
+{
+	return decoder_run(dec, NULL, 0, filename);
+}
+
+void jpeg_get_size(jpeg_decoder_t const * const dec, uint32_t * const size_X, uint32_t * const size_Y)
+{
+	*size_X=dec->decoded ? dec->pic.crop_W : 0;
+	*size_Y=dec->decoded ? dec->pic.crop_H : 0;
+}
+
+jpeg_status_t jpeg_read_rows(jpeg_decoder_t * const dec, const uint32_t first_row, const uint32_t nb_rows, const jpeg_pixel_format_t format, uint8_t * const out, const size_t stride)
+{
+	if(!dec->decoded || format>JPEG_PIXEL_RGBA || first_row>dec->pic.crop_H || nb_rows>dec->pic.crop_H-first_row)
+		return JPEG_ERROR_ARGUMENT;
+	
+	INSTRUMENT(uint64_t const start=read_tsc();)
+	uint32_t i;
+	for(i=0; i<nb_rows; i++)
+		picture_row_to_format(&dec->pic, first_row+i, dec->bufs, format, &out[i*stride]);
+	
+	INSTRUMENT(span_end(&dec->pic, JPEG_SPAN_OUTPUT, "rows", nb_rows, start);)
+	return JPEG_OK;
+}
+
+char const * jpeg_error_message(jpeg_decoder_t const * const dec)
+{
+	return dec->error.message;
+}
+
+char const * jpeg_kernels_name(jpeg_decoder_t const * const dec)
+{
+	return dec->pic.kernels.name;
+}
+
+size_t jpeg_arena_peak(jpeg_decoder_t const * const dec)
+{
+	return dec->pic.arena.peak;
+}
+
+
+//lossless transforms: the quantized coefficients are rearranged and entropy-coded again, nothing is
+//dequantized or transformed, so the pixels do not change
+typedef struct
+{
+	bool transpose;
+	bool mirror_x; //along the source's axes, before transposing
+	bool mirror_y;
+} transform_axes_t;
+
+static const transform_axes_t transform_axes[]=
+{
+	[JPEG_TRANSFORM_NONE]={false, false, false},
+	[JPEG_TRANSFORM_FLIP_H]={false, true, false},
+	[JPEG_TRANSFORM_FLIP_V]={false, false, true},
+	[JPEG_TRANSFORM_TRANSPOSE]={true, false, false},
+	[JPEG_TRANSFORM_TRANSVERSE]={true, true, true},
+	[JPEG_TRANSFORM_ROT_90]={true, false, true},
+	[JPEG_TRANSFORM_ROT_180]={false, true, true},
+	[JPEG_TRANSFORM_ROT_270]={true, true, false}
+};
+
+typedef struct
+{
+	transform_axes_t axes;
+	uint_fast32_t region_MCU_X; //first MCU of the region, relative to the MCU window
+	uint_fast32_t region_MCU_Y;
+	uint_fast32_t region_MCUs_X; //MCUs of the region along the source's axes
+	uint_fast32_t region_MCUs_Y;
+	uint8_t src_index[64]; //coefficient of the source block that becomes each coefficient of the output block
+	uint8_t src_index_zigzag[64]; //the same in zigzag order, for the encoder
+	int16_t negate_zigzag[64]; //-1 where mirroring negates the coefficient: odd frequencies along a mirrored axis
+} block_transform_t;
+
+static void block_transform_init(block_transform_t * const t)
+{
+	uint_fast8_t i;
+	
+	for(i=0; i<64; i++)
+	{
+		uint_fast8_t const v=i/8;
+		uint_fast8_t const u=i%8;
+		uint_fast8_t const v_src=t->axes.transpose ? u : v;
+		uint_fast8_t const u_src=t->axes.transpose ? v : u;
+		
+		t->src_index[i]=v_src*8+u_src;
+	}
+	
+	for(i=0; i<64; i++)
+	{
+		uint_fast8_t const src=t->src_index[zigzag_to_natural[i]];
+		
+		t->src_index_zigzag[i]=src;
+		t->negate_zigzag[i]=((t->axes.mirror_x && (src&1)) != (t->axes.mirror_y && ((src/8)&1))) ? -1 : 0;
+	}
+}
+
+//the output scan in MCU order, each block fetched from its place in the source region
+static void transform_scan(picture_t const * const pic, block_transform_t const * const t, scan_encoder_t * const enc)
+{
+	int16_t last_DC[4]={0, 0, 0, 0};
+	
+	uint_fast32_t const MCUs_X=t->axes.transpose ? t->region_MCUs_Y : t->region_MCUs_X;
+	uint_fast32_t const MCUs_Y=t->axes.transpose ? t->region_MCUs_X : t->region_MCUs_Y;
+	uint_fast32_t MCU_X, MCU_Y;
+	uint_fast8_t component;
+	
+	for(MCU_Y=0; MCU_Y<MCUs_Y; MCU_Y++)
+	{
+		if(enc->w)
+			writer_reserve(enc->w, MCUs_X*pic->Hmax*pic->Vmax*pic->nb_components*512);
+		
+		for(MCU_X=0; MCU_X<MCUs_X; MCU_X++)
+		{
+			for(component=0; component<pic->nb_components; component++)
+			{
+				components_data_t const * const comp=&pic->components_data[component];
+				uint_fast8_t const H=t->axes.transpose ? comp->V : comp->H;
+				uint_fast8_t const V=t->axes.transpose ? comp->H : comp->V;
+				uint_fast32_t const src_blocks_X=t->region_MCUs_X*comp->H;
+				uint_fast32_t const src_blocks_Y=t->region_MCUs_Y*comp->V;
+				uint_fast8_t x, y;
+				
+				for(y=0; y<V; y++)
+				{
+					for(x=0; x<H; x++)
+					{
+						uint_fast32_t const X=MCU_X*H+x;
+						uint_fast32_t const Y=MCU_Y*V+y;
+						uint_fast32_t a=t->axes.transpose ? Y : X;
+						uint_fast32_t b=t->axes.transpose ? X : Y;
+						
+						if(t->axes.mirror_x)
+							a=src_blocks_X-1-a;
+						if(t->axes.mirror_y)
+							b=src_blocks_Y-1-b;
+						
+						uint_fast32_t const block=(t->region_MCU_Y*comp->V+b)*comp->blocks_per_row+t->region_MCU_X*comp->H+a;
+						encode_block(enc, comp->coefs[block], comp->extents[block], t->src_index_zigzag, t->negate_zigzag, &last_DC[component], &enc->dc[comp->Td], &enc->ac[comp->Ta]);
+					}
+				}
+			}
+		}
+	}
+}
+
+static void write_DHT(jpeg_writer_t * const w, huffman_encoder_t const * const table, const uint8_t TcTh)
+{
+	uint_fast16_t i;
+	
+	writer_reserve(w, 4+1+16+table->nb_values);
+	writer_word(w, 0xFFC4);
+	writer_word(w, 2+1+16+table->nb_values);
+	writer_byte(w, TcTh);
+	for(i=1; i<=16; i++)
+		writer_byte(w, table->bits[i]);
+	for(i=0; i<table->nb_values; i++)
+		writer_byte(w, table->huffval[i]);
+}
+
+//baseline JPEG of the transformed region: JFIF, quantization tables, frame, optimized Huffman tables, one interleaved scan
+static void write_transformed(picture_t * const pic, const jpeg_transform_t transform, jpeg_writer_t * const w)
+{
+	block_transform_t t;
+	t.axes=transform_axes[transform];
+	block_transform_init(&t);
+	
+	//the crop rectangle grows up and left to the MCU grid. Along a mirrored axis a partial MCU at the far edge would
+	//end up at the near one, where it cannot be represented, so the region is trimmed to whole MCUs there
+	uint_fast32_t const MCU_width=8*pic->Hmax;
+	uint_fast32_t const MCU_height=8*pic->Vmax;
+	uint_fast32_t const x0=pic->crop_X/MCU_width*MCU_width;
+	uint_fast32_t const y0=pic->crop_Y/MCU_height*MCU_height;
+	uint_fast32_t width=pic->crop_X+pic->crop_W-x0;
+	uint_fast32_t height=pic->crop_Y+pic->crop_H-y0;
+	
+	if(t.axes.mirror_x)
+		width=width/MCU_width*MCU_width;
+	if(t.axes.mirror_y)
+		height=height/MCU_height*MCU_height;
+	if(!width || !height)
+		decode_fail(pic->error, JPEG_ERROR_ARGUMENT, "region smaller than one %lu x %lu MCU along a mirrored axis", MCU_width, MCU_height);
+	
+	t.region_MCU_X=x0/MCU_width-pic->coefs_MCU_X0;
+	t.region_MCU_Y=y0/MCU_height-pic->coefs_MCU_Y0;
+	t.region_MCUs_X=(width+MCU_width-1)/MCU_width;
+	t.region_MCUs_Y=(height+MCU_height-1)/MCU_height;
+	
+	uint_fast32_t const out_X=t.axes.transpose ? height : width;
+	uint_fast32_t const out_Y=t.axes.transpose ? width : height;
+	if(out_X>0xFFFF || out_Y>0xFFFF)
+		decode_fail(pic->error, JPEG_ERROR_ARGUMENT, "%lu x %lu output too large", out_X, out_Y);
+	
+	log_info(pic, "transform %u: %lu x %lu region at %lu,%lu -> %lu x %lu\n", transform, width, height, x0, y0, out_X, out_Y);
+	
+	//first pass: symbol statistics of each Huffman table
+	scan_encoder_t * const enc=arena_alloc(&pic->arena, sizeof(scan_encoder_t), pic->error);
+	memset(enc, 0, sizeof(scan_encoder_t));
+	enc->error=pic->error;
+	transform_scan(pic, &t, enc);
+	
+	uint_fast8_t used_dc=0, used_ac=0;
+	uint_fast8_t i, j, k;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		used_dc|=1<<pic->components_data[i].Td;
+		used_ac|=1<<pic->components_data[i].Ta;
+	}
+	
+	//the tables the components were decoded with get a slot each, components with the same one share it
+	uint_fast8_t Tq[4];
+	uint_fast8_t nb_quant=0;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		for(j=0; j<i; j++)
+			if(!memcmp(pic->components_data[j].quant, pic->components_data[i].quant, sizeof(quantization_table_t)))
+				break;
+		Tq[i]=j<i ? Tq[j] : nb_quant++;
+	}
+	
+	for(i=0; i<4; i++)
+	{
+		if(used_dc&(1<<i))
+			huff_build_encoder(&enc->dc[i]);
+		if(used_ac&(1<<i))
+			huff_build_encoder(&enc->ac[i]);
+	}
+	
+	w->size=0;
+	w->acc=0;
+	w->nb_bits=0;
+	writer_reserve(w, 1024);
+	
+	writer_word(w, 0xFFD8); //SOI
+	
+	//JFIF for gray and YCbCr. RGB, CMYK and YCCK are told by an Adobe marker, with the same transform flag
+	if(pic->color_space==JPEG_COLOR_GRAY || pic->color_space==JPEG_COLOR_YCBCR)
+	{
+		const uint8_t JFIF[]={0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00};
+		memcpy(&w->buf[w->size], JFIF, sizeof(JFIF));
+		w->size+=sizeof(JFIF);
+	}
+	else
+	{
+		const uint8_t adobe[]={0xFF, 0xEE, 0x00, 0x0E, 'A', 'd', 'o', 'b', 'e', 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, pic->color_space==JPEG_COLOR_YCCK ? 2 : 0};
+		memcpy(&w->buf[w->size], adobe, sizeof(adobe));
+		w->size+=sizeof(adobe);
+	}
+	
+	//quantization tables follow the coefficients when transposing. Slots are numbered in component order
+	uint_fast8_t nb_written=0;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		if(Tq[i]<nb_written)
+			continue;
+		nb_written++;
+		
+		uint16_t quant[64];
+		uint_fast8_t Pq=0;
+		for(k=0; k<64; k++)
+		{
+			quant[k]=pic->components_data[i].quant[t.src_index[zigzag_to_natural[k]]];
+			if(quant[k]>255)
+				Pq=1;
+		}
+		
+		writer_word(w, 0xFFDB);
+		writer_word(w, 2+1+64*(1+Pq));
+		writer_byte(w, (Pq<<4)|Tq[i]);
+		for(k=0; k<64; k++)
+		{
+			if(Pq)
+				writer_word(w, quant[k]);
+			else
+				writer_byte(w, quant[k]);
+		}
+	}
+	
+	writer_word(w, 0xFFC0); //SOF0
+	writer_word(w, 8+3*pic->nb_components);
+	writer_byte(w, 8);
+	writer_word(w, out_Y);
+	writer_word(w, out_X);
+	writer_byte(w, pic->nb_components);
+	for(i=0; i<pic->nb_components; i++)
+	{
+		components_data_t const * const comp=&pic->components_data[i];
+		uint_fast8_t const H=t.axes.transpose ? comp->V : comp->H;
+		uint_fast8_t const V=t.axes.transpose ? comp->H : comp->V;
+		
+		writer_byte(w, comp->C);
+		writer_byte(w, (H<<4)|V);
+		writer_byte(w, Tq[i]);
+	}
+	
+	for(i=0; i<4; i++)
+	{
+		if(used_dc&(1<<i))
+			write_DHT(w, &enc->dc[i], 0x00|i);
+		if(used_ac&(1<<i))
+			write_DHT(w, &enc->ac[i], 0x10|i);
+	}
+	
+	writer_reserve(w, 6+2*pic->nb_components+3);
+	writer_word(w, 0xFFDA); //SOS
+	writer_word(w, 6+2*pic->nb_components);
+	writer_byte(w, pic->nb_components);
+	for(i=0; i<pic->nb_components; i++)
+	{
+		writer_byte(w, pic->components_data[i].C);
+		writer_byte(w, (pic->components_data[i].Td<<4)|pic->components_data[i].Ta);
+	}
+	writer_byte(w, 0); //Ss
+	writer_byte(w, 63); //Se
+	writer_byte(w, 0); //Ah Al
+	
+	//second pass: the scan itself
+	enc->w=w;
+	transform_scan(pic, &t, enc);
+	
+	writer_reserve(w, 4);
+	writer_flush_bits(w);
+	writer_word(w, 0xFFD9); //EOI
+	
+	log_info(pic, "transformed JPEG: %zu bytes\n", w->size);
+}
+
+//transform data or, if it is NULL, the file filename
+static jpeg_status_t transform_run(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, char const * const filename, const jpeg_transform_t transform, uint8_t const ** const out, size_t * const out_size)
+{
+	picture_t * const pic=&dec->pic;
+	
+	dec->decoded=false;
+	dec->error.status=JPEG_OK;
+	dec->error.message[0]='\0';
+	
+	if(setjmp(dec->error.env))
+	{
+		pic->keep_coefficients=false;
+		release_input(pic);
+		return dec->error.status;
+	}
+	
+	if(transform>JPEG_TRANSFORM_ROT_270)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "unknown transform %u", transform);
+	if(pic->scale_denom!=1)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "transforms need scale_denom 1, not %u", pic->scale_denom);
+	
+	if(data)
+		open_picture_from_memory(data, size, pic);
+	else
+		open_new_picture(filename, pic);
+	
+	pic->keep_coefficients=true;
+	parse_picture(pic);
+	
+	if(!pic->scan_decoded)
+		decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "no scan in the data");
+	
+	write_transformed(pic, transform, &dec->writer);
+	
+	pic->keep_coefficients=false;
+	release_input(pic);
+	
+	*out=dec->writer.buf;
+	*out_size=dec->writer.size;
+	return JPEG_OK;
+}
+
+jpeg_status_t jpeg_transform_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const jpeg_transform_t transform, uint8_t const ** const out, size_t * const out_size)
+{
+	if(!data)
+		return JPEG_ERROR_ARGUMENT;
+	
+	return transform_run(dec, data, size, NULL, transform, out, out_size);
+}
+
+jpeg_status_t jpeg_transform_file(jpeg_decoder_t * const dec, char const * const filename, const jpeg_transform_t transform, uint8_t const ** const out, size_t * const out_size)
+{
+	return transform_run(dec, NULL, 0, filename, transform, out, out_size);
+}
+
+
+//probing: the headers only, and optionally a walk over the entropy-coded data that does not decode it
+
+//length of the scans and their restart markers, which must come in order and as many as the restart interval asks for.
+//Between the scans of a progressive or other multi-scan picture the segments are parsed as for a decode
+static void probe_scan(picture_t * const pic, jpeg_info_t * const info)
+{
+	uint8_t const * const data=pic->data;
+	
+	while(true)
+	{
+		uint_fast32_t pos=pic->pos_compressed_pixeldata;
+		uint_fast32_t nb_restarts=0;
+		
+		while(true)
+		{
+			uint8_t const * const ff=memchr(&data[pos], 0xFF, pic->filesize-pos);
+			if(!ff || ff+1>=&data[pic->filesize])
+				decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+			
+			pos=ff-data+1;
+			if(data[pos]==0x00) //stuffed 0xFF
+				pos++;
+			else if(data[pos]>=0xD0 && data[pos]<=0xD7)
+			{
+				if(data[pos]!=0xD0+nb_restarts%8)
+					decode_fail(pic->error, JPEG_ERROR_CORRUPT, "RST%u at pos %lu, RST%lu expected", data[pos]-0xD0, pos-1, nb_restarts%8);
+				nb_restarts++;
+				pos++;
+			}
+			else if(data[pos]!=0xFF) //any other marker ends the scan, 0xFF is a fill byte before it
+			{
+				pos--;
+				break;
+			}
+		}
+		
+		uint_fast32_t const expected_restarts=pic->restart_interval ? (pic->scan_MCUs+pic->restart_interval-1)/pic->restart_interval-1 : 0;
+		if(nb_restarts!=expected_restarts)
+			decode_fail(pic->error, JPEG_ERROR_CORRUPT, "%lu restart markers in scan %u, %lu expected", nb_restarts, info->nb_scans+1, expected_restarts);
+		
+		uint_fast32_t const scan_length=pos-pic->pos_compressed_pixeldata;
+		info->nb_scans++;
+		info->scan_length+=scan_length;
+		info->nb_restart_markers+=nb_restarts;
+		
+		//every block takes at least 2 bits, a DC code and an EOB. Progressive scans can code a run of blocks in a few bits
+		if(!pic->progressive)
+		{
+			uint_fast32_t nb_blocks=pic->scan_MCUs;
+			if(pic->scan_nb_components>1)
+			{
+				uint_fast8_t j;
+				nb_blocks=0;
+				for(j=0; j<pic->scan_nb_components; j++)
+					nb_blocks+=pic->components_data[pic->scan_components[j]].H*pic->components_data[pic->scan_components[j]].V;
+				nb_blocks*=pic->scan_MCUs;
+			}
+			uint64_t const min_bytes=((uint64_t)nb_blocks*2+7)/8;
+			
+			if(scan_length-2*nb_restarts<min_bytes)
+				decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "scan of %lu bytes, %lu blocks need at least %lu", scan_length, nb_blocks, (uint_fast32_t)min_bytes);
+		}
+		
+		uint16_t const marker=(data[pos]<<8)|data[pos+1];
+		if(marker==0xFFD9)
+			return;
+		if(!pic->buffered)
+			decode_fail(pic->error, JPEG_ERROR_UNSUPPORTED, "marker 0x%04x after a scan of all components, only progressive pictures and scans of fewer components are followed by more", marker);
+		
+		//the segments up to the next SOS, parsed and checked as for a decode
+		pic->pos_in_file=pos;
+		parse_picture(pic);
+		if(pic->pos_compressed_pixeldata<=pos)
+		{
+			if(data[pic->pos_in_file-2]!=0xFF || data[pic->pos_in_file-1]!=0xD9)
+				decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "marker EOI (0xFFD9) missing");
+			return;
+		}
+	}
+}
+
+//probe data or, if it is NULL, the file filename
+static jpeg_status_t probe_run(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, char const * const filename, const bool validate_scan, jpeg_info_t * const info)
+{
+	picture_t * const pic=&dec->pic;
+	
+	dec->decoded=false;
+	dec->error.status=JPEG_OK;
+	dec->error.message[0]='\0';
+	memset(info, 0, sizeof(jpeg_info_t));
+	
+	if(setjmp(dec->error.env))
+	{
+		pic->headers_only=false;
+		release_input(pic);
+		return dec->error.status;
+	}
+	
+	if(data)
+		open_picture_from_memory(data, size, pic);
+	else
+		open_new_picture(filename, pic);
+	
+	pic->headers_only=true;
+	parse_picture(pic);
+	
+	if(!pic->nb_components)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "no frame header (SOF0)");
+	if(!pic->pos_compressed_pixeldata)
+		decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "no scan in the data");
+	
+	info->width=pic->size_X;
+	info->height=pic->size_Y;
+	info->progressive=pic->progressive;
+	info->nb_components=pic->nb_components;
+	info->color_space=pic->color_space;
+	
+	uint_fast8_t i;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		components_data_t const * const comp=&pic->components_data[i];
+		
+		info->components[i].id=comp->C;
+		info->components[i].H=comp->H;
+		info->components[i].V=comp->V;
+		info->components[i].quant_table=comp->Tq;
+		info->components[i].dc_table=comp->Td;
+		info->components[i].ac_table=comp->Ta;
+	}
+	
+	info->restart_interval=pic->restart_interval;
+	info->quant_tables_defined=pic->quant_tables_defined;
+	memcpy(info->quant_tables, pic->quant_tables, sizeof(info->quant_tables));
+	info->scan_offset=pic->pos_compressed_pixeldata;
+	
+	if(validate_scan)
+		probe_scan(pic, info);
+	
+	pic->headers_only=false;
+	release_input(pic);
+	return JPEG_OK;
+}
+
+jpeg_status_t jpeg_probe_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const bool validate_scan, jpeg_info_t * const info)
+{
+	if(!data)
+		return JPEG_ERROR_ARGUMENT;
+	
+	return probe_run(dec, data, size, NULL, validate_scan, info);
+}
+
+jpeg_status_t jpeg_probe_file(jpeg_decoder_t * const dec, char const * const filename, const bool validate_scan, jpeg_info_t * const info)
+{
+	return probe_run(dec, NULL, 0, filename, validate_scan, info);
+}
+
+
+
+//benchmarks: each stage of the decoder timed on its own over a whole picture, and synthetic pictures to run them on
+
+typedef struct
+{
+	struct timespec time;
+	uint64_t tsc;
+} stage_clock_t;
+
+static void stage_start(stage_clock_t * const clock)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock->time);
+	clock->tsc=read_tsc();
+}
+
+static void stage_stop(stage_clock_t const * const clock, jpeg_stage_times_t * const times, const jpeg_stage_t stage)
+{
+	struct timespec now;
+	uint64_t const tsc=read_tsc();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	times->ns[stage]+=(now.tv_sec-clock->time.tv_sec)*1000000000LL+now.tv_nsec-clock->time.tv_nsec;
+	times->cycles[stage]+=tsc-clock->tsc;
+}
+
+//the bytes after the first SOS without stuffing and restart markers, as the bitstream reader sees them
+static uint_fast32_t remove_stuffing(uint8_t const * const data, uint_fast32_t pos, const uint_fast32_t end, uint8_t * const out)
+{
+	uint_fast32_t n=0;
+	
+	while(pos<end)
+	{
+		uint8_t const byte=data[pos++];
+		if(byte!=0xFF)
+		{
+			out[n++]=byte;
+			continue;
+		}
+		
+		if(pos<end && data[pos]==0x00)
+			out[n++]=0xFF;
+		pos++; //any other marker is dropped too
+	}
+	
+	return n;
+}
+
+//dequantization of the blocks of MCU row that take a full IDCT, into dequant in MCU order
+static void bench_dequant_row(picture_t const * const pic, const uint_fast32_t row, int32_t (* const dequant)[64])
+{
+	uint_fast32_t MCU_X;
+	uint_fast32_t block=0;
+	
+	for(MCU_X=pic->MCU_X0; MCU_X<pic->MCU_X1; MCU_X++)
+	{
+		uint_fast8_t component;
+		uint_fast8_t data_unit;
+		
+		for(component=0; component<pic->nb_components; component++)
+		{
+			components_data_t const * const comp=&pic->components_data[component];
+			
+			for(data_unit=0; data_unit<comp->V*comp->H; data_unit++, block++)
+			{
+				uint_fast32_t const blockX=(MCU_X-pic->coefs_MCU_X0)*comp->H+data_unit%comp->H;
+				uint_fast32_t const blockY=(row-pic->coefs_MCU_Y0)*comp->V+data_unit/comp->H;
+				uint_fast32_t const i=blockY*comp->blocks_per_row+blockX;
+				
+				if(data_unit_full_idct(pic, comp->extents[i]))
+					pic->kernels.dequant_block(comp->coefs[i], comp->quant, dequant[block]);
+			}
+		}
+	}
+}
+
+//the rest of the reconstruction of MCU row: IDCT of the blocks bench_dequant_row dequantized, the reduced and
+//DC-only paths for the others, and storage in the planes
+static void bench_idct_row(picture_t * const pic, const uint_fast32_t row, int32_t (* const dequant)[64])
+{
+	uint8_t samples[64];
+	uint_fast32_t MCU_X;
+	uint_fast32_t block=0;
+	
+	for(MCU_X=pic->MCU_X0; MCU_X<pic->MCU_X1; MCU_X++)
+	{
+		uint_fast8_t component;
+		uint_fast8_t data_unit;
+		
+		for(component=0; component<pic->nb_components; component++)
+		{
+			components_data_t const * const comp=&pic->components_data[component];
+			
+			for(data_unit=0; data_unit<comp->V*comp->H; data_unit++, block++)
+			{
+				uint_fast32_t const blockX=(MCU_X-pic->coefs_MCU_X0)*comp->H+data_unit%comp->H;
+				uint_fast32_t const blockY=(row-pic->coefs_MCU_Y0)*comp->V+data_unit/comp->H;
+				uint_fast32_t const i=blockY*comp->blocks_per_row+blockX;
+				
+				if(data_unit_full_idct(pic, comp->extents[i]))
+					data_unit_do_idct(pic, dequant[block], samples);
+				else
+					data_unit_reconstruct(pic, comp->coefs[i], comp->extents[i], comp->quant, samples);
+				store_data_unit_YCbCr(pic, row*pic->MCUs_per_row+MCU_X, component, data_unit, samples);
+			}
+		}
+	}
+}
+
+jpeg_status_t jpeg_benchmark_stages(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const jpeg_pixel_format_t format, jpeg_stage_times_t * const times)
+{
+	picture_t * const pic=&dec->pic;
+	stage_clock_t clock;
+	uint_fast8_t i;
+	
+	if(!data || format>JPEG_PIXEL_RGBA)
+		return JPEG_ERROR_ARGUMENT;
+	
+	dec->decoded=false;
+	dec->error.status=JPEG_OK;
+	dec->error.message[0]='\0';
+	memset(times, 0, sizeof(jpeg_stage_times_t));
+	
+	if(setjmp(dec->error.env))
+	{
+		pic->headers_only=false;
+		pic->keep_coefficients=false;
+		release_input(pic);
+		return dec->error.status;
+	}
+	
+	if(pic->requested_crop_W)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "benchmarks decode the whole picture, without a crop");
+	
+	//the marker segments up to the first scan
+	stage_start(&clock);
+	open_picture_from_memory(data, size, pic);
+	pic->headers_only=true;
+	parse_picture(pic);
+	pic->headers_only=false;
+	stage_stop(&clock, times, JPEG_STAGE_MARKERS);
+	
+	if(!pic->nb_components)
+		decode_fail(pic->error, JPEG_ERROR_CORRUPT, "no frame header (SOF0)");
+	
+	//entropy decoding of all scans into the coefficient store, on the decoder's threads. The bitstream reader
+	//removes the stuffing as it goes, which JPEG_STAGE_DESTUFF times on its own
+	stage_start(&clock);
+	open_picture_from_memory(data, size, pic);
+	pic->keep_coefficients=true;
+	parse_picture(pic);
+	pic->keep_coefficients=false;
+	stage_stop(&clock, times, JPEG_STAGE_HUFFMAN);
+	
+	if(!pic->scan_decoded)
+		decode_fail(pic->error, JPEG_ERROR_TRUNCATED, "no scan in the data");
+	
+	uint8_t * const unstuffed=arena_alloc(&pic->arena, size, pic->error);
+	stage_start(&clock);
+	remove_stuffing(data, pic->pos_compressed_pixeldata, size, unstuffed);
+	stage_stop(&clock, times, JPEG_STAGE_DESTUFF);
+	
+	//the coefficients are reconstructed as the decoder does it, one MCU row after the other, but with all
+	//dequantizations of a row done before its IDCTs so both can be timed
+	uint_fast32_t blocks_per_row=0;
+	for(i=0; i<pic->nb_components; i++)
+	{
+		components_data_t * const comp=&pic->components_data[i];
+		
+		comp->pixels=arena_alloc(&pic->arena, comp->stride*comp->plane_rows, pic->error);
+		blocks_per_row+=(pic->MCU_X1-pic->MCU_X0)*comp->H*comp->V;
+	}
+	int32_t (* const dequant)[64]=arena_alloc(&pic->arena, blocks_per_row*sizeof(*dequant), pic->error);
+	
+	uint_fast32_t row;
+	for(row=pic->MCU_Y0; row<pic->MCU_Y1; row++)
+	{
+		stage_start(&clock);
+		bench_dequant_row(pic, row, dequant);
+		stage_stop(&clock, times, JPEG_STAGE_DEQUANT);
+		
+		stage_start(&clock);
+		bench_idct_row(pic, row, dequant);
+		stage_stop(&clock, times, JPEG_STAGE_IDCT);
+	}
+	
+	//then every output row is upsampled, converted to RGB and stored in an image in the requested format
+	uint_fast8_t const bytes_per_pixel=jpeg_bytes_per_pixel(format);
+	uint8_t * bufs[4];
+	picture_alloc_row_buffers(pic, bufs);
+	uint8_t * const rgb=arena_alloc(&pic->arena, 4*pic->crop_W, pic->error);
+	uint8_t * const image=arena_alloc(&pic->arena, (size_t)bytes_per_pixel*pic->crop_W*pic->crop_H, pic->error);
+	
+	uint_fast32_t y;
+	for(y=0; y<pic->crop_H; y++)
+	{
+		uint8_t const * rows[4];
+		
+		stage_start(&clock);
+		picture_row_upsample(pic, y, bufs, rows);
+		stage_stop(&clock, times, JPEG_STAGE_UPSAMPLE);
+		
+		stage_start(&clock);
+		picture_row_convert(pic, rows, rgb);
+		stage_stop(&clock, times, JPEG_STAGE_COLOR);
+		
+		stage_start(&clock);
+		if(format==JPEG_PIXEL_BGR)
+			swap_red_blue_row(rgb, pic->crop_W);
+		else if(format==JPEG_PIXEL_RGBA)
+			expand_to_rgba_row(rgb, pic->crop_W);
+		memcpy(&image[(size_t)y*bytes_per_pixel*pic->crop_W], rgb, bytes_per_pixel*pic->crop_W);
+		stage_stop(&clock, times, JPEG_STAGE_OUTPUT);
+	}
+	
+	times->width=pic->crop_W;
+	times->height=pic->crop_H;
+	times->nb_MCUs=pic->nb_MCU_total;
+	times->nb_scans=pic->buffered ? pic->nb_scans : 1;
+	
+	release_input(pic);
+	return JPEG_OK;
+}
+
+//quantization tables of the standard's example (K.1), in natural order. Most encoders scale these
+static const uint8_t example_luminance_quant[64]={	16, 11, 10, 16, 24, 40, 51, 61,
+											12, 12, 14, 19, 26, 58, 60, 55,
+											14, 13, 16, 24, 40, 57, 69, 56,
+											14, 17, 22, 29, 51, 87, 80, 62,
+											18, 22, 37, 56, 68,109,103, 77,
+											24, 35, 55, 64, 81,104,113, 92,
+											49, 64, 78, 87,103,121,120,101,
+											72, 92, 95, 98,112,100,103, 99	};
+
+static const uint8_t example_chrominance_quant[64]={	17, 18, 24, 47, 99, 99, 99, 99,
+												18, 21, 26, 66, 99, 99, 99, 99,
+												24, 26, 56, 99, 99, 99, 99, 99,
+												47, 66, 99, 99, 99, 99, 99, 99,
+												99, 99, 99, 99, 99, 99, 99, 99,
+												99, 99, 99, 99, 99, 99, 99, 99,
+												99, 99, 99, 99, 99, 99, 99, 99,
+												99, 99, 99, 99, 99, 99, 99, 99	};
+
+static inline uint32_t xorshift32(uint32_t * const state)
+{
+	uint32_t x=*state;
+	x^=x<<13;
+	x^=x>>17;
+	x^=x<<5;
+	*state=x;
+	return x;
+}
+
+//quantized coefficients of a photo-like block: the DC coefficient is given, the AC coefficients get rarer and
+//smaller with frequency, in zigzag order, and come with their signs at random
+static void synthesize_block(int16_t coefs[64], uint8_t * const extent, const int_fast32_t DC, const uint_fast8_t detail, uint32_t * const rng)
+{
+	uint_fast8_t k;
+	
+	memset(coefs, 0, 64*sizeof(int16_t));
+	coefs[0]=DC;
+	*extent=1;
+	
+	for(k=1; k<64; k++)
+	{
+		//nonzero with a probability falling from detail/16 at the lowest frequencies, by half every 6 coefficients
+		if((xorshift32(rng)&0xFFFF)>=(((uint32_t)detail<<12)>>(k/6)))
+			continue;
+		
+		//mostly small, up to 2^(detail/2) at low frequencies
+		uint32_t const r=xorshift32(rng);
+		uint_fast8_t const max_bits=1+(detail/2)*(64-k)/64;
+		int_fast32_t const v=1+(r&((1<<((r>>16)%max_bits))-1));
+		
+		coefs[zigzag_to_natural[k]]=r>>31 ? -v : v;
+		*extent=zigzag_extent[k];
+	}
+}
+
+//smooth pattern over the picture for the DC coefficients of component c: a few sine waves in about -48..48
+static int_fast32_t synthetic_DC(const uint_fast32_t x, const uint_fast32_t y, const uint_fast8_t c, uint32_t * const rng)
+{
+	double const u=x*0.017+c*1.3;
+	double const v=y*0.011-c*0.7;
+	double const s=sin(u)*cos(v*1.7)+0.5*sin(u*2.9+v*2.3)+0.25*cos(u*0.37-v*5.1);
+	
+	return (int_fast32_t)(s*(c ? 16 : 27))+(int_fast32_t)(xorshift32(rng)%5)-2;
+}
+
+jpeg_status_t jpeg_synthesize(jpeg_decoder_t * const dec, const uint32_t width, const uint32_t height, const uint8_t nb_components, const uint8_t H, const uint8_t V, const uint32_t seed, uint8_t const ** const out, size_t * const out_size)
+{
+	picture_t * const pic=&dec->pic;
+	
+	dec->decoded=false;
+	dec->error.status=JPEG_OK;
+	dec->error.message[0]='\0';
+	
+	if(setjmp(dec->error.env))
+	{
+		release_input(pic);
+		return dec->error.status;
+	}
+	
+	if(!width || !height || width>0xFFFF || height>0xFFFF)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "%u x %u: 1 to 65535 pixels per side", width, height);
+	if(nb_components!=1 && nb_components!=3)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "%u components, 1 (gray) or 3 (YCbCr)", nb_components);
+	if(H<1 || H>4 || V<1 || V>4)
+		decode_fail(&dec->error, JPEG_ERROR_ARGUMENT, "sampling factors %u x %u, 1 to 4", H, V);
+	
+	release_input(pic);
+	init_picture(pic);
+	
+	pic->size_X=width;
+	pic->size_Y=height;
+	pic->nb_components=nb_components;
+	pic->color_space=nb_components==1 ? JPEG_COLOR_GRAY : JPEG_COLOR_YCBCR;
+	pic->Hmax=nb_components==1 ? 1 : H;
+	pic->Vmax=nb_components==1 ? 1 : V;
+	pic->MCUs_per_row=ceil_to_multiple_of(width, 8*pic->Hmax)/(8*pic->Hmax);
+	pic->MCU_rows=ceil_to_multiple_of(height, 8*pic->Vmax)/(8*pic->Vmax);
+	pic->nb_MCU_total=pic->MCUs_per_row*pic->MCU_rows;
+	pic->crop_X=0;
+	pic->crop_Y=0;
+	pic->crop_W=width;
+	pic->crop_H=height;
+	
+	uint_fast8_t i, k;
+	for(i=0; i<nb_components; i++)
+	{
+		components_data_t * const comp=&pic->components_data[i];
+		
+		comp->C=i+1;
+		comp->H=i ? 1 : pic->Hmax;
+		comp->V=i ? 1 : pic->Vmax;
+		comp->Tq=i ? 1 : 0;
+		comp->Td=comp->Tq;
+		comp->Ta=comp->Tq;
+		comp->quant_latched=true;
+		for(k=0; k<64; k++)
+			comp->quant[k]=i ? example_chrominance_quant[k] : example_luminance_quant[k];
+	}
+	
+	//the whole picture, zeroed
+	pic->buffered=true;
+	alloc_coefficient_store(pic);
+	pic->buffered=false;
+	
+	uint32_t rng=seed ? seed : 1;
+	for(i=0; i<nb_components; i++)
+	{
+		components_data_t * const comp=&pic->components_data[i];
+		uint_fast32_t const blocks_X=pic->MCUs_per_row*comp->H;
+		uint_fast32_t const blocks_Y=pic->MCU_rows*comp->V;
+		uint_fast8_t const detail=i ? 3 : 8;
+		uint_fast32_t x, y;
+		
+		for(y=0; y<blocks_Y; y++)
+			for(x=0; x<blocks_X; x++)
+				synthesize_block(comp->coefs[y*comp->blocks_per_row+x], &comp->extents[y*comp->blocks_per_row+x], synthetic_DC(x*pic->Hmax/comp->H, y*pic->Vmax/comp->V, i, &rng), detail, &rng);
+	}
+	
+	write_transformed(pic, JPEG_TRANSFORM_NONE, &dec->writer);
+	
+	*out=dec->writer.buf;
+	*out_size=dec->writer.size;
+	return JPEG_OK;
+}
+
+//instrumentation
+jpeg_status_t jpeg_get_stats(jpeg_decoder_t const * const dec, jpeg_stats_t * const stats)
+{
+#ifdef JPEG_INSTRUMENT
+	instrument_t const * const in=&dec->pic.instrument;
+	uint_fast8_t i;
+	
+	stats->nb_MCUs=atomic_load(&in->nb_MCUs);
+	stats->nb_blocks=atomic_load(&in->nb_blocks);
+	stats->nb_dc_only_blocks=atomic_load(&in->nb_dc_only_blocks);
+	stats->nb_symbols=atomic_load(&in->nb_symbols);
+	stats->nb_padding_bits=atomic_load(&in->nb_padding_bits);
+	stats->nb_entropy_bytes=atomic_load(&in->nb_entropy_bytes);
+	stats->nb_stuffed_bytes=atomic_load(&in->nb_stuffed_bytes);
+	for(i=0; i<JPEG_NB_SPANS; i++)
+		stats->cycles[i]=atomic_load(&in->cycles[i]);
+	
+	uint_fast32_t const nb_events=atomic_load(&in->nb_events);
+	stats->nb_events=nb_events<TRACE_MAX_EVENTS ? nb_events : TRACE_MAX_EVENTS;
+	stats->nb_events_dropped=nb_events-stats->nb_events;
+	return JPEG_OK;
+#else
+	(void)dec;
+	(void)stats;
+	return JPEG_ERROR_UNSUPPORTED;
+#endif
+}
+
+jpeg_status_t jpeg_write_trace(jpeg_decoder_t const * const dec, char const * const filename)
+{
+#ifdef JPEG_INSTRUMENT
+	static char const * const span_names[JPEG_NB_SPANS]={"headers", "entropy", "reconstruct", "output"};
+	instrument_t const * const in=&dec->pic.instrument;
+	jpeg_stats_t stats;
+	
+	jpeg_get_stats(dec, &stats);
+	
+	//time stamp counter ticks to microseconds, from the time elapsed since the origin
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t const ticks=read_tsc()-in->origin_tsc;
+	double const elapsed_ns=(now.tv_sec-in->origin_time.tv_sec)*1e9+(now.tv_nsec-in->origin_time.tv_nsec);
+	double const us_per_tick=ticks ? elapsed_ns/ticks/1000 : 0.001;
+	
+	FILE * const f=fopen(filename, "w");
+	if(!f)
+		return JPEG_ERROR_IO;
+	
+	fprintf(f, "{\"traceEvents\":[\n");
+	uint_fast32_t i;
+	for(i=0; i<stats.nb_events; i++)
+	{
+		trace_event_t const * const e=&in->events[i];
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"n\":%u}},\n", e->name, span_names[e->span], (int64_t)(e->start-in->origin_tsc)*us_per_tick, (e->end-e->start)*us_per_tick, e->thread, e->arg);
+	}
+	fprintf(f, "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"MCUs\":%llu,\"blocks\":%llu,\"dc_only_blocks\":%llu,\"symbols\":%llu,\"padding_bits\":%llu,\"entropy_bytes\":%llu,\"stuffed_bytes\":%llu,\"events_dropped\":%u}}\n", ticks*us_per_tick, (unsigned long long)stats.nb_MCUs, (unsigned long long)stats.nb_blocks, (unsigned long long)stats.nb_dc_only_blocks, (unsigned long long)stats.nb_symbols, (unsigned long long)stats.nb_padding_bits, (unsigned long long)stats.nb_entropy_bytes, (unsigned long long)stats.nb_stuffed_bytes, stats.nb_events_dropped);
+	fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+	
+	return fclose(f) ? JPEG_ERROR_IO : JPEG_OK;
+#else
+	(void)dec;
+	(void)filename;
+	return JPEG_ERROR_UNSUPPORTED;
+#endif
+}
+
+//streaming decoder
+#define STREAM_RING_MCU_ROWS 4 //the row above the oldest unread MCU row (fancy upsampling), that row, and two rows ahead
+
+typedef enum
+{
+	STREAM_HEADERS, //parsing marker segments
+	STREAM_SCAN, //decoding entropy-coded data
+	STREAM_END, //EOI seen
+	STREAM_FAILED
+} stream_state_t;
+
+struct jpeg_stream
+{
+	picture_t pic;
+	
+	decode_error_t error;
+	
+	uint8_t * buf; //input received but not consumed yet
+	uint_fast32_t size;
+	uint_fast32_t capacity;
+	
+	bool finished; //the caller has no more input
+	
+	stream_state_t state;
+	
+	bitstream_t bs; //entropy decoder state at the start of MCU row next_MCU/MCUs_per_row
+	int16_t precedent_DC[4];
+	uint_fast32_t next_MCU;
+	uint_fast32_t decoded_MCU_rows;
+	
+	uint_fast32_t retry_size; //a starved MCU row is not retried before this much input is buffered
+	
+	uint_fast32_t rows_read; //output rows handed to the caller
+	
+	uint8_t * bufs[4]; //upsampling
+};
+
+jpeg_stream_t * jpeg_stream_create(jpeg_options_t const * const options)
+{
+	if(!options_valid(options))
+		return NULL;
+	
+	if(options->crop_width)
+		return NULL;
+	
+	jpeg_stream_t * const s=calloc(1, sizeof(jpeg_stream_t));
+	if(!s)
+		return NULL;
+	
+	init_picture(&s->pic);
+	picture_set_options(&s->pic, options);
+	s->pic.error=&s->error;
+	s->pic.max_plane_MCU_rows=STREAM_RING_MCU_ROWS;
+	s->pic.nb_threads=1;
+	
+	s->state=STREAM_HEADERS;
+	
+	return s;
+}
+
+void jpeg_stream_destroy(jpeg_stream_t * const s)
+{
+	if(!s)
+		return;
+	
+	free_picture(&s->pic);
+	free(s->buf);
+	free(s);
+}
+
+//the parser and the bitstream read straight from the input buffer, which moves when it grows or is compacted
+static void stream_set_input(jpeg_stream_t * const s)
+{
+	s->pic.data=s->buf;
+	s->pic.filesize=s->size;
+	s->bs.data=s->buf;
+	s->bs.end=s->size;
+}
+
+//parse the next marker segment once all of it is buffered
+static bool stream_parse_segment(jpeg_stream_t * const s)
+{
+	picture_t * const pic=&s->pic;
+	uint_fast32_t const avail=s->size-pic->pos_in_file;
+	uint8_t const * const p=&s->buf[pic->pos_in_file];
+	
+	if(avail<2)
+		goto need_data;
+	
+	uint16_t const marker=(p[0]<<8)|p[1];
+	if(marker!=0xFFD8 && marker!=0xFFD9)
+	{
+		if(avail<4 || avail<2+(uint_fast32_t)((p[2]<<8)|p[3]))
+			goto need_data;
+	}
+	
+	//the coefficients of the whole picture have to be kept until the last scan, rows could not be handed out early
+	if(marker==0xFFC2)
+		decode_fail(&s->error, JPEG_ERROR_UNSUPPORTED, "progressive JPEG, decode it with jpeg_decode_memory or jpeg_decode_file");
+	
+	pic->pos_in_file+=2;
+	log_info(pic, "marker: %d\n", marker);
+	parse_segment(pic, marker);
+	log_info(pic, "\n");
+	
+	if(marker==0xFFD9)
+		s->state=STREAM_END;
+	else if(marker==0xFFDA)
+	{
+		if(pic->buffered)
+			decode_fail(&s->error, JPEG_ERROR_UNSUPPORTED, "scan of %u of the %u components, decode it with jpeg_decode_memory or jpeg_decode_file", pic->scan_nb_components, pic->nb_components);
+		
+		picture_alloc_row_buffers(pic, s->bufs);
+		
+		bitstream_init(&s->bs, s->buf, pic->pos_in_file, s->size, &s->error);
+		s->bs.suspend=true;
+		memset(s->precedent_DC, 0, sizeof(s->precedent_DC));
+		s->next_MCU=0;
+		s->decoded_MCU_rows=0;
+		s->state=STREAM_SCAN;
+	}
+	
+	return true;
+	
+need_data:
+	if(s->finished)
+		decode_fail(&s->error, JPEG_ERROR_TRUNCATED, "JPEG data truncated in the headers");
+	return false;
+}
+
+//decode the next MCU row if its data is complete, a row that runs out of data is undone and retried later
+static bool stream_decode_MCU_row(jpeg_stream_t * const s)
+{
+	picture_t * const pic=&s->pic;
+	
+	if(s->next_MCU==pic->nb_MCU_total)
+	{
+		uint_fast32_t marker_pos;
+		if(!bitstream_find_marker(&s->bs, &marker_pos))
+			goto need_data;
+		
+		pic->pos_in_file=marker_pos;
+		s->state=STREAM_HEADERS;
+		return true;
+	}
+	
+	//the ring slot of this row must not hold rows the caller still needs
+	uint_fast32_t const first_unread_MCU_row=s->rows_read/(pic->block_size*pic->Vmax);
+	if(s->decoded_MCU_rows>=first_unread_MCU_row+STREAM_RING_MCU_ROWS-1)
+		return false;
+	
+	if(!s->finished && s->size<s->retry_size)
+		return false;
+	
+	bitstream_t bs=s->bs;
+	int16_t precedent_DC[4];
+	memcpy(precedent_DC, s->precedent_DC, sizeof(precedent_DC));
+	
+	int16_t coefs[4*4*4][64];
+	uint8_t extents[4*4*4];
+	
+	uint_fast32_t MCU;
+	uint_fast32_t last_MCU=s->next_MCU+pic->MCUs_per_row;
+	if(last_MCU>pic->nb_MCU_total)
+		last_MCU=pic->nb_MCU_total;
+	
+	for(MCU=s->next_MCU; MCU<last_MCU; MCU++)
+	{
+		if(pic->restart_interval && MCU>0 && MCU%pic->restart_interval==0)
+		{
+			uint_fast32_t marker_pos;
+			if(!bitstream_find_marker(&bs, &marker_pos))
+				goto need_data;
+			
+			uint8_t const expected=0xD0+(MCU/pic->restart_interval-1)%8;
+			if(s->buf[marker_pos+1]!=expected)
+				decode_fail(&s->error, JPEG_ERROR_CORRUPT, "restart marker 0xFF%02X expected at pos %lu, found 0xFF%02X", expected, marker_pos, s->buf[marker_pos+1]);
+			
+			bitstream_init(&bs, s->buf, marker_pos+2, s->size, &s->error);
+			bs.suspend=true;
+			memset(precedent_DC, 0, sizeof(precedent_DC));
+		}
+		
+		decode_MCU_coefs(pic, &bs, precedent_DC, coefs, extents);
+		if(bs.starved)
+			goto need_data;
+		
+		reconstruct_MCU(pic, MCU, coefs, extents);
+	}
+	
+	s->bs=bs;
+	memcpy(s->precedent_DC, precedent_DC, sizeof(precedent_DC));
+	s->next_MCU=last_MCU;
+	s->decoded_MCU_rows++;
+	s->retry_size=0;
+	return true;
+	
+need_data:
+	if(s->finished)
+		decode_fail(&s->error, JPEG_ERROR_TRUNCATED, "JPEG data truncated in MCU row %lu", s->decoded_MCU_rows);
+	
+	//wait until the data buffered past the start of the row has grown by half, so a row is decoded a bounded number of times
+	s->retry_size=s->size+(s->size-s->bs.pos)/2;
+	return false;
+}
+
+//do as much work as the buffered input and free ring slots allow
+static void stream_advance(jpeg_stream_t * const s)
+{
+	bool progress=true;
+	
+	while(progress)
+	{
+		switch(s->state)
+		{
+			case STREAM_HEADERS:	progress=stream_parse_segment(s); break;
+			case STREAM_SCAN:		progress=stream_decode_MCU_row(s); break;
+			case STREAM_END:
+			case STREAM_FAILED:		progress=false; break;
+		}
+	}
+}
+
+//every API call that can fail comes back here through decode_fail, the stream is unusable afterwards
+#define STREAM_CATCH(s)	do { \
+							if((s)->state==STREAM_FAILED) \
+								return (s)->error.status; \
+							if(setjmp((s)->error.env)) \
+							{ \
+								(s)->state=STREAM_FAILED; \
+								return (s)->error.status; \
+							} \
+						} while(0)
+
+jpeg_status_t jpeg_stream_feed(jpeg_stream_t * const s, uint8_t const * const data, const size_t size)
+{
+	STREAM_CATCH(s);
+	
+	//drop consumed input once it makes up half of the buffer
+	uint_fast32_t consumed=s->size;
+	if(s->state==STREAM_HEADERS)
+		consumed=s->pic.pos_in_file;
+	else if(s->state==STREAM_SCAN)
+		consumed=s->bs.pos;
+	
+	if(consumed>0 && 2*consumed>=s->size)
+	{
+		memmove(s->buf, &s->buf[consumed], s->size-consumed);
+		s->size-=consumed;
+		s->pic.pos_in_file-=(s->pic.pos_in_file<consumed) ? s->pic.pos_in_file : consumed;
+		s->bs.pos-=(s->bs.pos<consumed) ? s->bs.pos : consumed;
+		s->retry_size-=(s->retry_size<consumed) ? s->retry_size : consumed;
+	}
+	
+	if(s->size+size>s->capacity)
+	{
+		uint_fast32_t capacity=2*s->capacity;
+		if(capacity<s->size+size)
+			capacity=s->size+size;
+		if(capacity<65536)
+			capacity=65536;
+		
+		uint8_t * const buf=realloc(s->buf, capacity);
+		if(!buf)
+			decode_fail(&s->error, JPEG_ERROR_NOMEM, "realloc %lu bytes of input buffer", capacity);
+		s->buf=buf;
+		s->capacity=capacity;
+	}
+	
+	memcpy(&s->buf[s->size], data, size);
+	s->size+=size;
+	stream_set_input(s);
+	
+	stream_advance(s);
+	return JPEG_OK;
+}
+
+jpeg_status_t jpeg_stream_finish(jpeg_stream_t * const s)
+{
+	STREAM_CATCH(s);
+	
+	s->finished=true;
+	stream_advance(s);
+	return JPEG_OK;
+}
+
+bool jpeg_stream_get_size(jpeg_stream_t const * const s, uint32_t * const size_X, uint32_t * const size_Y)
+{
+	if(!s->pic.nb_components)
+		return false;
+	
+	*size_X=s->pic.output_X;
+	*size_Y=s->pic.output_Y;
+	return true;
+}
+
+uint32_t jpeg_stream_rows_available(jpeg_stream_t const * const s)
+{
+	picture_t const * const pic=&s->pic;
+	uint_fast32_t ready=0;
+	
+	if(s->state==STREAM_FAILED || (s->state==STREAM_HEADERS && !pic->nb_components))
+		return 0;
+	
+	//fancy upsampling of the last rows of an MCU row needs the first chroma row of the next one
+	if(s->decoded_MCU_rows==pic->MCU_rows)
+		ready=pic->output_Y;
+	else if(s->decoded_MCU_rows>0)
+		ready=(s->decoded_MCU_rows-1)*pic->block_size*pic->Vmax;
+	
+	return ready-s->rows_read;
+}
+
+jpeg_status_t jpeg_stream_read_rows(jpeg_stream_t * const s, const uint32_t max_rows, const jpeg_pixel_format_t format, uint8_t * const out, const size_t stride, uint32_t * const nb_rows)
+{
+	*nb_rows=0;
+	
+	if(format>JPEG_PIXEL_RGBA)
+		return JPEG_ERROR_ARGUMENT;
+	
+	STREAM_CATCH(s);
+	
+	uint32_t n=jpeg_stream_rows_available(s);
+	if(n>max_rows)
+		n=max_rows;
+	
+	uint32_t i;
+	for(i=0; i<n; i++)
+		picture_row_to_format(&s->pic, s->rows_read+i, s->bufs, format, &out[i*stride]);
+	s->rows_read+=n;
+	*nb_rows=n;
+	
+	//ring slots were freed
+	stream_advance(s);
+	return JPEG_OK;
+}
+
+bool jpeg_stream_done(jpeg_stream_t const * const s)
+{
+	return s->state==STREAM_END && s->rows_read==s->pic.output_Y;
+}
+
+char const * jpeg_stream_error_message(jpeg_stream_t const * const s)
+{
+	return s->error.message;
+}
@@ -0,0 +1,261 @@
+//baseline and progressive JPEG decoder library
+//a decoder or stream object is used by one thread at a time, any number of them can run in parallel.
+//Errors are returned as jpeg_status_t, the object's error message tells the details
+
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum
+{
+	JPEG_OK=0,
+	JPEG_ERROR_IO, //file could not be opened or mapped
+	JPEG_ERROR_NOMEM,
+	JPEG_ERROR_UNSUPPORTED, //valid JPEG, but a feature this decoder does not have
+	JPEG_ERROR_CORRUPT, //invalid data
+	JPEG_ERROR_TRUNCATED, //data ends early
+	JPEG_ERROR_ARGUMENT //invalid call, for example reading rows before a successful decode
+} jpeg_status_t;
+
+typedef enum
+{
+	IDCT_FLOAT, //reference, double precision, O(n^4)
+	IDCT_ISLOW, //separable integer, accurate
+	IDCT_IFAST //separable integer, less accurate
+} idct_method_t;
+
+//chroma upsampling: replicate samples, or libjpeg's triangle filter ("fancy upsampling")
+typedef enum
+{
+	UPSAMPLE_NEAREST,
+	UPSAMPLE_FANCY
+} upsampling_t;
+
+//lossless transforms, as jpegtran's -flip, -transpose, -transverse and -rotate
+typedef enum
+{
+	JPEG_TRANSFORM_NONE, //re-encode only, with a crop and optimized Huffman tables
+	JPEG_TRANSFORM_FLIP_H,
+	JPEG_TRANSFORM_FLIP_V,
+	JPEG_TRANSFORM_TRANSPOSE, //across the top-left to bottom-right diagonal
+	JPEG_TRANSFORM_TRANSVERSE, //across the other diagonal
+	JPEG_TRANSFORM_ROT_90, //clockwise
+	JPEG_TRANSFORM_ROT_180,
+	JPEG_TRANSFORM_ROT_270
+} jpeg_transform_t;
+
+//what the components hold, from the number of components, the JFIF and Adobe markers and the component identifiers
+//(as libjpeg decides it). Rows are always handed out as RGB
+typedef enum
+{
+	JPEG_COLOR_GRAY,
+	JPEG_COLOR_YCBCR,
+	JPEG_COLOR_RGB,
+	JPEG_COLOR_CMYK, //Adobe (inverted) CMYK
+	JPEG_COLOR_YCCK
+} jpeg_color_space_t;
+
+//layout of the rows handed out, interleaved 8 bit samples
+typedef enum
+{
+	JPEG_PIXEL_RGB,
+	JPEG_PIXEL_BGR,
+	JPEG_PIXEL_RGBA //alpha is 255
+} jpeg_pixel_format_t;
+
+//what the headers of a picture tell, from a probe
+typedef struct
+{
+	uint32_t width;
+	uint32_t height;
+	bool progressive; //SOF2
+	uint8_t nb_components;
+	jpeg_color_space_t color_space;
+	struct
+	{
+		uint8_t id; //component identifier of the frame header
+		uint8_t H; //sampling factors
+		uint8_t V;
+		uint8_t quant_table;
+		uint8_t dc_table; //Huffman tables of the (first) scan
+		uint8_t ac_table;
+	} components[4];
+	uint16_t restart_interval; //MCUs, 0 without restart markers
+	uint8_t quant_tables_defined; //bit i set if table i was defined
+	uint16_t quant_tables[4][64]; //natural (row-major) order
+	uint32_t scan_offset; //first byte of the entropy-coded data
+	uint32_t scan_length; //only with validate_scan: bytes of entropy-coded data, restart markers included, of all scans
+	uint32_t nb_restart_markers; //only with validate_scan
+	uint32_t nb_scans; //only with validate_scan, 1 unless progressive
+} jpeg_info_t;
+
+struct jpeg_decoder; //jpeg_decoder_t, for the preview callback
+
+typedef struct
+{
+	idct_method_t idct_method;
+	upsampling_t upsampling;
+	unsigned nb_threads; //threads used within one decode, 1 when the caller already runs decoders in parallel
+	size_t arena_bytes; //memory reserved up front for the buffers of a picture, 0 to size it on the first pictures
+	unsigned scale_denom; //1, 2, 4 or 8: decode at 1/scale_denom of the size, reduced IDCTs make this much faster
+	
+	//only decode this rectangle, in pixels of the (scaled) picture. crop_width 0 for the whole picture.
+	//Not supported by the streaming decoder
+	uint32_t crop_x;
+	uint32_t crop_y;
+	uint32_t crop_width;
+	uint32_t crop_height;
+	
+	bool verbose; //print what the parser finds to stdout, for debugging
+	
+	//progressive pictures only, decoder only: called after each scan (counted from 1) with the picture so far,
+	//which jpeg_get_size and jpeg_read_rows read as after a decode. NULL for none
+	void (* preview)(struct jpeg_decoder * const dec, const unsigned scan, void * const user);
+	void * preview_user;
+} jpeg_options_t;
+
+void jpeg_default_options(jpeg_options_t * const options);
+
+char const * jpeg_status_string(const jpeg_status_t status);
+
+uint_fast8_t jpeg_bytes_per_pixel(const jpeg_pixel_format_t format);
+
+
+//whole-picture decoder. The buffers of a picture (sample planes, restart index, row buffers) come from an arena
+//that is reset for the next picture and only grows, so decoding many pictures of the same size allocates nothing
+//after the first one
+typedef struct jpeg_decoder jpeg_decoder_t;
+
+jpeg_decoder_t * jpeg_decoder_create(jpeg_options_t const * const options); //NULL if out of memory or invalid options
+void jpeg_decoder_destroy(jpeg_decoder_t * const dec);
+
+//data is only read during the call
+jpeg_status_t jpeg_decode_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size);
+
+//the file is memory-mapped during the call
+jpeg_status_t jpeg_decode_file(jpeg_decoder_t * const dec, char const * const filename);
+
+//size of the last picture decoded successfully: the crop rectangle, or the picture scaled down by scale_denom
+void jpeg_get_size(jpeg_decoder_t const * const dec, uint32_t * const size_X, uint32_t * const size_Y);
+
+//color convert nb_rows rows starting at first_row, rows are stride bytes apart in out
+jpeg_status_t jpeg_read_rows(jpeg_decoder_t * const dec, const uint32_t first_row, const uint32_t nb_rows, const jpeg_pixel_format_t format, uint8_t * const out, const size_t stride);
+
+char const * jpeg_error_message(jpeg_decoder_t const * const dec);
+
+char const * jpeg_kernels_name(jpeg_decoder_t const * const dec); //SIMD kernels in use
+
+//most arena memory a picture has needed so far, the arena_bytes to give a decoder for pictures like these
+size_t jpeg_arena_peak(jpeg_decoder_t const * const dec);
+
+//lossless transform to a new baseline JPEG: only the entropy coding is done again, the quantized coefficients
+//are moved around, so there is no generation loss and no IDCT. The crop options select a region, its top-left
+//corner moves up and left to the MCU grid. Along a mirrored axis a partial MCU at the edge is dropped, as
+//jpegtran -trim does. scale_denom must be 1. *out belongs to the decoder and is valid until its next call
+jpeg_status_t jpeg_transform_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const jpeg_transform_t transform, uint8_t const ** const out, size_t * const out_size);
+jpeg_status_t jpeg_transform_file(jpeg_decoder_t * const dec, char const * const filename, const jpeg_transform_t transform, uint8_t const ** const out, size_t * const out_size);
+
+//headers only: markers are parsed up to SOS and checked, nothing is allocated and no scan data is read.
+//validate_scan also walks the entropy-coded data, without decoding it, to check it ends with EOI, has the restart
+//markers the restart interval asks for and is long enough for the number of blocks
+jpeg_status_t jpeg_probe_memory(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const bool validate_scan, jpeg_info_t * const info);
+jpeg_status_t jpeg_probe_file(jpeg_decoder_t * const dec, char const * const filename, const bool validate_scan, jpeg_info_t * const info);
+
+
+//benchmarks: the stages of a decode, as jpeg_benchmark_stages times them
+typedef enum
+{
+	JPEG_STAGE_MARKERS, //marker segments up to the first scan
+	JPEG_STAGE_DESTUFF, //stuffing and restart markers removed from the entropy-coded data, in a pass of its own
+	JPEG_STAGE_HUFFMAN, //entropy decoding of all scans to quantized coefficients, which removes the stuffing too
+	JPEG_STAGE_DEQUANT,
+	JPEG_STAGE_IDCT, //storage of the samples included, and the reduced IDCTs that dequantize their few coefficients
+	JPEG_STAGE_UPSAMPLE,
+	JPEG_STAGE_COLOR, //conversion to RGB
+	JPEG_STAGE_OUTPUT, //rows stored in an image in the requested pixel format
+	JPEG_NB_STAGES
+} jpeg_stage_t;
+
+typedef struct
+{
+	uint32_t width; //of the decoded picture
+	uint32_t height;
+	uint32_t nb_MCUs;
+	uint32_t nb_scans;
+	uint64_t ns[JPEG_NB_STAGES];
+	uint64_t cycles[JPEG_NB_STAGES]; //time stamp counter (reference cycles), nanoseconds where there is none
+} jpeg_stage_times_t;
+
+//decode data once with every stage timed on its own: all scans are entropy-decoded to coefficients first (on the
+//decoder's threads), then reconstructed one MCU row after the other and handed out row by row, on the calling thread.
+//Slower than jpeg_decode_memory, which interleaves the stages. The crop options must be unset, the decoder holds
+//no picture afterwards
+jpeg_status_t jpeg_benchmark_stages(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const jpeg_pixel_format_t format, jpeg_stage_times_t * const times);
+
+//synthetic baseline JPEG with the statistics of a photo at quality 50, the same for the same seed: gray
+//(nb_components 1) or YCbCr with luma sampling factors H x V against 1x1 for chroma. *out as for the transforms
+jpeg_status_t jpeg_synthesize(jpeg_decoder_t * const dec, const uint32_t width, const uint32_t height, const uint8_t nb_components, const uint8_t H, const uint8_t V, const uint32_t seed, uint8_t const ** const out, size_t * const out_size);
+
+//instrumentation, in builds with JPEG_INSTRUMENT defined (-DJPEG_INSTRUMENT): counters of the entropy decoder and
+//timed spans of the last picture of a decoder (decode, transform or probe, and the jpeg_read_rows calls after it).
+//Otherwise these calls return JPEG_ERROR_UNSUPPORTED and decoding pays nothing for them
+typedef enum
+{
+	JPEG_SPAN_HEADERS, //marker segments
+	JPEG_SPAN_ENTROPY, //entropy decoding, with the reconstruction where the same thread does both
+	JPEG_SPAN_RECONSTRUCT, //dequantization, IDCT and storage on threads of their own, or after buffered scans
+	JPEG_SPAN_OUTPUT, //upsampling and color conversion in jpeg_read_rows
+	JPEG_NB_SPANS
+} jpeg_span_t;
+
+typedef struct
+{
+	uint64_t nb_MCUs; //entropy-decoded, over all scans
+	uint64_t nb_blocks;
+	uint64_t nb_dc_only_blocks; //sequential blocks without a nonzero AC coefficient
+	uint64_t nb_symbols; //Huffman-decoded
+	uint64_t nb_padding_bits; //left in the last byte of each entropy-coded segment
+	uint64_t nb_entropy_bytes; //read by the entropy decoder, stuffing included
+	uint64_t nb_stuffed_bytes; //0x00 bytes removed after 0xFF
+	uint64_t cycles[JPEG_NB_SPANS]; //time stamp counter, summed over the threads
+	uint32_t nb_events; //spans recorded for jpeg_write_trace
+	uint32_t nb_events_dropped; //past the capacity of the trace
+} jpeg_stats_t;
+
+jpeg_status_t jpeg_get_stats(jpeg_decoder_t const * const dec, jpeg_stats_t * const stats);
+
+//the spans as a Chrome trace (JSON Trace Event Format, which Perfetto reads too), with the counters at the end
+jpeg_status_t jpeg_write_trace(jpeg_decoder_t const * const dec, char const * const filename);
+
+//streaming decoder: input arrives in chunks of any size, output rows can be read as soon as the MCU rows
+//they depend on are decoded. Only a few MCU rows of samples are kept and consumed input is dropped,
+//so memory does not grow with the size of the picture. Once a call failed, all following ones fail too.
+//Progressive pictures, and sequential ones whose components come in separate scans, need all of the picture
+//at once: feeding them fails with JPEG_ERROR_UNSUPPORTED
+typedef struct jpeg_stream jpeg_stream_t;
+
+jpeg_stream_t * jpeg_stream_create(jpeg_options_t const * const options); //NULL if out of memory or invalid options
+void jpeg_stream_destroy(jpeg_stream_t * const s);
+
+jpeg_status_t jpeg_stream_feed(jpeg_stream_t * const s, uint8_t const * const data, const size_t size);
+
+//no more input, everything left must be decodable now
+jpeg_status_t jpeg_stream_finish(jpeg_stream_t * const s);
+
+//picture size, false until the frame header was parsed
+bool jpeg_stream_get_size(jpeg_stream_t const * const s, uint32_t * const size_X, uint32_t * const size_Y);
+
+uint32_t jpeg_stream_rows_available(jpeg_stream_t const * const s);
+
+//the next rows in order, up to max_rows of them, *nb_rows tells how many were written
+jpeg_status_t jpeg_stream_read_rows(jpeg_stream_t * const s, const uint32_t max_rows, const jpeg_pixel_format_t format, uint8_t * const out, const size_t stride, uint32_t * const nb_rows);
+
+//EOI was parsed and all rows were read
+bool jpeg_stream_done(jpeg_stream_t const * const s);
+
+char const * jpeg_stream_error_message(jpeg_stream_t const * const s);
+
+#endif //JPEG_H
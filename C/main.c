@@ -3,916 +3,1427 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <math.h>
 #include <err.h>
 #include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include "jpeg.h"
 
-const char * comp_names[3]={"Y","Cb","Cr"};
+typedef enum
+{
+	OUTPUT_P6, //binary PPM
+	OUTPUT_P3, //ASCII PPM, slow, for debugging
+	OUTPUT_RGB, //raw interleaved samples, no header
+	OUTPUT_BGR,
+	OUTPUT_RGBA
+} output_format_t;
+
+//what is done with each input
+typedef enum
+{
+	TASK_DECODE,
+	TASK_TRANSFORM, //lossless transform to a new JPEG
+	TASK_PROBE, //headers only
+	TASK_PROBE_SCAN //headers and a walk over the scan data
+} task_t;
 
-typedef struct
+jpeg_pixel_format_t output_pixel_format(const output_format_t format)
 {
-	uint_fast8_t H;
-	uint_fast8_t V;
-	uint_fast8_t Tq;
-	uint_fast16_t xi;
-	uint_fast16_t yi;
-	uint_fast8_t Td; //quant table for DC
-	uint_fast8_t Ta; //quant table for AC
-} components_data_t;
+	switch(format)
+	{
+		case OUTPUT_BGR:	return JPEG_PIXEL_BGR;
+		case OUTPUT_RGBA:	return JPEG_PIXEL_RGBA;
+		default:			return JPEG_PIXEL_RGB;
+	}
+}
 
-typedef struct
+char const * output_extension(const output_format_t format)
 {
-	uint_fast8_t sz;
-	uint_fast16_t codeword;
-	uint_fast8_t decoded;
-} huffman_entry_t;
+	switch(format)
+	{
+		case OUTPUT_P6:
+		case OUTPUT_P3:		return "ppm";
+		case OUTPUT_RGB:	return "rgb";
+		case OUTPUT_BGR:	return "bgr";
+		case OUTPUT_RGBA:	return "rgba";
+	}
+	return "";
+}
 
-typedef struct
+//P3 for debugging, one fprintf per pixel. False if the rows could not be read
+bool write_ppm_ascii(jpeg_decoder_t * const dec, FILE * const out, uint8_t * const row_rgb)
 {
-	uint_fast8_t nb_entries;
-	huffman_entry_t entries[256];
-} huffman_table_t;
+	uint32_t size_X, size_Y;
+	uint32_t x,y;
 
-typedef uint_fast8_t quantization_table_t[8][8];
+	jpeg_get_size(dec, &size_X, &size_Y);
 
-typedef struct
+	fprintf(out, "P3\n%u %u\n255\n", size_X, size_Y);
+
+	for(y=0; y<size_Y; y++)
+	{
+		if(jpeg_read_rows(dec, y, 1, JPEG_PIXEL_RGB, row_rgb, 0)!=JPEG_OK)
+			return false;
+
+		for(x=0; x<size_X; x++)
+			fprintf(out, "%u %u %u ", row_rgb[3*x+0], row_rgb[3*x+1], row_rgb[3*x+2]);
+		fprintf(out, "\n");
+	}
+	return true;
+}
+
+//rows are converted into a band of about 1 MiB which is written with a single fwrite
+#define OUTPUT_BAND_BYTES (1<<20)
+
+//false on decoder or I/O errors, which are reported. Batch workers call it concurrently, it prints nothing else
+bool write_image(jpeg_decoder_t * const dec, char const * const filename, const output_format_t format)
+{
+	jpeg_pixel_format_t const pixel_format=output_pixel_format(format);
+	uint32_t size_X, size_Y;
+
+	jpeg_get_size(dec, &size_X, &size_Y);
+
+	uint_fast32_t const out_row_bytes=jpeg_bytes_per_pixel(pixel_format)*size_X;
+	uint_fast32_t rows_per_band=OUTPUT_BAND_BYTES/out_row_bytes;
+	if(rows_per_band<1)
+		rows_per_band=1;
+	if(rows_per_band>size_Y)
+		rows_per_band=size_Y;
+
+	uint8_t * const band=malloc(rows_per_band*out_row_bytes);
+	if(!band)
+		err(1, "malloc");
+
+	FILE *out=fopen(filename, "wb");
+	if(!out)
+	{
+		warn("fopen %s failed", filename);
+		free(band);
+		return false;
+	}
+
+	bool rows_read=true;
+	if(format==OUTPUT_P3)
+		rows_read=write_ppm_ascii(dec, out, band);
+	else
+	{
+		if(format==OUTPUT_P6)
+			fprintf(out, "P6\n%u %u\n255\n", size_X, size_Y);
+
+		uint_fast32_t y=0;
+		while(y<size_Y)
+		{
+			uint_fast32_t nb_rows=size_Y-y;
+			if(nb_rows>rows_per_band)
+				nb_rows=rows_per_band;
+
+			if(jpeg_read_rows(dec, y, nb_rows, pixel_format, band, out_row_bytes)!=JPEG_OK)
+			{
+				rows_read=false;
+				break;
+			}
+			y+=nb_rows;
+
+			if(fwrite(band, out_row_bytes, nb_rows, out)!=nb_rows)
+				break;
+		}
+	}
+
+	free(band);
+
+	bool const write_failed=ferror(out);
+	if(fclose(out) || write_failed)
+	{
+		warn("writing %s failed", filename);
+		return false;
+	}
+	if(!rows_read)
+	{
+		warnx("%s: %s", filename, jpeg_error_message(dec));
+		return false;
+	}
+
+	return true;
+}
+
+//false on I/O errors, which are reported
+bool write_buffer(char const * const filename, uint8_t const * const data, const size_t size)
 {
-	double Y;
-	double Cb;
-	double Cr;
-} pixel_YCbCr_t;
+	FILE *out=fopen(filename, "wb");
+	if(!out)
+	{
+		warn("fopen %s failed", filename);
+		return false;
+	}
+
+	printf("writing file %s\n", filename);
+
+	bool const write_failed=fwrite(data, 1, size, out)!=size;
+	if(fclose(out) || write_failed)
+	{
+		warn("writing %s failed", filename);
+		return false;
+	}
+
+	return true;
+}
 
+//-previews: the picture so far after each scan of a progressive file
 typedef struct
 {
-	uint8_t * data;
-	
-	uint_fast32_t filesize;
-	
-	uint_fast32_t pos_in_file;	
-	
-	uint_fast16_t size_X;
-	uint_fast16_t size_Y;
-	
-	uint_fast8_t Hmax;
-	uint_fast8_t Vmax;
-	
-	uint_fast32_t nb_MCU_total;
-	
-	uint8_t * compressed_pixeldata;
-	
-	uint_fast32_t sz_compressed_pixeldata;
-	
-	uint_fast32_t pos_compressed_pixeldata;
-	
-	uint_fast32_t bitpos_in_compressed_pixeldata;
-
-	uint_fast8_t nb_components;
-	
-	components_data_t components_data[4];
-	
-	huffman_table_t huff_tables[2][2]; //Tc (type=AC/DC), Th (destination identifier)
-	
-	quantization_table_t quant_tables[4];
-	
-	pixel_YCbCr_t ** pixels_YCbCr;
-	
-} picture_t;
-
-typedef double matrix8x8_t[8][8];
-
-uint8_t get1i(uint8_t const * const data, uint_fast32_t * const pos)
-{
-	uint8_t val=data[*pos];
-	(*pos)++;
-	return val;
-}
-
-uint16_t get2i(uint8_t const * const data, uint_fast32_t * const pos)
-{
-	uint16_t val=(data[*pos]<<8)|data[(*pos)+1];
-	(*pos)+=2;
-	return val;
-}
-
-uint32_t get4i(uint8_t const * const data, uint_fast32_t * const pos)
-{
-	uint32_t val=(data[*pos]<<24)|(data[(*pos)+1]<<16)|(data[(*pos)+2]<<8)|(data[(*pos)+3]);
-	(*pos)+=4;
-	return val;
-}
+	char const * prefix;
+	output_format_t format;
+} preview_output_t;
 
-uint16_t get_marker(uint8_t const * const data, uint_fast32_t * const pos)
+void write_preview(jpeg_decoder_t * const dec, const unsigned scan, void * const user)
 {
-	return get2i(data, pos);
+	preview_output_t const * const preview=user;
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s%u.%s", preview->prefix, scan, output_extension(preview->format));
+	if(write_image(dec, name, preview->format))
+		printf("preview written to %s\n", name);
 }
 
-
-char *to_bin(const uint16_t word, const uint8_t sz)
-{
-	static char str[17];
-	memset(str, '\0', 17);
-	
-	uint8_t i;
-	for(i=0; i<sz; i++)
-		str[i]='0'+!!(word&(1<<(sz-i-1)));
-	
-	return str;
-}
-
-
-uint_fast32_t ceil_to_multiple_of(const uint_fast32_t val, const uint_fast32_t multiple)
-{
-	return (uint_fast32_t)(multiple*ceil((double)val/multiple));
-}
-
-void skip_EXIF(picture_t * const pic)
-{
-	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
-	printf("APP1 (probably EXIF) found (length %u bytes), skipping\n", len);
-	pic->pos_in_file+=len-2;
-}
-
-void parse_APP0(picture_t * const pic)
-{
-    uint16_t len = get2i(pic->data, &(pic->pos_in_file));
-    printf("APP0 found (length %u bytes)\n", len);
-    if (len < 16)
-        errx(1, "APP0: too short");
-    
-    uint8_t identifier[5];
-    memcpy(identifier, &pic->data[pic->pos_in_file], 5);
-    pic->pos_in_file += 5;
-
-    uint_fast8_t version_major = get1i(pic->data, &(pic->pos_in_file));
-    uint_fast8_t version_minor = get1i(pic->data, &(pic->pos_in_file));
-    uint_fast8_t units = get1i(pic->data, &(pic->pos_in_file));
-    uint_fast16_t Xdensity = get2i(pic->data, &(pic->pos_in_file));
-    uint_fast16_t Ydensity = get2i(pic->data, &(pic->pos_in_file));
-    uint_fast16_t Xthumbnail = get1i(pic->data, &(pic->pos_in_file));
-    uint_fast16_t Ythumbnail = get1i(pic->data, &(pic->pos_in_file));
-        
-    if (memcmp(identifier, "JFIF\x00", 5))
-        errx(1, "APP0: invalid identifier");
-    
-    printf("version %u.%u\n", version_major, version_minor);
-    printf("units %u\n", units);
-    printf("density X %lu Y %lu\n", Xdensity, Ydensity);
-        
-    uint_fast32_t bytes_thumbnail = 3 * Xthumbnail * Ythumbnail;
-    
-    if (bytes_thumbnail)
-    {
-        printf("thumbnail %lu bytes, skipping\n", bytes_thumbnail);
-        pic->pos_in_file += bytes_thumbnail;
-    }
-    else
-        printf("no thumbnail\n");
-	printf("parse_APP0 at end get2i pic->pos_in_file: %lu\n", (unsigned long)pic->pos_in_file);
-}
-
-void parse_DQT(picture_t * const pic)
-{
-	uint16_t Lq=get2i(pic->data, &(pic->pos_in_file));
-	printf("DQT found (length %u bytes)\n", Lq);
-	
-	uint8_t PqTq=get1i(pic->data, &(pic->pos_in_file));
-	uint8_t Pq=(PqTq>>4)&0x0f;
-	uint8_t Tq=PqTq&0x0f;
-	printf("Pq (element precision) %u -> %u bits\n", Pq, (Pq==0)?8:16);
-	printf("Tq (table destination identifier) %u\n", Tq);
-	
-	if(Pq!=0)
-		errx(1, "DQT: only 8 bit precision supported");
-	
-	uint16_t nb_data_bytes=Lq-2-1;
-	
-	if(nb_data_bytes!=64)
-		errx(1, "DQT: nb_data_bytes!=64");
-
-	uint8_t u,v;
-	for(u=0; u<8; u++)
-	{
-		for(v=0; v<8; v++)
-		{
-			uint8_t Q=get1i(pic->data, &(pic->pos_in_file));
-			pic->quant_tables[Tq][u][v]=Q;
-		}
-	}
-	printf("\n");
-}
-
-void parse_SOF0(picture_t * const pic)
-{
-	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
-	printf("SOF0 found (length %u bytes)\n", len);
-	
-	uint_fast8_t P=get1i(pic->data, &(pic->pos_in_file));
-	uint_fast16_t Y=get2i(pic->data, &(pic->pos_in_file));
-	uint_fast16_t X=get2i(pic->data, &(pic->pos_in_file));
-	uint_fast8_t Nf=get1i(pic->data, &(pic->pos_in_file));
-	
-	if(P!=8)
-		errx(1, "SOF0: P!=8 unsupported");
-	
-	if(Y==0)
-		errx(1, "SOF0: Y==0 unsupported");
-	
-	printf("P %u (must be 8)\n", P);
-	printf("imagesize X %lu Y %lu\n", X, Y);
-	printf("Nf (number of components) %u\n", Nf);
-	
-	if(Nf!=3)
-		errx(1, "picture does not have 3 components, this code will not work");
-	
-	pic->size_X=X;
-	pic->size_Y=Y;
-	
+//-transform values, in jpeg_transform_t order
+char const * const transform_names[]={"none", "flip_h", "flip_v", "transpose", "transverse", "rot90", "rot180", "rot270"};
+
+//one line per picture, so that batch output stays readable
+void print_info(char const * const name, jpeg_info_t const * const info)
+{
+	static char const * const color_space_names[]={"gray", "YCbCr", "RGB", "CMYK", "YCCK"};
+	char line[512];
+	int len=snprintf(line, sizeof(line), "%s: %u x %u%s, %s, %u components", name, info->width, info->height, info->progressive ? " progressive" : "", color_space_names[info->color_space], info->nb_components);
 	uint_fast8_t i;
-	for(i=0; i<Nf; i++)
-	{
-		uint8_t C=get1i(pic->data, &(pic->pos_in_file));
-		uint8_t HV=get1i(pic->data, &(pic->pos_in_file));
-		uint8_t H=(HV>>4)&0x0f;
-		uint8_t V=HV&0x0f;
-		uint8_t Tq=get1i(pic->data, &(pic->pos_in_file));
-		
-		pic->components_data[i].H=H;
-		pic->components_data[i].V=V;
-		pic->components_data[i].Tq=Tq;
-		
-		printf("component %u (%s) C %u, H %u, V %u, Tq %u\n", i, comp_names[i], C, H, V, Tq);
-	}
-	
-	pic->nb_components=Nf;
-	
-	uint_fast8_t Hmax=0,Vmax=0;
-
-	for(i=0; i<pic->nb_components; i++)
-	{
-		if(pic->components_data[i].H>Hmax)
-			Hmax=pic->components_data[i].H;
-		if(pic->components_data[i].V>Vmax)
-			Vmax=pic->components_data[i].V;
-	}
-	
-	pic->Hmax=Hmax;
-	pic->Vmax=Vmax;
-	
-	pic->nb_MCU_total=(ceil_to_multiple_of(pic->size_X, 8*Hmax)/(8*Hmax))*(ceil_to_multiple_of(pic->size_Y, 8*Hmax)/(8*Vmax));
-	
-	printf("Hmax %u Vmax %u\n", Hmax, Vmax);
-	printf("MCU_total %lu\n", pic->nb_MCU_total);
-	
-	uint16_t xi,yi;
-	for(i=0; i<pic->nb_components; i++)
-	{
-		xi=(uint16_t)ceil((double)pic->size_X*pic->components_data[i].H/Hmax);
-		yi=(uint16_t)ceil((double)pic->size_Y*pic->components_data[i].V/Vmax);
-		
-		pic->components_data[i].xi=xi;
-		pic->components_data[i].yi=yi;
-		
-		printf("component %u (%s) xi %u yi %u\n", i, comp_names[i], xi, yi);
-	}
-	
-	printf("allocating memory for pixels\n");
-	
-	uint_fast16_t x,y;
-	pic->pixels_YCbCr=malloc(pic->size_X*sizeof(pixel_YCbCr_t*));
-	for(x=0; x<pic->size_X; x++)
-		pic->pixels_YCbCr[x]=malloc(pic->size_Y*sizeof(pixel_YCbCr_t));
-	
-	for(x=0; x<pic->size_X; x++)
-	{
-		for(y=0; y<pic->size_Y; y++)
-		{
-			pic->pixels_YCbCr[x][y].Y=0;
-			pic->pixels_YCbCr[x][y].Cb=0;
-			pic->pixels_YCbCr[x][y].Cr=0;
-		}
-	}
-	printf("memory allocated\n");
-}
-
-void parse_DHT(picture_t * const pic)
-{
-	uint16_t len=get2i(pic->data, &(pic->pos_in_file));
-	printf("DHT found (length %u bytes)\n", len);
-	
-	uint8_t TcTh=get1i(pic->data, &(pic->pos_in_file));
-	uint8_t Tc=(TcTh>>4)&0x0f;
-	uint8_t Th=TcTh&0x0f;
-	
-	printf("Tc %u (%s table)\n", Tc, (Tc==0)?"DC":"AC");
-	printf("Th (table destination identifier) %u\n", Th);
-	
-	uint8_t L[16];
-	uint8_t mt=0;
-	uint8_t i;
-	for(i=0; i<16; i++)
-	{
-		L[i]=get1i(pic->data, &(pic->pos_in_file));
-		mt+=L[i];
-	}
-	
-	printf("total %u codes\n", mt);
-
-	uint16_t codeword=0;
-	
-	for(i=0; i<16; i++)
-	{
-		uint8_t j;
-		for(j=0; j<L[i]; j++)
-		{
-			uint8_t V=get1i(pic->data, &(pic->pos_in_file));
-
-			pic->huff_tables[Tc][Th].entries[pic->huff_tables[Tc][Th].nb_entries].sz=i+1;
-			pic->huff_tables[Tc][Th].entries[pic->huff_tables[Tc][Th].nb_entries].codeword=codeword;
-			pic->huff_tables[Tc][Th].entries[pic->huff_tables[Tc][Th].nb_entries].decoded=V;
-			pic->huff_tables[Tc][Th].nb_entries++;
-			
-			codeword++;
-		}
-		codeword<<=1;
-	}
-}
-
-void parse_SOS(picture_t * const pic)
-{
-	uint16_t len=get2i(pic->data, &(pic->pos_in_file)); //without actual bitmap data
-	printf("SOS found (length %u bytes)\n", len);
-	
-	uint8_t Ns=get1i(pic->data, &(pic->pos_in_file));
-	printf("Ns %u\n", Ns);
-	
-	uint8_t j;
-	for(j=0; j<Ns; j++)
-	{
-		uint8_t Cs=get1i(pic->data, &(pic->pos_in_file));
-		uint8_t TdTa=get1i(pic->data, &(pic->pos_in_file));
-		uint8_t Td=(TdTa>>4)&0x0f;
-		uint8_t Ta=TdTa&0x0f;
-		
-		printf("component %u (%s) Cs %u Td %u Ta %u\n", j, comp_names[j], Cs, Td, Ta);
-		pic->components_data[j].Td=Td; //DC
-		pic->components_data[j].Ta=Ta; //AC
-	}
-	
-	uint8_t Ss=get1i(pic->data, &(pic->pos_in_file));
-	uint8_t Se=get1i(pic->data, &(pic->pos_in_file));
-	uint8_t AhAl=get1i(pic->data, &(pic->pos_in_file));
-	uint8_t Ah=(AhAl>>4)&0x0f;
-	uint8_t Al=AhAl&0x0f;
-	
-	printf("Ss %u Se %u Ah %u Al %u\n", Ss, Se, Ah, Al);
-	
-	pic->pos_compressed_pixeldata=pic->pos_in_file;
-	
-	printf("compressed pixeldata starts at pos %lu\n\n", pic->pos_compressed_pixeldata);
-}
-
-void copy_bitmap_data_remove_stuffing(picture_t * const pic)
-{
-	printf("removing stuffing...\n");
-	
-	//get length of bitstream without stuffing
-	
-	uint_fast32_t pos=pic->pos_compressed_pixeldata;
-	uint_fast32_t size=0;
-	uint8_t byte;
-	uint16_t combined=0;
-	
+
+	for(i=0; i<info->nb_components; i++)
+		len+=snprintf(&line[len], sizeof(line)-len, " %u:%ux%u/q%u", info->components[i].id, info->components[i].H, info->components[i].V, info->components[i].quant_table);
+
+	if(info->restart_interval)
+		len+=snprintf(&line[len], sizeof(line)-len, ", restart interval %u", info->restart_interval);
+
+	len+=snprintf(&line[len], sizeof(line)-len, ", scan at %u", info->scan_offset);
+	if(info->scan_length)
+		snprintf(&line[len], sizeof(line)-len, ", %u scans, %u bytes, %u restart markers", info->nb_scans, info->scan_length, info->nb_restart_markers);
+
+	printf("%s\n", line);
+}
+
+//decode a file through the streaming decoder, writing rows as they become available
+#define STREAM_CHUNK_BYTES 65536
+
+void stream_decode_file(char const * const name, char const * const out_name, const output_format_t format, jpeg_options_t const * const options)
+{
+	jpeg_pixel_format_t const pixel_format=output_pixel_format(format);
+
+	if(format==OUTPUT_P3)
+		errx(1, "-format p3 is not supported with -input stream");
+
+	FILE * const in=fopen(name, "rb");
+	if(!in)
+		err(1, "fopen %s failed", name);
+	FILE * const out=fopen(out_name, "wb");
+	if(!out)
+		err(1, "fopen %s failed", out_name);
+
+	jpeg_stream_t * const s=jpeg_stream_create(options);
+	uint8_t * const chunk=malloc(STREAM_CHUNK_BYTES);
+	uint8_t * row=NULL;
+	uint32_t size_X=0, size_Y=0;
+	size_t nb_read;
+
+	if(!s || !chunk)
+		err(1, "malloc");
+
 	do
 	{
-		if(pos>=pic->filesize)
-			errx(1, "marker EOI (0xFFD9) missing");
-		
-		byte=pic->data[pos++];
-		if(byte==0xFF)
-		{
-			uint8_t byte2=pic->data[pos++];
-			if(byte2!=0x00)
-				combined=(byte<<8)|byte2;
-			else
-				size++;
-		}
+		nb_read=fread(chunk, 1, STREAM_CHUNK_BYTES, in);
+		if(ferror(in))
+			err(1, "fread %s failed", name);
+
+		jpeg_status_t status;
+		if(nb_read)
+			status=jpeg_stream_feed(s, chunk, nb_read);
 		else
-			size++;
-	} while(combined!=0xFFD9);
-	
-	uint_fast32_t size_stuffed=pos-pic->pos_compressed_pixeldata-2;
-	
-	//remove stuffing
-	
-	pic->compressed_pixeldata=malloc(size*sizeof(uint8_t));
-	if(!pic->compressed_pixeldata)
-		err(1, "malloc");
-	
-	printf("%lu bytes with stuffing\n", size_stuffed);
-	
-	uint_fast32_t i;
-	uint_fast32_t size_without_stuffing;
-	
-	for(i=pic->pos_compressed_pixeldata, pos=0, size_without_stuffing=0; i<(pic->pos_compressed_pixeldata+size_stuffed); )
-	{
-		if(pic->data[i]!=0xFF)
+			status=jpeg_stream_finish(s);
+		if(status!=JPEG_OK)
+			errx(1, "%s: %s", name, jpeg_stream_error_message(s));
+
+		if(!row && jpeg_stream_get_size(s, &size_X, &size_Y))
 		{
-			pic->compressed_pixeldata[pos++]=pic->data[i++];
-			size_without_stuffing++;
+			row=malloc(jpeg_bytes_per_pixel(pixel_format)*size_X);
+			if(!row)
+				err(1, "malloc");
+
+			if(format==OUTPUT_P6)
+				fprintf(out, "P6\n%u %u\n255\n", size_X, size_Y);
 		}
-		else if(pic->data[i]==0xFF && pic->data[i+1]==0x00)
+
+		while(row)
 		{
-			pic->compressed_pixeldata[pos++]=0xFF;
-			size_without_stuffing++;
-			i+=2;
+			uint32_t nb_rows;
+			if(jpeg_stream_read_rows(s, 1, pixel_format, row, 0, &nb_rows)!=JPEG_OK)
+				errx(1, "%s: %s", name, jpeg_stream_error_message(s));
+			if(!nb_rows)
+				break;
+
+			if(fwrite(row, jpeg_bytes_per_pixel(pixel_format)*size_X, 1, out)!=1)
+				err(1, "fwrite %s failed", out_name);
 		}
-		else
-			errx(1, "unexpected marker 0x%02x%02x found in bitstream", pic->data[i], pic->data[i+1]);
+	} while(nb_read);
+
+	if(!jpeg_stream_done(s))
+		errx(1, "%s: EOI not found", name);
+
+	printf("%u rows decoded from %s through the streaming decoder\n", size_Y, name);
+
+	if(fclose(out))
+		err(1, "fclose %s failed", out_name);
+	fclose(in);
+
+	free(row);
+	free(chunk);
+	jpeg_stream_destroy(s);
+}
+
+//the whole file in a malloc'ed buffer, to exercise jpeg_decode_memory like a caller that already holds the data
+uint8_t * read_file(char const * const name, size_t * const size)
+{
+	FILE *f=fopen(name, "rb");
+	if(!f)
+		err(1, "fopen %s failed", name);
+
+	fseek(f, 0, SEEK_END);
+	*size=ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t * const data=malloc(*size);
+	if(!data)
+		err(1, "malloc for %s failed", name);
+
+	if(fread(data, *size, 1, f)!=1)
+		err(1, "fread for %s failed", name);
+
+	fclose(f);
+
+	printf("%zu bytes read from %s\n\n", *size, name);
+
+	return data;
+}
+
+double elapsed_seconds(struct timespec const * const start, struct timespec const * const end)
+{
+	return (end->tv_sec-start->tv_sec)+(end->tv_nsec-start->tv_nsec)/1e9;
+}
+
+//inputs of a batch run
+typedef struct
+{
+	char ** names;
+	size_t nb;
+	size_t capacity;
+} file_list_t;
+
+void file_list_add(file_list_t * const list, char const * const name)
+{
+	if(list->nb==list->capacity)
+	{
+		list->capacity=list->capacity ? 2*list->capacity : 256;
+		list->names=realloc(list->names, list->capacity*sizeof(char *));
+		if(!list->names)
+			err(1, "realloc");
 	}
-	
-	pic->bitpos_in_compressed_pixeldata=0;
-	pic->sz_compressed_pixeldata=size_without_stuffing;
-	pic->pos_in_file=pic->pos_compressed_pixeldata+size_stuffed;
-	
-	printf("%lu data bytes without stuffing\n\n", size_without_stuffing);
+
+	list->names[list->nb]=strdup(name);
+	if(!list->names[list->nb])
+		err(1, "strdup");
+	list->nb++;
 }
 
-int16_t convert_to_neg(uint16_t bits, const uint8_t sz)
+bool has_jpeg_extension(char const * const name)
 {
-	int16_t ret=-((bits^0xFFFF)&((1<<sz)-1));
-	return ret;
+	char const * const dot=strrchr(name, '.');
+	return dot && (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg"));
 }
 
+int compare_names(void const * const a, void const * const b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-uint16_t bitstream_get_bits(picture_t * const pic, const uint_fast8_t nb_bits)
+//the JPEG files of a directory (not its subdirectories), in name order
+void file_list_add_directory(file_list_t * const list, char const * const dirname)
 {
-	if(nb_bits>16)
-		errx(1, "bitstream_get_bits: >16 bits requested");
-	
-	uint_fast32_t index=pic->bitpos_in_compressed_pixeldata/8;
-	int_fast8_t pos_in_byte=(7-pic->bitpos_in_compressed_pixeldata%8);
-	uint16_t ret=0;
-	uint_fast8_t bits_copied=0;
-	
-	while(pos_in_byte>=0 && bits_copied<nb_bits)
+	DIR * const dir=opendir(dirname);
+	if(!dir)
+		err(1, "opendir %s failed", dirname);
+
+	size_t const first=list->nb;
+	struct dirent *entry;
+	char path[PATH_MAX];
+
+	while((entry=readdir(dir)))
 	{
-		ret<<=1;
-		ret|=!!(pic->compressed_pixeldata[index]&(1<<pos_in_byte));
-		bits_copied++;
-		pos_in_byte--;
-		if(pos_in_byte<0)
-		{
-			pos_in_byte=7;
-			index++;
-		}
+		if(!has_jpeg_extension(entry->d_name))
+			continue;
+		if(snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name)>=(int)sizeof(path))
+			errx(1, "%s/%s: path too long", dirname, entry->d_name);
+		file_list_add(list, path);
 	}
-	
-	return ret;	
+
+	closedir(dir);
+
+	qsort(&list->names[first], list->nb-first, sizeof(char *), compare_names);
 }
 
-void bitstream_remove_bits(picture_t * const pic, const uint_fast8_t nb_bits)
+//a file or all JPEG files of a directory
+void file_list_add_path(file_list_t * const list, char const * const path)
 {
-	pic->bitpos_in_compressed_pixeldata+=nb_bits;
+	struct stat st;
+	if(!stat(path, &st) && S_ISDIR(st.st_mode))
+		file_list_add_directory(list, path);
+	else
+		file_list_add(list, path);
 }
 
+//manifest: one path per line, empty lines are skipped
+void file_list_add_manifest(file_list_t * const list, char const * const manifest)
+{
+	FILE * const f=fopen(manifest, "r");
+	if(!f)
+		err(1, "fopen %s failed", manifest);
+
+	char * line=NULL;
+	size_t line_size=0;
+	ssize_t len;
+
+	while((len=getline(&line, &line_size, f))>=0)
+	{
+		while(len && (line[len-1]=='\n' || line[len-1]=='\r'))
+			line[--len]='\0';
+		if(len)
+			file_list_add_path(list, line);
+	}
+
+	free(line);
+	fclose(f);
+}
+
+void file_list_free(file_list_t * const list)
+{
+	size_t i;
+	for(i=0; i<list->nb; i++)
+		free(list->names[i]);
+	free(list->names);
+}
+
+//input name with its extension replaced, in outdir if given, else next to the input
+bool derive_output_name(char const * const input, char const * const outdir, char const * const extension, char * const out, const size_t size)
+{
+	char const * const slash=strrchr(input, '/');
+	char const * const base=slash ? slash+1 : input;
+	char const * const dot=strrchr(base, '.');
+	int const base_len=dot ? dot-base : (int)strlen(base);
+	int len;
+
+	if(outdir)
+		len=snprintf(out, size, "%s/%.*s.%s", outdir, base_len, base, extension);
+	else
+		len=snprintf(out, size, "%.*s%.*s.%s", (int)(base-input), input, base_len, base, extension);
+
+	return len>=0 && (size_t)len<size;
+}
+
+//work stealing: the inputs are split in contiguous ranges, one per worker. A worker whose range is empty takes the
+//second half of the largest range left. Only one lock is held at a time
+typedef struct
+{
+	pthread_mutex_t lock;
+	size_t next;
+	size_t end;
+} work_range_t;
+
+typedef struct
+{
+	file_list_t const * inputs;
+	work_range_t * ranges;
+	unsigned nb_workers;
+	jpeg_options_t const * options;
+	output_format_t format;
+	char const * outdir;
+	task_t task;
+	jpeg_transform_t transform;
+} batch_t;
 
-bool huff_decode(picture_t * const pic, const uint8_t Tc, const uint8_t Th, const uint8_t sz, const uint16_t bitstream, uint8_t * const decoded)
+typedef struct
+{
+	batch_t * batch;
+	unsigned id;
+	pthread_t thread;
+	uint_fast32_t nb_decoded;
+	uint_fast32_t nb_failed;
+	uint_fast32_t nb_stolen;
+	uint64_t bytes_in;
+	uint64_t pixels;
+} batch_worker_t;
+
+bool batch_next_input(batch_t * const batch, const unsigned id, size_t * const index, uint_fast32_t * const nb_stolen)
 {
-	uint32_t i;
-	for(i=0; i<pic->huff_tables[Tc][Th].nb_entries; i++)
+	work_range_t * const own=&batch->ranges[id];
+
+	pthread_mutex_lock(&own->lock);
+	bool const found=own->next<own->end;
+	if(found)
+		*index=own->next++;
+	pthread_mutex_unlock(&own->lock);
+	if(found)
+		return true;
+
+	while(true)
 	{
-		if(pic->huff_tables[Tc][Th].entries[i].sz==sz && pic->huff_tables[Tc][Th].entries[i].codeword==bitstream)
+		unsigned v, victim=id;
+		size_t most=0;
+
+		for(v=0; v<batch->nb_workers; v++)
 		{
-			(*decoded)=pic->huff_tables[Tc][Th].entries[i].decoded;
-			return true;
+			pthread_mutex_lock(&batch->ranges[v].lock);
+			size_t const left=batch->ranges[v].end-batch->ranges[v].next;
+			pthread_mutex_unlock(&batch->ranges[v].lock);
+			if(left>most)
+			{
+				most=left;
+				victim=v;
+			}
 		}
+		if(!most)
+			return false;
+
+		work_range_t * const range=&batch->ranges[victim];
+		pthread_mutex_lock(&range->lock);
+		size_t const left=range->end-range->next;
+		size_t const stolen_end=range->end;
+		range->end-=(left+1)/2;
+		size_t const stolen_begin=range->end;
+		pthread_mutex_unlock(&range->lock);
+
+		if(!left) //emptied since the scan, look again
+			continue;
+
+		pthread_mutex_lock(&own->lock);
+		own->next=stolen_begin+1;
+		own->end=stolen_end;
+		pthread_mutex_unlock(&own->lock);
+
+		(*nb_stolen)++;
+		*index=stolen_begin;
+		return true;
 	}
-	
-	return false;
 }
 
+//transformed.jpg of name.jpg is name.<transform>.jpg
+bool batch_transform(batch_t const * const batch, jpeg_decoder_t * const dec, char const * const name)
+{
+	char out_name[PATH_MAX];
+	char extension[32];
+	uint8_t const * data;
+	size_t size;
+
+	if(jpeg_transform_file(dec, name, batch->transform, &data, &size)!=JPEG_OK)
+	{
+		warnx("%s: %s", name, jpeg_error_message(dec));
+		return false;
+	}
+
+	snprintf(extension, sizeof(extension), "%s.jpg", transform_names[batch->transform]);
+	if(!derive_output_name(name, batch->outdir, extension, out_name, sizeof(out_name)))
+	{
+		warnx("%s: output name too long", name);
+		return false;
+	}
+
+	return write_buffer(out_name, data, size);
+}
 
-bool bitstream_get_next_decoded_element(picture_t * const pic, const uint8_t Tc, const uint8_t Th, uint8_t * const decoded, uint_fast8_t * const nb_bits)
+void * batch_worker(void * const arg)
 {
-	uint16_t huff_candidate;
-	bool found;
-	
-	while(pic->bitpos_in_compressed_pixeldata<8*pic->sz_compressed_pixeldata)
+	batch_worker_t * const worker=arg;
+	batch_t * const batch=worker->batch;
+	char out_name[PATH_MAX];
+	size_t index;
+
+	jpeg_decoder_t * const dec=jpeg_decoder_create(batch->options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	while(batch_next_input(batch, worker->id, &index, &worker->nb_stolen))
 	{
-		found=false;
-		for(*nb_bits=1; *nb_bits<=16; (*nb_bits)++)
+		char const * const name=batch->inputs->names[index];
+		struct stat st;
+
+		if(batch->task==TASK_PROBE || batch->task==TASK_PROBE_SCAN)
 		{
-			if((pic->bitpos_in_compressed_pixeldata+*nb_bits)>8*pic->sz_compressed_pixeldata)
-				errx(1, "end of stream, requested to many bits");
-			
-			huff_candidate=bitstream_get_bits(pic, *nb_bits);
-			if(huff_decode(pic, Tc, Th, *nb_bits, huff_candidate, decoded))
+			jpeg_info_t info;
+			if(jpeg_probe_file(dec, name, batch->task==TASK_PROBE_SCAN, &info)!=JPEG_OK)
 			{
-				found=true;
-				bitstream_remove_bits(pic, *nb_bits);
-
-				return true;
+				warnx("%s: %s", name, jpeg_error_message(dec));
+				worker->nb_failed++;
+				continue;
 			}
+
+			print_info(name, &info);
+			worker->nb_decoded++;
+			worker->pixels+=(uint64_t)info.width*info.height;
+			if(!stat(name, &st))
+				worker->bytes_in+=st.st_size;
+			continue;
 		}
-		if(!found)
+
+		if(batch->task==TASK_TRANSFORM)
 		{
-			//check if it's padding, else error
-			bool is_all_one=true;
-			uint_fast8_t i;
-			for(i=0; i<(*nb_bits)-1; i++)
+			if(!batch_transform(batch, dec, name))
 			{
-				if((huff_candidate&(1<<i))==0)
-				{
-					is_all_one=false;
-					break;
-				}
+				worker->nb_failed++;
+				continue;
 			}
-			
-			if(is_all_one) //padding
-				bitstream_remove_bits(pic, *nb_bits);
-			else
-				errx(1, "unknown code in bitstream bitpos %lu byte 0x%x [prev 0x%x, next 0x%x]", pic->bitpos_in_compressed_pixeldata, pic->compressed_pixeldata[pic->bitpos_in_compressed_pixeldata/8], pic->compressed_pixeldata[(pic->bitpos_in_compressed_pixeldata/8)-1], pic->compressed_pixeldata[(pic->bitpos_in_compressed_pixeldata/8)+1]);
+
+			worker->nb_decoded++;
+			if(!stat(name, &st))
+				worker->bytes_in+=st.st_size;
+			continue;
+		}
+
+		jpeg_status_t const status=jpeg_decode_file(dec, name);
+		if(status!=JPEG_OK)
+		{
+			warnx("%s: %s", name, jpeg_error_message(dec));
+			worker->nb_failed++;
+			continue;
+		}
+
+		if(!derive_output_name(name, batch->outdir, output_extension(batch->format), out_name, sizeof(out_name)))
+		{
+			warnx("%s: output name too long", name);
+			worker->nb_failed++;
+			continue;
 		}
+
+		if(!write_image(dec, out_name, batch->format))
+		{
+			worker->nb_failed++;
+			continue;
+		}
+
+		uint32_t size_X, size_Y;
+		jpeg_get_size(dec, &size_X, &size_Y);
+
+		worker->nb_decoded++;
+		worker->pixels+=(uint64_t)size_X*size_Y;
+		if(!stat(name, &st))
+			worker->bytes_in+=st.st_size;
+	}
+
+	jpeg_decoder_destroy(dec);
+	return NULL;
+}
+
+//decode all inputs on nb_workers threads with one decoder each, false if any input failed
+bool batch_decode(file_list_t const * const inputs, const unsigned nb_workers, jpeg_options_t const * const options, const output_format_t format, char const * const outdir, const task_t task, const jpeg_transform_t transform)
+{
+	work_range_t ranges[nb_workers];
+	batch_worker_t workers[nb_workers];
+	batch_t batch={inputs, ranges, nb_workers, options, format, outdir, task, transform};
+	struct timespec start_time, end_time;
+	unsigned w;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	for(w=0; w<nb_workers; w++)
+	{
+		pthread_mutex_init(&ranges[w].lock, NULL);
+		ranges[w].next=inputs->nb*w/nb_workers;
+		ranges[w].end=inputs->nb*(w+1)/nb_workers;
+
+		memset(&workers[w], 0, sizeof(batch_worker_t));
+		workers[w].batch=&batch;
+		workers[w].id=w;
+	}
+
+	//all ranges are set before the first worker can steal
+	for(w=0; w<nb_workers; w++)
+		if(pthread_create(&workers[w].thread, NULL, batch_worker, &workers[w]))
+			errx(1, "pthread_create failed");
+
+	uint_fast32_t nb_decoded=0, nb_failed=0, nb_stolen=0;
+	uint64_t bytes_in=0, pixels=0;
+
+	for(w=0; w<nb_workers; w++)
+	{
+		pthread_join(workers[w].thread, NULL);
+
+		nb_decoded+=workers[w].nb_decoded;
+		nb_failed+=workers[w].nb_failed;
+		nb_stolen+=workers[w].nb_stolen;
+		bytes_in+=workers[w].bytes_in;
+		pixels+=workers[w].pixels;
 	}
 
-	return false;
+	//the other workers may scan a range until they are joined
+	for(w=0; w<nb_workers; w++)
+		pthread_mutex_destroy(&ranges[w].lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	double const seconds=elapsed_seconds(&start_time, &end_time);
+
+	char const * const done[]={"decoded", "transformed", "probed", "probed"};
+	printf("%lu images %s, %lu failed, %u workers, %lu steals\n", nb_decoded, done[task], nb_failed, nb_workers, nb_stolen);
+	printf("%f seconds, %.1f images/s, %.1f MB/s of JPEG data, %.1f Mpixel/s\n", seconds, nb_decoded/seconds, bytes_in/seconds/1e6, pixels/seconds/1e6);
+
+	return !nb_failed;
 }
 
+//lossless transform of one file to transformed.jpg
+int transform_file(char const * const filename, const jpeg_transform_t transform, const bool in_memory, jpeg_options_t const * const options)
+{
+	struct timespec start_time, end_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	jpeg_decoder_t * const dec=jpeg_decoder_create(options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	jpeg_status_t status;
+	uint8_t const * data;
+	size_t size;
+	uint8_t * file_data=NULL;
+	if(in_memory)
+	{
+		size_t file_size;
+		file_data=read_file(filename, &file_size);
+		status=jpeg_transform_memory(dec, file_data, file_size, transform, &data, &size);
+	}
+	else
+		status=jpeg_transform_file(dec, filename, transform, &data, &size);
+	if(status!=JPEG_OK)
+		errx(1, "%s: %s", filename, jpeg_error_message(dec));
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	bool const ok=write_buffer("transformed.jpg", data, size);
+	printf("Time taken by the transform: %f seconds\n", elapsed_seconds(&start_time, &end_time));
+
+	jpeg_decoder_destroy(dec);
+	free(file_data);
+	return ok ? 0 : 1;
+}
 
-void store_data_unit_YCbCr(picture_t * const pic, const uint_fast32_t MCU, const uint_fast8_t component, const uint_fast8_t data_unit, const matrix8x8_t data)
+//print what the headers of one file tell
+int probe_file(char const * const filename, const bool validate_scan, const bool in_memory, jpeg_options_t const * const options)
 {
-	uint_fast8_t zoomX, zoomY;
-	
-	zoomX=pic->Hmax/pic->components_data[component].H;
-	zoomY=pic->Vmax/pic->components_data[component].V;
-	
-	uint_fast8_t scaleX, scaleY;
-	
-	scaleX=8*pic->components_data[component].H;
-	scaleY=8*pic->components_data[component].V;
-	
-	uint_fast16_t startX, startY;
-	
-	startX=MCU%(ceil_to_multiple_of(pic->size_X, 8*pic->Hmax)/(scaleX*zoomX));
-	startY=MCU/(ceil_to_multiple_of(pic->size_X, 8*pic->Hmax)/(scaleY*zoomY)); //yes, size_X and H!
-	
-	uint_fast16_t startHiX=data_unit%pic->components_data[component].H;
-	uint_fast16_t startHiY=data_unit/pic->components_data[component].H; //yes, H!
-	
-	uint_fast8_t x,y;
-	uint_fast8_t zx,zy;
-	
-	uint_fast32_t posX, posY;
-	
-	for(x=0; x<8; x++)
+	struct timespec start_time, end_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	jpeg_decoder_t * const dec=jpeg_decoder_create(options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	jpeg_info_t info;
+	jpeg_status_t status;
+	uint8_t * file_data=NULL;
+	if(in_memory)
 	{
-		for(y=0; y<8; y++)
+		size_t file_size;
+		file_data=read_file(filename, &file_size);
+		status=jpeg_probe_memory(dec, file_data, file_size, validate_scan, &info);
+	}
+	else
+		status=jpeg_probe_file(dec, filename, validate_scan, &info);
+	if(status!=JPEG_OK)
+		errx(1, "%s: %s", filename, jpeg_error_message(dec));
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	print_info(filename, &info);
+	printf("Time taken by the probe: %f seconds\n", elapsed_seconds(&start_time, &end_time));
+
+	jpeg_decoder_destroy(dec);
+	free(file_data);
+	return 0;
+}
+
+//benchmark: every input decoded warmup+iterations times, each stage timed on its own by jpeg_benchmark_stages
+//and the whole decode (jpeg_decode_memory and jpeg_read_rows) timed as a program would run it. Medians are reported
+#define BENCH_MAX_ITERATIONS 1000
+#define BENCH_DEFAULT_SYNTHETIC "4096x3072"
+
+char const * const stage_names[JPEG_NB_STAGES]={"markers", "destuff", "huffman", "dequant", "idct", "upsample", "color", "output"};
+
+typedef struct
+{
+	uint64_t median_ns;
+	uint64_t min_ns;
+	uint64_t median_cycles;
+} bench_stat_t;
+
+typedef struct
+{
+	char const * name;
+	size_t bytes;
+	uint32_t width;
+	uint32_t height;
+	uint32_t nb_MCUs;
+	uint32_t nb_scans;
+	bench_stat_t stages[JPEG_NB_STAGES];
+	bench_stat_t decode;
+} bench_result_t;
+
+int compare_u64(void const * const a, void const * const b)
+{
+	uint64_t const x=*(uint64_t const *)a, y=*(uint64_t const *)b;
+	return (x>y)-(x<y);
+}
+
+//sorts values
+uint64_t median_u64(uint64_t * const values, const unsigned n)
+{
+	qsort(values, n, sizeof(uint64_t), compare_u64);
+	return n%2 ? values[n/2] : (values[n/2-1]+values[n/2])/2;
+}
+
+//synthetic inputs are named synthetic:WxH:sampling, sampling 444, 422, 420 or gray
+bool is_synthetic(char const * const name)
+{
+	return !strncmp(name, "synthetic:", 10);
+}
+
+uint8_t * synthesize(char const * const name, size_t * const size)
+{
+	unsigned width, height;
+	char sampling[8];
+	if(sscanf(name, "synthetic:%ux%u:%7s", &width, &height, sampling)!=3)
+		errx(1, "%s: synthetic:WxH:sampling expected", name);
+
+	uint8_t nb_components=3, H=1, V=1;
+	if(!strcmp(sampling, "gray"))
+		nb_components=1;
+	else if(!strcmp(sampling, "422"))
+		H=2;
+	else if(!strcmp(sampling, "420"))
+		H=V=2;
+	else if(strcmp(sampling, "444"))
+		errx(1, "%s: unknown sampling %s (444, 422, 420 or gray)", name, sampling);
+
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	uint8_t const * out;
+	if(jpeg_synthesize(dec, width, height, nb_components, H, V, width^height, &out, size)!=JPEG_OK)
+		errx(1, "%s: %s", name, jpeg_error_message(dec));
+
+	uint8_t * const data=malloc(*size);
+	if(!data)
+		err(1, "malloc");
+	memcpy(data, out, *size);
+
+	jpeg_decoder_destroy(dec);
+	return data;
+}
+
+//false with a message if the input does not decode
+bool bench_image(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const unsigned warmup, const unsigned iterations, const jpeg_pixel_format_t format, bench_result_t * const result)
+{
+	uint64_t ns[JPEG_NB_STAGES+1][iterations];
+	uint64_t cycles[JPEG_NB_STAGES][iterations];
+	uint8_t * image=NULL;
+	size_t image_size=0;
+	int i;
+	unsigned s;
+
+	for(i=-(int)warmup; i<(int)iterations; i++)
+	{
+		jpeg_stage_times_t times;
+		if(jpeg_benchmark_stages(dec, data, size, format, &times)!=JPEG_OK)
 		{
-			for(zx=0; zx<zoomX; zx++)
-			{
-				for(zy=0; zy<zoomY; zy++)
-				{
-					posX=(scaleX*startX+8*startHiX+x)*zoomX+zx;
-					posY=(scaleY*startY+8*startHiY+y)*zoomY+zy;
-					
-					if(posX<pic->size_X && posY<pic->size_Y)
-					{			
-						switch(component)
-						{
-							case 0: pic->pixels_YCbCr[posX][posY].Y=data[x][y]; break;
-							case 1: pic->pixels_YCbCr[posX][posY].Cb=data[x][y]; break;
-							case 2: pic->pixels_YCbCr[posX][posY].Cr=data[x][y]; break;
-							default: errx(1, "unknown component"); break;
-						}
-					}
-				}
-			}
+			free(image);
+			return false;
+		}
+
+		size_t const stride=(size_t)times.width*jpeg_bytes_per_pixel(format);
+		if(stride*times.height>image_size)
+		{
+			image_size=stride*times.height;
+			free(image);
+			image=malloc(image_size);
+			if(!image)
+				err(1, "malloc");
+		}
+
+		struct timespec start_time, end_time;
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		if(jpeg_decode_memory(dec, data, size)!=JPEG_OK || jpeg_read_rows(dec, 0, times.height, format, image, stride)!=JPEG_OK)
+		{
+			free(image);
+			return false;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+		if(i<0)
+			continue;
+		for(s=0; s<JPEG_NB_STAGES; s++)
+		{
+			ns[s][i]=times.ns[s];
+			cycles[s][i]=times.cycles[s];
 		}
+		ns[JPEG_NB_STAGES][i]=(end_time.tv_sec-start_time.tv_sec)*1000000000ULL+end_time.tv_nsec-start_time.tv_nsec;
+
+		result->width=times.width;
+		result->height=times.height;
+		result->nb_MCUs=times.nb_MCUs;
+		result->nb_scans=times.nb_scans;
+	}
+	free(image);
+
+	for(s=0; s<=JPEG_NB_STAGES; s++)
+	{
+		bench_stat_t * const stat=s<JPEG_NB_STAGES ? &result->stages[s] : &result->decode;
+		stat->median_ns=median_u64(ns[s], iterations);
+		stat->min_ns=ns[s][0];
+		stat->median_cycles=s<JPEG_NB_STAGES ? median_u64(cycles[s], iterations) : 0;
 	}
+	result->bytes=size;
+	return true;
 }
 
+void print_bench_result(bench_result_t const * const r)
+{
+	unsigned s;
 
-void reverse_ZZ_and_dequant(picture_t const * const pic, const uint8_t quant_table, const matrix8x8_t inp, matrix8x8_t outp)
-{
-	const uint_fast8_t reverse_ZZ_u[8][8]={	{0, 0, 1, 2, 1, 0, 0, 1 },
-											{2, 3, 4, 3, 2, 1, 0, 0 },
-											{1, 2, 3, 4, 5, 6, 5, 4 },
-											{3, 2, 1, 0, 0, 1, 2, 3 },
-											{4, 5, 6, 7, 7, 6, 5, 4 },
-											{3, 2, 1, 2, 3, 4, 5, 6 },
-											{7, 7, 6, 5, 4, 3, 4, 5 },
-											{6, 7, 7, 6, 5, 6, 7, 7 }	};
-										
-	const uint_fast8_t reverse_ZZ_v[8][8]={	{0, 1, 0, 0, 1, 2, 3, 2 },
-											{1, 0, 0, 1, 2, 3, 4, 5 },
-											{4, 3, 2, 1, 0, 0, 1, 2 },
-											{3, 4, 5, 6, 7, 6, 5, 4 },
-											{3, 2, 1, 0, 1, 2, 3, 4 },
-											{5, 6, 7, 7, 6, 5, 4, 3 },
-											{2, 3, 4, 5, 6, 7, 7, 6 },
-											{5, 4, 5, 6, 7, 7, 6, 7 }	};
-	
-	uint_fast8_t u,v;
-	
-	for(u=0; u<8; u++)
-		for(v=0; v<8; v++)
-			outp[reverse_ZZ_u[u][v]][reverse_ZZ_v[u][v]]=inp[u][v]*pic->quant_tables[quant_table][u][v];
-}
-
-#define a_c 0.9807
-#define b_c 0.8314
-#define c_c 0.5555
-#define d_c 0.1950
-#define e_c 0.9238
-#define f_c 0.3826
-#define g_c 0.7071
-
-
-static float tab_coefs[8][8] = {{0.7071,  a_c,  e_c,  b_c,  g_c,  c_c,  f_c,  d_c},
-                                {0.7071,  b_c,  f_c, -d_c, -g_c, -a_c, -e_c, -c_c},
-                                {0.7071,  c_c, -f_c, -a_c, -g_c,  d_c,  e_c,  b_c},
-                                {0.7071,  d_c, -e_c, -c_c,  g_c,  b_c, -f_c, -a_c},
-                                {0.7071, -d_c, -e_c,  c_c,  g_c, -b_c, -f_c,  a_c},
-                                {0.7071, -c_c, -f_c,  a_c, -g_c, -d_c,  e_c, -b_c},
-                                {0.7071, -b_c,  f_c,  d_c, -g_c,  a_c, -e_c,  c_c},
-                                {0.7071, -a_c,  e_c, -b_c,  g_c, -c_c,  f_c, -d_c}};
-
-
-void data_unit_do_idct(const matrix8x8_t inp, matrix8x8_t outp)
-{
-    double rxy=0;
-  
-    uint_fast8_t x, y;
-    uint_fast8_t u, v;
-        
-    for(y=0; y<8; y++)
-    {
-        for(x=0; x<8; x++)
-        {
-        rxy=0;
-
-        for(u=0; u<=7; u++)
-        {
-            for(v=0; v<=7; v++)
-            {
-            double Svu=inp[v][u];
-
-            rxy+= Svu*tab_coefs[x][u]*tab_coefs[y][v];
-            }
-        }
-                
-        rxy*=0.25;
-        rxy+=128;
-
-        outp[x][y]=rxy;
-        }
-    }
-}
-
-void print_matrix(matrix8x8_t m)
-{
-	for(int u = 0; u < 8; u++) {
-		for(int v = 0; v < 8; v++) {
-			printf("%5f ", m[u][v]);
-		}
+	printf("%s: %u x %u, %u MCUs, %u scans, %zu bytes\n", r->name, r->width, r->height, r->nb_MCUs, r->nb_scans, r->bytes);
+	printf("  %-9s %10s %10s %10s %12s\n", "stage", "ms", "ns/MCU", "MB/s", "Mcycles");
+	for(s=0; s<=JPEG_NB_STAGES; s++)
+	{
+		bench_stat_t const * const stat=s<JPEG_NB_STAGES ? &r->stages[s] : &r->decode;
+		printf("  %-9s %10.3f %10.1f %10.1f", s<JPEG_NB_STAGES ? stage_names[s] : "decode", stat->median_ns/1e6, (double)stat->median_ns/r->nb_MCUs, stat->median_ns ? r->bytes*1e3/stat->median_ns : 0);
+		if(s<JPEG_NB_STAGES)
+			printf(" %12.3f", stat->median_cycles/1e6);
 		printf("\n");
 	}
-	printf("\n");
 }
 
-void parse_bitmap_data(picture_t * const pic)
+//the whole decode has no cycle count, the library only counts them for the stages
+void write_bench_stat(FILE * const f, char const * const indent, char const * const name, bench_stat_t const * const stat, bench_result_t const * const r, char const * const end)
 {
-	printf("parsing bitstream...\n");
-	
-	uint_fast8_t nb_bits;
-	uint_fast8_t component=0; //Cs
-	uint_fast8_t data_unit;
-	uint_fast8_t u,v;
-	uint_fast8_t ac_count;
-	
-	int16_t precedent_DC[4]={0,0,0,0};
-	
-	uint_fast32_t nb_MCU=0;
+	fprintf(f, "%s\"%s\": {\"ns\": %llu, \"ns_min\": %llu, \"ns_per_MCU\": %.2f, \"MB_per_s\": %.2f", indent, name, (unsigned long long)stat->median_ns, (unsigned long long)stat->min_ns, (double)stat->median_ns/r->nb_MCUs, stat->median_ns ? r->bytes*1e3/stat->median_ns : 0);
+	if(stat!=&r->decode)
+		fprintf(f, ", \"cycles\": %llu", (unsigned long long)stat->median_cycles);
+	fprintf(f, "}%s\n", end);
+}
 
-	matrix8x8_t matrix;
-	
-	for(nb_MCU=0; nb_MCU<pic->nb_MCU_total; nb_MCU++)
+//one stage per line, which compare_bench_baseline relies on
+bool write_bench_json(char const * const filename, bench_result_t const * const results, const size_t nb, char const * const kernels, const unsigned warmup, const unsigned iterations, jpeg_options_t const * const options)
+{
+	char const * const idct_names[]={"float", "islow", "ifast"};
+	FILE * const f=fopen(filename, "w");
+	if(!f)
 	{
-		for(component=0; component<pic->nb_components; component++)
-		{
-			for(data_unit=0; data_unit<(pic->components_data[component].V*pic->components_data[component].H); data_unit++)
-			{
+		warn("fopen %s failed", filename);
+		return false;
+	}
 
-				for(u=0; u<8; u++)
-					for(v=0; v<8; v++)
-						matrix[u][v]=0;
-				
-				uint8_t SSSS;
-				int16_t DC;
-				if(!bitstream_get_next_decoded_element(pic, 0, pic->components_data[component].Td, &SSSS, &nb_bits))
-					errx(1, "no DC data");
-				if(SSSS)
-				{
-					uint16_t bits_DC=bitstream_get_bits(pic, SSSS);
-					bitstream_remove_bits(pic, SSSS);
-					
-					bool msb_DC=!!(bits_DC&(1<<(SSSS-1)));
-					
-					if(msb_DC)
-						DC=precedent_DC[component]+bits_DC;
-					else
-						DC=precedent_DC[component]+convert_to_neg(bits_DC,SSSS);
-					
-				}
-				else
-					DC=precedent_DC[component]+0;
-				
-				matrix[0][0]=DC;
-				precedent_DC[component]=DC;
-
-				int16_t AC;
-				for(ac_count=0; ac_count<63; )
-				{
-					uint8_t RRRRSSSS;
-					if(!bitstream_get_next_decoded_element(pic, 1, pic->components_data[component].Ta, &RRRRSSSS, &nb_bits))
-						errx(1, "no AC data");
-					
-					uint8_t RRRR=(RRRRSSSS>>4); //number of preceding 0 samples
-					uint8_t SSSS=RRRRSSSS&0x0f; //category
-					
-					if(RRRR==0 && SSSS==0)
-					{
-
-						break;
-					}
-					else if(RRRR==0x0F && SSSS==0)
-					{
-						ac_count+=16;
-
-					}
-					else
-					{
-						ac_count+=RRRR;
-						
-						uint16_t bits_AC=bitstream_get_bits(pic, SSSS);
-						bitstream_remove_bits(pic, SSSS);
-						
-						bool msb_AC=!!(bits_AC&(1<<(SSSS-1)));
-						
-						if(msb_AC)
-							AC=bits_AC;
-						else
-							AC=convert_to_neg(bits_AC,SSSS);
-						
-						u=(ac_count+1)/8;
-						v=(ac_count+1)%8;
-						matrix[u][v]=AC;
-						ac_count++;
-
-					}
-				}
-
-				matrix8x8_t matrix_dequant;
-
-				reverse_ZZ_and_dequant(pic, pic->components_data[component].Tq, matrix, matrix_dequant);
-				matrix8x8_t matrix_decoded;
-
-				data_unit_do_idct(matrix_dequant, matrix_decoded);
-				store_data_unit_YCbCr(pic, nb_MCU, component, data_unit, matrix_decoded);
-			}
-		}
+	fprintf(f, "{\n\t\"kernels\": \"%s\", \"idct\": \"%s\", \"upsample\": \"%s\", \"scale_denom\": %u, \"threads\": %u, \"warmup\": %u, \"iterations\": %u,\n", kernels, idct_names[options->idct_method], options->upsampling==UPSAMPLE_FANCY ? "fancy" : "nearest", options->scale_denom, options->nb_threads, warmup, iterations);
+	fprintf(f, "\t\"images\": [\n");
+
+	size_t i;
+	unsigned s;
+	for(i=0; i<nb; i++)
+	{
+		bench_result_t const * const r=&results[i];
+
+		fprintf(f, "\t\t{\"name\": \"%s\", \"bytes\": %zu, \"width\": %u, \"height\": %u, \"MCUs\": %u, \"scans\": %u,\n", r->name, r->bytes, r->width, r->height, r->nb_MCUs, r->nb_scans);
+		write_bench_stat(f, "\t\t\t", "decode", &r->decode, r, ",");
+		fprintf(f, "\t\t\t\"stages\": {\n");
+		for(s=0; s<JPEG_NB_STAGES; s++)
+			write_bench_stat(f, "\t\t\t\t", stage_names[s], &r->stages[s], r, s+1<JPEG_NB_STAGES ? "," : "");
+		fprintf(f, "\t\t\t}}%s\n", i+1<nb ? "," : "");
 	}
-	printf("parsed %lu MCU\n", nb_MCU);
-}
 
+	fprintf(f, "\t]\n}\n");
+	return !fclose(f);
+}
 
-void open_new_picture(char const * const name, picture_t * const picture)
+//a previous write_bench_json output: every image and stage also measured now must not have become more than
+//tolerance percent slower per MCU. Returns the number of regressions
+unsigned compare_bench_baseline(char const * const filename, bench_result_t const * const results, const size_t nb, const double tolerance)
 {
-	FILE *f=fopen(name, "rb");
+	FILE * const f=fopen(filename, "r");
 	if(!f)
-		err(1, "fopen %s failed", name);
-	
-	fseek(f, 0, SEEK_END);
-	picture->filesize=ftell(f);
-	fseek(f, 0, SEEK_SET);
-	
-	picture->data=malloc(picture->filesize*sizeof(uint8_t));
-	if(!picture->data)
-		err(1, "malloc for %s failed", name);
-		
-	if(fread(picture->data, picture->filesize, 1, f)!=1)
-		err(1, "fread for %s failed", name);
-		
+		err(1, "fopen %s failed", filename);
+
+	bench_result_t const * current=NULL;
+	unsigned nb_regressions=0, nb_compared=0;
+	char * line=NULL;
+	size_t line_size=0;
+
+	while(getline(&line, &line_size, f)>=0)
+	{
+		char const * p=strstr(line, "\"name\": \"");
+		if(p)
+		{
+			p+=9;
+			size_t const len=strcspn(p, "\"");
+			size_t i;
+
+			current=NULL;
+			for(i=0; i<nb; i++)
+				if(strlen(results[i].name)==len && !strncmp(results[i].name, p, len))
+					current=&results[i];
+			continue;
+		}
+
+		char name[16];
+		double baseline;
+		if(!current || sscanf(line, " \"%15[^\"]\": {\"ns\": %*u, \"ns_min\": %*u, \"ns_per_MCU\": %lf", name, &baseline)!=2)
+			continue;
+
+		bench_stat_t const * stat=NULL;
+		unsigned s;
+		if(!strcmp(name, "decode"))
+			stat=&current->decode;
+		for(s=0; s<JPEG_NB_STAGES; s++)
+			if(!strcmp(name, stage_names[s]))
+				stat=&current->stages[s];
+		if(!stat)
+			continue;
+
+		double const now=(double)stat->median_ns/current->nb_MCUs;
+		nb_compared++;
+		if(now>baseline*(1+tolerance/100))
+		{
+			printf("regression: %s %s %.1f ns/MCU, was %.1f (+%.1f%%)\n", current->name, name, now, baseline, (now/baseline-1)*100);
+			nb_regressions++;
+		}
+	}
+
+	free(line);
 	fclose(f);
-	
-	printf("%lu bytes read from %s\n\n", picture->filesize, name);
-	
-	picture->pos_in_file=0;
-	
-	picture->nb_components=0;
-	
-	picture->huff_tables[0][0].nb_entries=0;
-	picture->huff_tables[0][1].nb_entries=0;
-	picture->huff_tables[1][0].nb_entries=0;
-	picture->huff_tables[1][1].nb_entries=0;
-}
-
-void parse_picture(picture_t * const picture)
-{
-	while(picture->pos_in_file<=picture->filesize-2)
-	{
-		uint16_t marker;
-		
-		marker=get_marker(picture->data, &(picture->pos_in_file));
-		printf("marker: %d\n",marker);
-		
-		switch(marker)
-		{
-			case 0xFFD8:	printf("SOI found\n"); break;
-			
-			case 0xFFE1:	skip_EXIF(picture); break;
-			
-			case 0xFFE0:	parse_APP0(picture); break;
-			case 0xFFDB:	parse_DQT(picture); break;
-			case 0xFFC0:	parse_SOF0(picture); break;
-			case 0xFFC4:	parse_DHT(picture); break;
-			case 0xFFDA:	parse_SOS(picture);
-							copy_bitmap_data_remove_stuffing(picture);
-							parse_bitmap_data(picture);
-							break;
-			
-			case 0xFFD9:	printf("EOI found\n"); break;
-			
-			default: errx(1, "unknown marker 0x%04x pos %lu", marker, picture->pos_in_file); break;
+
+	printf("%u measurements compared with %s, %u more than %.1f%% slower\n", nb_compared, filename, nb_regressions, tolerance);
+	return nb_regressions;
+}
+
+//0 if all inputs decoded and nothing regressed against the baseline
+int bench_files(file_list_t const * const inputs, const unsigned warmup, const unsigned iterations, const output_format_t format, jpeg_options_t const * const options, char const * const json, char const * const baseline, const double tolerance)
+{
+	jpeg_decoder_t * const dec=jpeg_decoder_create(options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	bench_result_t * const results=calloc(inputs->nb, sizeof(bench_result_t));
+	if(!results)
+		err(1, "calloc");
+
+	printf("using %s kernels, %u threads, %u warmup runs and %u timed runs per input\n\n", jpeg_kernels_name(dec), options->nb_threads, warmup, iterations);
+
+	size_t i, nb=0;
+	bool ok=true;
+	for(i=0; i<inputs->nb; i++)
+	{
+		char const * const name=inputs->names[i];
+		size_t size;
+		uint8_t * const data=is_synthetic(name) ? synthesize(name, &size) : read_file(name, &size);
+		bool const decoded=bench_image(dec, data, size, warmup, iterations, output_pixel_format(format), &results[nb]);
+		free(data);
+
+		if(!decoded)
+		{
+			printf("%s: %s\n\n", name, jpeg_error_message(dec));
+			ok=false;
+			continue;
 		}
+
+		results[nb].name=name;
+		print_bench_result(&results[nb]);
 		printf("\n");
+		nb++;
 	}
+
+	if(json && !write_bench_json(json, results, nb, jpeg_kernels_name(dec), warmup, iterations, options))
+		ok=false;
+	if(baseline && compare_bench_baseline(baseline, results, nb, tolerance))
+		ok=false;
+
+	free(results);
+	jpeg_decoder_destroy(dec);
+	return ok ? 0 : 1;
 }
 
-uint8_t clamp(const double v)
+//the spans of the decode and of writing the image, and the counters of the entropy decoder
+void write_trace(jpeg_decoder_t const * const dec, char const * const filename)
 {
-	if(v<0)
-		return 0;
-	if(v>255)
-		return 255;
-	
-	return (uint8_t)v;
+	static char const * const span_names[JPEG_NB_SPANS]={"headers", "entropy", "reconstruct", "output"};
+	jpeg_stats_t stats;
+
+	jpeg_status_t const status=jpeg_write_trace(dec, filename);
+	if(status==JPEG_ERROR_UNSUPPORTED)
+		errx(1, "-trace: the decoder was built without -DJPEG_INSTRUMENT");
+	if(status!=JPEG_OK || jpeg_get_stats(dec, &stats)!=JPEG_OK)
+		errx(1, "-trace: writing %s failed", filename);
+
+	printf("\ntrace written to %s (%u spans", filename, stats.nb_events);
+	if(stats.nb_events_dropped)
+		printf(", %u more dropped", stats.nb_events_dropped);
+	printf(")\n");
+	printf("%llu MCUs, %llu blocks of which %llu DC only, %llu Huffman symbols\n", (unsigned long long)stats.nb_MCUs, (unsigned long long)stats.nb_blocks, (unsigned long long)stats.nb_dc_only_blocks, (unsigned long long)stats.nb_symbols);
+	printf("%llu entropy-coded bytes, %llu stuffed bytes, %llu padding bits\n", (unsigned long long)stats.nb_entropy_bytes, (unsigned long long)stats.nb_stuffed_bytes, (unsigned long long)stats.nb_padding_bits);
+
+	unsigned s;
+	for(s=0; s<JPEG_NB_SPANS; s++)
+		printf("%-12s %10.3f Mcycles\n", span_names[s], stats.cycles[s]/1e6);
 }
 
-void write_ppm(picture_t const * const pic, char const * const filename)
+void usage(char const * const name)
 {
-	uint_fast16_t x,y;
-	
-	double Y,Cb,Cr;
-	double r,g,b;
-	
-	FILE *out=fopen(filename, "w");
-	
-	printf("writing file %s\n", filename);
-	
-	fprintf(out, "P3\n%lu %lu\n255\n", pic->size_X, pic->size_Y);
-		
-	for(y=0; y<pic->size_Y; y++)
-	{
-		for(x=0; x<pic->size_X; x++)
-		{
-			Y=pic->pixels_YCbCr[x][y].Y;
-			Cb=pic->pixels_YCbCr[x][y].Cb;
-			Cr=pic->pixels_YCbCr[x][y].Cr;
-			
-			r=Y+1.402*(Cr-128);
-			g=Y-(0.114*1.772*(Cb-128)+0.299*1.402*(Cr-128))/0.587;
-			b=Y+1.772*(Cb-128);
-			
-			fprintf(out, "%u %u %u ", clamp(round(r)),clamp(round(g)),clamp(round(b)));
-		}
-		fprintf(out, "\n");
-	}
-	fclose(out);
-	printf("output file written\n\n");
+	printf("Usage: %s [-idct float|islow|ifast] [-upsample nearest|fancy] [-format p6|p3|rgb|bgr|rgba] [-input mmap|memory|stream] [-scale 1|1/2|1/4|1/8] [-crop WxH+X+Y] [-threads N] [-previews prefix] <filename.jpg>\n", name);
+	printf("       %s [-verbose on|off] [-trace trace.json] ... <filename.jpg>\n", name);
+	printf("       %s -transform none|flip_h|flip_v|transpose|transverse|rot90|rot180|rot270 [-crop WxH+X+Y] [-input mmap|memory] <filename.jpg>\n", name);
+	printf("       %s -probe headers|scan [-input mmap|memory] <filename.jpg>\n", name);
+	printf("       %s -bench N [-warmup N] [-json results.json] [-baseline old.json] [-tolerance percent] [-synthetic WxH[:444|422|420|gray]] [-idct ...] [-upsample ...] [-format ...] [-scale ...] [-threads N] [file.jpg|directory ...]\n", name);
+	printf("       %s -batch N [-list manifest.txt] [-outdir dir] [-idct ...] [-upsample ...] [-format ...] [-scale ...] [-crop ...] [-transform ...] [-probe ...] [-threads N] [file.jpg|directory ...]\n", name);
+	exit(1);
 }
 
-
 int main(int argc, char *argv[])
 {
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	options.nb_threads=sysconf(_SC_NPROCESSORS_ONLN);
+	if(options.nb_threads<1)
+		options.nb_threads=1;
+
+	output_format_t format=OUTPUT_P6;
+	enum {INPUT_MMAP, INPUT_MEMORY, INPUT_STREAM} input=INPUT_MMAP;
+	unsigned nb_batch_workers=0; //0: decode a single file
+	bool threads_given=false;
+	task_t task=TASK_DECODE;
+	jpeg_transform_t transform=JPEG_TRANSFORM_NONE;
+	char const * outdir=NULL;
+	char const * previews=NULL;
+	file_list_t inputs={NULL, 0, 0};
+	unsigned bench_iterations=0; //0: no benchmark
+	unsigned bench_warmup=1;
+	char const * bench_json=NULL;
+	char const * bench_baseline=NULL;
+	double bench_tolerance=10;
+	char const * trace=NULL;
+
+	int argi;
+	for(argi=1; argi+1<argc && argv[argi][0]=='-'; argi+=2)
+	{
+		if(!strcmp(argv[argi], "-idct"))
+		{
+			if(!strcmp(argv[argi+1], "float"))
+				options.idct_method=IDCT_FLOAT;
+			else if(!strcmp(argv[argi+1], "islow"))
+				options.idct_method=IDCT_ISLOW;
+			else if(!strcmp(argv[argi+1], "ifast"))
+				options.idct_method=IDCT_IFAST;
+			else
+				errx(1, "unknown IDCT method %s (float, islow or ifast)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-upsample"))
+		{
+			if(!strcmp(argv[argi+1], "nearest"))
+				options.upsampling=UPSAMPLE_NEAREST;
+			else if(!strcmp(argv[argi+1], "fancy"))
+				options.upsampling=UPSAMPLE_FANCY;
+			else
+				errx(1, "unknown upsampling %s (nearest or fancy)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-format"))
+		{
+			if(!strcmp(argv[argi+1], "p6"))
+				format=OUTPUT_P6;
+			else if(!strcmp(argv[argi+1], "p3"))
+				format=OUTPUT_P3;
+			else if(!strcmp(argv[argi+1], "rgb"))
+				format=OUTPUT_RGB;
+			else if(!strcmp(argv[argi+1], "bgr"))
+				format=OUTPUT_BGR;
+			else if(!strcmp(argv[argi+1], "rgba"))
+				format=OUTPUT_RGBA;
+			else
+				errx(1, "unknown output format %s (p6, p3, rgb, bgr or rgba)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-input"))
+		{
+			if(!strcmp(argv[argi+1], "mmap"))
+				input=INPUT_MMAP;
+			else if(!strcmp(argv[argi+1], "memory"))
+				input=INPUT_MEMORY;
+			else if(!strcmp(argv[argi+1], "stream"))
+				input=INPUT_STREAM;
+			else
+				errx(1, "unknown input mode %s (mmap, memory or stream)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-threads"))
+		{
+			long const nb_threads=atol(argv[argi+1]);
+			if(nb_threads<1 || nb_threads>256)
+				errx(1, "-threads: 1 to 256 threads");
+			options.nb_threads=nb_threads;
+			threads_given=true;
+		}
+		else if(!strcmp(argv[argi], "-scale"))
+		{
+			if(!strcmp(argv[argi+1], "1"))
+				options.scale_denom=1;
+			else if(!strcmp(argv[argi+1], "1/2"))
+				options.scale_denom=2;
+			else if(!strcmp(argv[argi+1], "1/4"))
+				options.scale_denom=4;
+			else if(!strcmp(argv[argi+1], "1/8"))
+				options.scale_denom=8;
+			else
+				errx(1, "unknown scale %s (1, 1/2, 1/4 or 1/8)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-crop"))
+		{
+			unsigned w, h, x, y;
+			char end;
+			if(sscanf(argv[argi+1], "%ux%u+%u+%u%c", &w, &h, &x, &y, &end)!=4 || !w || !h)
+				errx(1, "-crop: WxH+X+Y expected, not %s", argv[argi+1]);
+			options.crop_width=w;
+			options.crop_height=h;
+			options.crop_x=x;
+			options.crop_y=y;
+		}
+		else if(!strcmp(argv[argi], "-transform"))
+		{
+			unsigned t;
+			for(t=0; t<sizeof(transform_names)/sizeof(transform_names[0]); t++)
+				if(!strcmp(argv[argi+1], transform_names[t]))
+					break;
+			if(t==sizeof(transform_names)/sizeof(transform_names[0]))
+				errx(1, "unknown transform %s (none, flip_h, flip_v, transpose, transverse, rot90, rot180 or rot270)", argv[argi+1]);
+			task=TASK_TRANSFORM;
+			transform=t;
+		}
+		else if(!strcmp(argv[argi], "-probe"))
+		{
+			if(!strcmp(argv[argi+1], "headers"))
+				task=TASK_PROBE;
+			else if(!strcmp(argv[argi+1], "scan"))
+				task=TASK_PROBE_SCAN;
+			else
+				errx(1, "unknown probe %s (headers or scan)", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-batch"))
+		{
+			long const nb_workers=atol(argv[argi+1]);
+			if(nb_workers<1 || nb_workers>256)
+				errx(1, "-batch: 1 to 256 workers");
+			nb_batch_workers=nb_workers;
+		}
+		else if(!strcmp(argv[argi], "-list"))
+			file_list_add_manifest(&inputs, argv[argi+1]);
+		else if(!strcmp(argv[argi], "-outdir"))
+			outdir=argv[argi+1];
+		else if(!strcmp(argv[argi], "-verbose"))
+		{
+			if(!strcmp(argv[argi+1], "on"))
+				options.verbose=true;
+			else if(!strcmp(argv[argi+1], "off"))
+				options.verbose=false;
+			else
+				errx(1, "-verbose: on or off, not %s", argv[argi+1]);
+		}
+		else if(!strcmp(argv[argi], "-trace"))
+			trace=argv[argi+1];
+		else if(!strcmp(argv[argi], "-previews"))
+			previews=argv[argi+1];
+		else if(!strcmp(argv[argi], "-bench"))
+		{
+			long const iterations=atol(argv[argi+1]);
+			if(iterations<1 || iterations>BENCH_MAX_ITERATIONS)
+				errx(1, "-bench: 1 to %u iterations", BENCH_MAX_ITERATIONS);
+			bench_iterations=iterations;
+		}
+		else if(!strcmp(argv[argi], "-warmup"))
+		{
+			long const warmup=atol(argv[argi+1]);
+			if(warmup<0 || warmup>BENCH_MAX_ITERATIONS)
+				errx(1, "-warmup: 0 to %u runs", BENCH_MAX_ITERATIONS);
+			bench_warmup=warmup;
+		}
+		else if(!strcmp(argv[argi], "-json"))
+			bench_json=argv[argi+1];
+		else if(!strcmp(argv[argi], "-baseline"))
+			bench_baseline=argv[argi+1];
+		else if(!strcmp(argv[argi], "-tolerance"))
+		{
+			bench_tolerance=atof(argv[argi+1]);
+			if(bench_tolerance<0)
+				errx(1, "-tolerance: a percentage, 0 or more");
+		}
+		else if(!strcmp(argv[argi], "-synthetic"))
+		{
+			//all four samplings unless one is given
+			char const * const samplings[]={"444", "422", "420", "gray"};
+			char name[64];
+			unsigned w, h, i;
+			if(sscanf(argv[argi+1], "%ux%u", &w, &h)!=2)
+				errx(1, "-synthetic: WxH[:sampling] expected, not %s", argv[argi+1]);
+			for(i=0; i<4; i++)
+			{
+				if(strchr(argv[argi+1], ':'))
+					snprintf(name, sizeof(name), "synthetic:%s", argv[argi+1]);
+				else
+					snprintf(name, sizeof(name), "synthetic:%ux%u:%s", w, h, samplings[i]);
+				file_list_add(&inputs, name);
+				if(strchr(argv[argi+1], ':'))
+					break;
+			}
+		}
+		else
+			usage(argv[0]);
+	}
+
+	char const * const force=getenv("JPEG_SIMD");
+	if(force && strcmp(force, "scalar") && strcmp(force, "sse2") && strcmp(force, "avx2"))
+		errx(1, "JPEG_SIMD: unknown value %s (scalar, sse2 or avx2)", force);
+
+	if(task==TASK_TRANSFORM && options.scale_denom!=1)
+		errx(1, "-transform works on the full-size coefficients, -scale cannot be used with it");
+
+	if(previews && (nb_batch_workers || task!=TASK_DECODE || input==INPUT_STREAM))
+		errx(1, "-previews is for decoding a single file from mmap or memory input");
+
+	if(trace && (nb_batch_workers || bench_iterations || task!=TASK_DECODE || input==INPUT_STREAM))
+		errx(1, "-trace is for decoding a single file from mmap or memory input");
+
+	if(bench_iterations)
+	{
+		if(nb_batch_workers || task!=TASK_DECODE || previews || input!=INPUT_MMAP || options.crop_width)
+			errx(1, "-bench decodes whole pictures, without -batch, -transform, -probe, -previews, -input or -crop");
+		if(format==OUTPUT_P3)
+			format=OUTPUT_P6;
+
+		//stage timings are for one thread, unless asked otherwise
+		if(!threads_given)
+			options.nb_threads=1;
+
+		//without inputs: the example images and synthetic pictures of every sampling
+		if(argi==argc && !inputs.nb)
+		{
+			file_list_add(&inputs, "../Example_images/test1.jpg");
+			file_list_add(&inputs, "../Example_images/test2.jpg");
+			file_list_add(&inputs, "../Example_images/test3.jpg");
+			file_list_add(&inputs, "synthetic:" BENCH_DEFAULT_SYNTHETIC ":444");
+			file_list_add(&inputs, "synthetic:" BENCH_DEFAULT_SYNTHETIC ":422");
+			file_list_add(&inputs, "synthetic:" BENCH_DEFAULT_SYNTHETIC ":420");
+			file_list_add(&inputs, "synthetic:" BENCH_DEFAULT_SYNTHETIC ":gray");
+		}
+		for(; argi<argc; argi++)
+			file_list_add_path(&inputs, argv[argi]);
 
-	if (argc != 2) {
-        printf("Usage: %s <filename.jpg>\n", argv[0]);
-        return 1;
-    }
-
-	clock_t start_time, end_time, write_time;
-    double cpu_time_used_algo, cpu_time_used_write;
-	start_time = clock();
-	picture_t pic;
-	open_new_picture(argv[1], &pic);
-	parse_picture(&pic);
-	end_time = clock();
-	write_ppm(&pic, "decodedimage.ppm");
-	write_time = clock();
-    cpu_time_used_algo = ((double) (end_time - start_time)) / CLOCKS_PER_SEC;
-	cpu_time_used_write = ((double) (write_time - end_time)) / CLOCKS_PER_SEC;
-    printf("Time taken by the Jpeg decoder algorithm: %f seconds\n", cpu_time_used_algo);
-	printf("Time taken for writing the image: %f seconds\n", cpu_time_used_write);
-}
\ No newline at end of file
+		int const status=bench_files(&inputs, bench_warmup, bench_iterations, format, &options, bench_json, bench_baseline, bench_tolerance);
+		file_list_free(&inputs);
+		return status;
+	}
+
+	if(nb_batch_workers)
+	{
+		if(input!=INPUT_MMAP)
+			errx(1, "-batch decodes mapped files only");
+
+		//the workers already keep the cores busy
+		if(!threads_given)
+			options.nb_threads=1;
+
+		for(; argi<argc; argi++)
+			file_list_add_path(&inputs, argv[argi]);
+		if(!inputs.nb)
+			errx(1, "-batch: no input files");
+
+		bool const ok=batch_decode(&inputs, nb_batch_workers, &options, format, outdir, task, transform);
+		file_list_free(&inputs);
+		return ok ? 0 : 1;
+	}
+
+	if(inputs.nb || outdir || argi!=argc-1)
+		usage(argv[0]);
+
+	//wall clock, the decoder may run on several threads
+	struct timespec start_time, end_time, write_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	if(task!=TASK_DECODE && input==INPUT_STREAM)
+		errx(1, "-transform and -probe are not supported with -input stream");
+	if(task==TASK_TRANSFORM)
+		return transform_file(argv[argi], transform, input==INPUT_MEMORY, &options);
+	if(task==TASK_PROBE || task==TASK_PROBE_SCAN)
+		return probe_file(argv[argi], task==TASK_PROBE_SCAN, input==INPUT_MEMORY, &options);
+
+	char out_name[32];
+	snprintf(out_name, sizeof(out_name), "decodedimage.%s", output_extension(format));
+
+	if(input==INPUT_STREAM)
+	{
+		if(options.crop_width)
+			errx(1, "-crop is not supported with -input stream");
+
+		//decoding and writing overlap, only the total is meaningful
+		stream_decode_file(argv[argi], out_name, format, &options);
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+		printf("Time taken by the streaming decoder, writing included: %f seconds\n", elapsed_seconds(&start_time, &end_time));
+		return 0;
+	}
+
+	//written during the decode, which includes their time
+	preview_output_t preview={previews, format};
+	if(previews)
+	{
+		options.preview=write_preview;
+		options.preview_user=&preview;
+	}
+
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+	printf("using %s kernels\n\n", jpeg_kernels_name(dec));
+
+	jpeg_status_t status;
+	uint8_t * file_data=NULL;
+	if(input==INPUT_MEMORY)
+	{
+		size_t file_size;
+		file_data=read_file(argv[argi], &file_size);
+		status=jpeg_decode_memory(dec, file_data, file_size);
+	}
+	else
+		status=jpeg_decode_file(dec, argv[argi]);
+	if(status!=JPEG_OK)
+		errx(1, "%s: %s", argv[argi], jpeg_error_message(dec));
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	printf("arena peak %zu bytes\n\n", jpeg_arena_peak(dec));
+	printf("writing file %s\n", out_name);
+	bool const written=write_image(dec, out_name, format);
+	clock_gettime(CLOCK_MONOTONIC, &write_time);
+	if(written)
+		printf("output file written\n\n");
+    printf("Time taken by the Jpeg decoder algorithm: %f seconds\n", elapsed_seconds(&start_time, &end_time));
+	printf("Time taken for writing the image: %f seconds\n", elapsed_seconds(&end_time, &write_time));
+
+	if(trace)
+		write_trace(dec, trace);
+
+	jpeg_decoder_destroy(dec);
+	free(file_data);
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
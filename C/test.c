@@ -0,0 +1,973 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+
+//IDCT conformance: the integer IDCTs against the double precision IDCT, and the SIMD kernels against the
+//scalar ones, which must give the same samples. Then malformed marker segments, which must be rejected, and the
+//decoding paths on the small pictures of test_images/ (made by make_fixtures.py), and main's -bench, run as the
+//program given as argument (./main by default).
+//Run from this directory, exits with status 1 if a check fails
+static char const * const test_images[]={"../Example_images/test1.jpg", "../Example_images/test2.jpg", "../Example_images/test3.jpg"};
+
+static char const * const kernel_sets[]={"scalar", "sse2", "avx2"};
+
+typedef struct
+{
+	idct_method_t method;
+	char const * name;
+	unsigned max_error; //largest difference of an RGB sample to the float IDCT's
+	double mean_error; //largest mean difference over a picture
+} idct_bound_t;
+
+static const idct_bound_t idct_bounds[]={{IDCT_ISLOW, "islow", 3, 0.05}, {IDCT_IFAST, "ifast", 4, 0.1}};
+
+//the whole picture as RGB, NULL with a message if it does not decode
+static uint8_t * decode_rgb(char const * const filename, const idct_method_t method, uint32_t * const size_X, uint32_t * const size_Y, char const ** const kernels)
+{
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	options.idct_method=method;
+
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+	*kernels=jpeg_kernels_name(dec);
+
+	uint8_t * rgb=NULL;
+	if(jpeg_decode_file(dec, filename)==JPEG_OK)
+	{
+		jpeg_get_size(dec, size_X, size_Y);
+		rgb=malloc((size_t)*size_X**size_Y*3);
+		if(!rgb)
+			err(1, "malloc");
+		if(jpeg_read_rows(dec, 0, *size_Y, JPEG_PIXEL_RGB, rgb, (size_t)*size_X*3)!=JPEG_OK)
+		{
+			free(rgb);
+			rgb=NULL;
+		}
+	}
+	if(!rgb)
+		printf("%s: %s\n", filename, jpeg_error_message(dec));
+
+	jpeg_decoder_destroy(dec);
+	return rgb;
+}
+
+//the picture dec has decoded as RGB, NULL if its rows cannot be read
+static uint8_t * read_picture(jpeg_decoder_t * const dec, uint32_t * const size_X, uint32_t * const size_Y)
+{
+	jpeg_get_size(dec, size_X, size_Y);
+	uint8_t * const rgb=malloc((size_t)*size_X**size_Y*3);
+	if(!rgb)
+		err(1, "malloc");
+	if(jpeg_read_rows(dec, 0, *size_Y, JPEG_PIXEL_RGB, rgb, (size_t)*size_X*3)==JPEG_OK)
+		return rgb;
+	free(rgb);
+	return NULL;
+}
+
+//the whole picture as RGB with these options, NULL with a message if it does not decode
+static uint8_t * decode_with(char const * const filename, jpeg_options_t const * const options, uint32_t * const size_X, uint32_t * const size_Y)
+{
+	jpeg_decoder_t * const dec=jpeg_decoder_create(options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	uint8_t * const rgb=jpeg_decode_file(dec, filename)==JPEG_OK ? read_picture(dec, size_X, size_Y) : NULL;
+	if(!rgb)
+		printf("FAIL %s: %s\n", filename, jpeg_error_message(dec));
+
+	jpeg_decoder_destroy(dec);
+	return rgb;
+}
+
+//false if the pictures differ in size or any sample differs by more than max_error
+static bool compare_pictures(char const * const what, uint8_t const * const a, const uint32_t a_X, const uint32_t a_Y, uint8_t const * const b, const uint32_t b_X, const uint32_t b_Y, const unsigned max_error)
+{
+	if(a_X!=b_X || a_Y!=b_Y)
+	{
+		printf("FAIL %s: %u x %u, %u x %u expected\n", what, a_X, a_Y, b_X, b_Y);
+		return false;
+	}
+
+	unsigned error=0;
+	size_t i;
+	for(i=0; i<(size_t)a_X*a_Y*3; i++)
+	{
+		unsigned const e=abs(a[i]-b[i]);
+		if(e>error)
+			error=e;
+	}
+
+	bool const ok=error<=max_error;
+	printf("%-4s %s: max error %u (bound %u)\n", ok ? "ok" : "FAIL", what, error, max_error);
+	return ok;
+}
+
+//a progressive encoding with DC and AC refinement scans and restart intervals, against the baseline encoding of the
+//same picture at the same quality, which has the same quantized coefficients: within the integer IDCT's bounds
+//of each other, with the float IDCT exactly the same
+static bool check_progressive(void)
+{
+	static const idct_bound_t exact={IDCT_FLOAT, "float", 0, 0};
+	bool ok=true;
+	unsigned b;
+
+	for(b=0; b<=sizeof(idct_bounds)/sizeof(idct_bounds[0]); b++)
+	{
+		idct_bound_t const * const bound=b<sizeof(idct_bounds)/sizeof(idct_bounds[0]) ? &idct_bounds[b] : &exact;
+		jpeg_options_t options;
+		jpeg_default_options(&options);
+		options.idct_method=bound->method;
+
+		uint32_t p_X, p_Y, s_X, s_Y;
+		uint8_t * const progressive=decode_with("test_images/progressive.jpg", &options, &p_X, &p_Y);
+		uint8_t * const sequential=decode_with("test_images/420.jpg", &options, &s_X, &s_Y);
+		if(progressive && sequential)
+		{
+			char what[64];
+			snprintf(what, sizeof(what), "progressive.jpg %s against 420.jpg", bound->name);
+			ok&=compare_pictures(what, progressive, p_X, p_Y, sequential, s_X, s_Y, bound->max_error);
+		}
+		else
+			ok=false;
+		free(progressive);
+		free(sequential);
+	}
+	return ok;
+}
+
+//the whole file, NULL with a message if it cannot be read
+static uint8_t * read_file(char const * const filename, size_t * const size)
+{
+	FILE * const f=fopen(filename, "rb");
+	if(!f)
+	{
+		printf("FAIL %s: cannot open it\n", filename);
+		return NULL;
+	}
+
+	uint8_t * data=NULL;
+	long const length=fseek(f, 0, SEEK_END) ? -1 : ftell(f);
+	if(length>=0 && !fseek(f, 0, SEEK_SET))
+	{
+		*size=length;
+		data=malloc(*size ? *size : 1);
+		if(!data)
+			err(1, "malloc");
+		if(fread(data, 1, *size, f)!=*size)
+		{
+			free(data);
+			data=NULL;
+		}
+	}
+	if(!data)
+		printf("FAIL %s: cannot read it\n", filename);
+
+	fclose(f);
+	return data;
+}
+
+//a binary PPM as written by make_fixtures.py, NULL with a message if it cannot be read
+static uint8_t * read_ppm(char const * const filename, uint32_t * const size_X, uint32_t * const size_Y)
+{
+	FILE * const f=fopen(filename, "rb");
+	if(!f)
+	{
+		printf("FAIL %s: cannot open it\n", filename);
+		return NULL;
+	}
+
+	unsigned max;
+	uint8_t * rgb=NULL;
+	if(fscanf(f, "P6 %u %u %u", size_X, size_Y, &max)==3 && max==255 && fgetc(f)!=EOF)
+	{
+		size_t const size=(size_t)*size_X**size_Y*3;
+		rgb=malloc(size);
+		if(!rgb)
+			err(1, "malloc");
+		if(fread(rgb, 1, size, f)!=size)
+		{
+			free(rgb);
+			rgb=NULL;
+		}
+	}
+	if(!rgb)
+		printf("FAIL %s: not a PPM of 8 bit samples\n", filename);
+
+	fclose(f);
+	return rgb;
+}
+
+typedef struct
+{
+	char const * name; //in test_images/, with a .ppm of libjpeg's decode next to it
+	uint8_t nb_components;
+	jpeg_color_space_t color_space;
+} color_fixture_t;
+
+//sampling factors without MCU loops of their own, grayscale, RGB without transform, Adobe CMYK and YCCK, and a CMYK picture using all four Huffman and quantization
+//table slots, 16 bit quantization tables and tables redefined between its scans
+static const color_fixture_t color_fixtures[]=
+{
+	{"440", 3, JPEG_COLOR_YCBCR},
+	{"3x1", 3, JPEG_COLOR_YCBCR},
+	{"gray", 1, JPEG_COLOR_GRAY},
+	{"rgb", 3, JPEG_COLOR_RGB},
+	{"cmyk", 4, JPEG_COLOR_CMYK},
+	{"ycck", 4, JPEG_COLOR_YCCK},
+	{"tables", 4, JPEG_COLOR_CMYK},
+};
+
+//the components the probe sees, and the RGB samples against libjpeg's (CMYK converted as the decoder does),
+//which can differ by the rounding of their IDCTs and color conversions
+static bool check_color_fixture(color_fixture_t const * const fixture)
+{
+	char jpg[64], ppm[64];
+	snprintf(jpg, sizeof(jpg), "test_images/%s.jpg", fixture->name);
+	snprintf(ppm, sizeof(ppm), "test_images/%s.ppm", fixture->name);
+
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+	jpeg_info_t info;
+	jpeg_status_t const status=jpeg_probe_file(dec, jpg, true, &info);
+	bool ok=status==JPEG_OK && info.nb_components==fixture->nb_components && info.color_space==fixture->color_space;
+	printf("%-4s %s: probe %d, %u components, color space %d (%u and %d expected)\n", ok ? "ok" : "FAIL", jpg, status, info.nb_components, info.color_space, fixture->nb_components, fixture->color_space);
+	jpeg_decoder_destroy(dec);
+
+	uint32_t size_X, size_Y, ref_X, ref_Y;
+	uint8_t * const rgb=decode_with(jpg, &options, &size_X, &size_Y);
+	uint8_t * const reference=read_ppm(ppm, &ref_X, &ref_Y);
+	if(rgb && reference)
+	{
+		char what[96];
+		snprintf(what, sizeof(what), "%s against libjpeg", jpg);
+		ok&=compare_pictures(what, rgb, size_X, size_Y, reference, ref_X, ref_Y, 1);
+	}
+	else
+		ok=false;
+	free(rgb);
+	free(reference);
+	return ok;
+}
+
+typedef struct
+{
+	unsigned scale_denom;
+	uint32_t x, y, width, height;
+} crop_t;
+
+//in restart.jpg, 61 x 45 in 4:2:0, MCUs are 16 x 16 (8 x 8 at 1/2 scale) and a restart interval is 3 MCUs, so
+//intervals begin at x 0, 48, 32, 16 of successive MCU rows: odd offsets, single rows and columns, rectangles within
+//one MCU, across MCU edges, across restart intervals and up to the right and bottom edges
+static const crop_t crops[]=
+{
+	{1, 1, 1, 5, 3},
+	{1, 15, 15, 2, 2},
+	{1, 13, 7, 20, 30},
+	{1, 47, 31, 14, 14},
+	{1, 40, 10, 16, 12},
+	{1, 31, 15, 3, 30},
+	{1, 33, 0, 1, 45},
+	{1, 0, 44, 61, 1},
+	{1, 0, 0, 61, 45},
+	{2, 1, 1, 5, 3},
+	{2, 7, 7, 2, 2},
+	{2, 23, 5, 8, 11},
+	{2, 3, 11, 28, 12},
+};
+
+//each rectangle has to be the same, byte for byte, as when cut from the whole picture decoded with the same options
+static bool check_crops(char const * const filename)
+{
+	bool ok=true;
+	unsigned u, c;
+
+	for(u=UPSAMPLE_NEAREST; u<=UPSAMPLE_FANCY; u++)
+		for(c=0; c<sizeof(crops)/sizeof(crops[0]); c++)
+		{
+			crop_t const * const crop=&crops[c];
+			jpeg_options_t options;
+			jpeg_default_options(&options);
+			options.upsampling=u;
+			options.scale_denom=crop->scale_denom;
+
+			uint32_t size_X, size_Y, crop_X, crop_Y;
+			uint8_t * const whole=decode_with(filename, &options, &size_X, &size_Y);
+			options.crop_x=crop->x;
+			options.crop_y=crop->y;
+			options.crop_width=crop->width;
+			options.crop_height=crop->height;
+			uint8_t * const cropped=decode_with(filename, &options, &crop_X, &crop_Y);
+
+			bool same=whole && cropped && crop_X==crop->width && crop_Y==crop->height;
+			uint32_t y;
+			for(y=0; same && y<crop->height; y++)
+				same=!memcmp(cropped+(size_t)y*crop->width*3, whole+((size_t)(crop->y+y)*size_X+crop->x)*3, (size_t)crop->width*3);
+
+			printf("%-4s %s 1/%u %s: crop %ux%u+%u+%u\n", same ? "ok" : "FAIL", filename, crop->scale_denom, u==UPSAMPLE_FANCY ? "fancy" : "nearest", crop->width, crop->height, crop->x, crop->y);
+			ok&=same;
+			free(whole);
+			free(cropped);
+		}
+	return ok;
+}
+
+typedef struct
+{
+	jpeg_transform_t transform;
+	char const * name;
+	bool mirror_x, mirror_y, transpose; //of the source picture, mirrored before transposing
+} transform_case_t;
+
+static const transform_case_t transform_cases[]=
+{
+	{JPEG_TRANSFORM_NONE, "none", false, false, false},
+	{JPEG_TRANSFORM_FLIP_H, "flip_h", true, false, false},
+	{JPEG_TRANSFORM_FLIP_V, "flip_v", false, true, false},
+	{JPEG_TRANSFORM_TRANSPOSE, "transpose", false, false, true},
+	{JPEG_TRANSFORM_TRANSVERSE, "transverse", true, true, true},
+	{JPEG_TRANSFORM_ROT_90, "rot90", false, true, true},
+	{JPEG_TRANSFORM_ROT_180, "rot180", true, true, false},
+	{JPEG_TRANSFORM_ROT_270, "rot270", true, false, true},
+};
+
+//the float IDCT and nearest upsampling, with which moving and sign-flipping the coefficients of a block moves its
+//samples the same way, up to the rounding of the IDCT
+static void exact_options(jpeg_options_t * const options)
+{
+	jpeg_default_options(options);
+	options->idct_method=IDCT_FLOAT;
+	options->upsampling=UPSAMPLE_NEAREST;
+}
+
+//transforms the region of data that the crop options select, NULL with a message if it fails. The result belongs to dec
+static uint8_t const * transform_with(jpeg_decoder_t * const dec, uint8_t const * const data, const size_t size, const jpeg_transform_t transform, size_t * const out_size)
+{
+	uint8_t const * out;
+	if(jpeg_transform_memory(dec, data, size, transform, &out, out_size)==JPEG_OK)
+		return out;
+	printf("FAIL transform %u: %s\n", transform, jpeg_error_message(dec));
+	return NULL;
+}
+
+//the decoded output of a transform of the crop x, y, width, height of source (source_X wide) against the source
+//samples moved as the transform says: the crop grows up and left to the MCU grid and along a mirrored axis loses
+//its partial MCU
+static bool check_transform(uint8_t const * const data, const size_t size, uint8_t const * const source, const uint32_t source_X, const unsigned MCU_size, transform_case_t const * const c, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	jpeg_options_t options;
+	exact_options(&options);
+	options.crop_x=x;
+	options.crop_y=y;
+	options.crop_width=width;
+	options.crop_height=height;
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	jpeg_options_t decode_options;
+	exact_options(&decode_options);
+	jpeg_decoder_t * const out_dec=jpeg_decoder_create(&decode_options);
+	if(!dec || !out_dec)
+		err(1, "jpeg_decoder_create");
+
+	width+=x%MCU_size;
+	height+=y%MCU_size;
+	x-=x%MCU_size;
+	y-=y%MCU_size;
+	if(c->mirror_x)
+		width-=width%MCU_size;
+	if(c->mirror_y)
+		height-=height%MCU_size;
+	uint32_t const expected_X=c->transpose ? height : width;
+	uint32_t const expected_Y=c->transpose ? width : height;
+
+	size_t out_size;
+	uint8_t const * const out=transform_with(dec, data, size, c->transform, &out_size);
+	uint32_t size_X=0, size_Y=0;
+	uint8_t * const rgb=out && jpeg_decode_memory(out_dec, out, out_size)==JPEG_OK ? read_picture(out_dec, &size_X, &size_Y) : NULL;
+
+	unsigned error=0;
+	bool ok=rgb && size_X==expected_X && size_Y==expected_Y;
+	uint32_t i, j;
+	for(j=0; ok && j<size_Y; j++)
+		for(i=0; i<size_X; i++)
+		{
+			uint32_t a=c->transpose ? j : i;
+			uint32_t b=c->transpose ? i : j;
+			if(c->mirror_x)
+				a=width-1-a;
+			if(c->mirror_y)
+				b=height-1-b;
+
+			unsigned k;
+			for(k=0; k<3; k++)
+			{
+				unsigned const e=abs(rgb[((size_t)j*size_X+i)*3+k]-source[((size_t)(y+b)*source_X+x+a)*3+k]);
+				if(e>error)
+					error=e;
+			}
+		}
+	ok&=error<=1;
+
+	printf("%-4s transform %s of %ux%u+%u+%u: %u x %u (%u x %u expected), max error %u (bound 1)\n", ok ? "ok" : "FAIL", c->name, options.crop_width, options.crop_height, options.crop_x, options.crop_y, size_X, size_Y, expected_X, expected_Y, error);
+
+	free(rgb);
+	jpeg_decoder_destroy(out_dec);
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+//rot270 of rot90 of 420.jpg has the coefficients of its top 32 rows (rot90 drops the partial MCU row): the same samples
+static bool check_transform_round_trip(uint8_t const * const data, const size_t size, uint8_t const * const source, const uint32_t source_X)
+{
+	jpeg_options_t options;
+	exact_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	jpeg_decoder_t * const dec2=jpeg_decoder_create(&options);
+	if(!dec || !dec2)
+		err(1, "jpeg_decoder_create");
+
+	size_t rotated_size, back_size;
+	uint8_t const * const rotated=transform_with(dec, data, size, JPEG_TRANSFORM_ROT_90, &rotated_size);
+	uint8_t const * const back=rotated ? transform_with(dec2, rotated, rotated_size, JPEG_TRANSFORM_ROT_270, &back_size) : NULL;
+	uint32_t size_X=0, size_Y=0;
+	uint8_t * const rgb=back && jpeg_decode_memory(dec, back, back_size)==JPEG_OK ? read_picture(dec, &size_X, &size_Y) : NULL;
+
+	bool const ok=rgb && size_X==source_X && !memcmp(rgb, source, (size_t)size_X*size_Y*3);
+	printf("%-4s transform rot90 then rot270: %u x %u, %s\n", ok ? "ok" : "FAIL", size_X, size_Y, ok ? "the same samples" : "not the source");
+
+	free(rgb);
+	jpeg_decoder_destroy(dec2);
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+//a crop smaller than one MCU along a mirrored axis leaves nothing to transform, along the other axis it is fine
+static bool check_transform_too_small(uint8_t const * const data, const size_t size, const jpeg_transform_t transform, char const * const name, uint32_t x, uint32_t y, uint32_t width, uint32_t height, const jpeg_status_t expected)
+{
+	jpeg_options_t options;
+	exact_options(&options);
+	options.crop_x=x;
+	options.crop_y=y;
+	options.crop_width=width;
+	options.crop_height=height;
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	uint8_t const * out;
+	size_t out_size;
+	jpeg_status_t const status=jpeg_transform_memory(dec, data, size, transform, &out, &out_size);
+	bool const ok=status==expected;
+	printf("%-4s transform %s of %ux%u+%u+%u: %d (%d expected)%s%s\n", ok ? "ok" : "FAIL", name, width, height, x, y, status, expected, status ? ", " : "", status ? jpeg_error_message(dec) : "");
+
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+//every transform of 420.jpg (16 x 16 MCUs, 61 x 45) and of a crop of it, then the errors
+static bool check_transforms(void)
+{
+	char const * const filename="test_images/420.jpg";
+	size_t size;
+	uint8_t * const data=read_file(filename, &size);
+	jpeg_options_t options;
+	exact_options(&options);
+	uint32_t source_X, source_Y;
+	uint8_t * const source=decode_with(filename, &options, &source_X, &source_Y);
+	bool ok=data && source;
+	unsigned c;
+
+	for(c=0; ok && c<sizeof(transform_cases)/sizeof(transform_cases[0]); c++)
+	{
+		ok&=check_transform(data, size, source, source_X, 16, &transform_cases[c], 0, 0, source_X, source_Y);
+		ok&=check_transform(data, size, source, source_X, 16, &transform_cases[c], 21, 19, 30, 24);
+	}
+
+	if(data && source)
+	{
+		ok&=check_transform_round_trip(data, size, source, source_X);
+		ok&=check_transform_too_small(data, size, JPEG_TRANSFORM_FLIP_H, "flip_h", 50, 0, 11, 45, JPEG_ERROR_ARGUMENT);
+		ok&=check_transform_too_small(data, size, JPEG_TRANSFORM_FLIP_V, "flip_v", 50, 0, 11, 45, JPEG_OK);
+		ok&=check_transform_too_small(data, size, JPEG_TRANSFORM_ROT_90, "rot90", 0, 40, 61, 5, JPEG_ERROR_ARGUMENT);
+		ok&=check_transform_too_small(data, size, JPEG_TRANSFORM_TRANSPOSE, "transpose", 0, 40, 61, 5, JPEG_OK);
+	}
+
+	free(source);
+	free(data);
+	return ok;
+}
+
+static const size_t stream_chunks[]={1, 7, 333, SIZE_MAX};
+
+//the data fed to the streaming decoder chunk bytes at a time (SIZE_MAX for all at once), reading the available rows after each chunk, against
+//jpeg_decode_memory's rows. expected is the status of the first call that fails, JPEG_OK for none
+static bool check_stream(char const * const filename, const size_t chunk, const jpeg_status_t expected)
+{
+	size_t size;
+	uint8_t * const data=read_file(filename, &size);
+	if(!data)
+		return false;
+
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_stream_t * const s=jpeg_stream_create(&options);
+	if(!s)
+		err(1, "jpeg_stream_create");
+
+	uint8_t * rgb=NULL;
+	uint32_t size_X=0, size_Y=0, row=0;
+	jpeg_status_t status=JPEG_OK;
+	size_t offset=0;
+	while(status==JPEG_OK && offset<size)
+	{
+		size_t const n=size-offset<chunk ? size-offset : chunk;
+		status=jpeg_stream_feed(s, data+offset, n);
+		offset+=n;
+		if(offset==size && status==JPEG_OK)
+			status=jpeg_stream_finish(s);
+
+		if(!rgb && status==JPEG_OK && jpeg_stream_get_size(s, &size_X, &size_Y))
+		{
+			rgb=malloc((size_t)size_X*size_Y*3);
+			if(!rgb)
+				err(1, "malloc");
+		}
+		uint32_t nb_rows;
+		if(rgb && status==JPEG_OK)
+			status=jpeg_stream_read_rows(s, size_Y-row, JPEG_PIXEL_RGB, rgb+(size_t)row*size_X*3, (size_t)size_X*3, &nb_rows);
+		if(rgb && status==JPEG_OK)
+			row+=nb_rows;
+	}
+
+	bool ok=status==expected;
+	if(ok && expected==JPEG_OK)
+	{
+		uint32_t ref_X, ref_Y;
+		uint8_t * const reference=decode_with(filename, &options, &ref_X, &ref_Y);
+		ok=jpeg_stream_done(s) && row==size_Y && reference && ref_X==size_X && ref_Y==size_Y && !memcmp(rgb, reference, (size_t)size_X*size_Y*3);
+		free(reference);
+	}
+
+	printf("%-4s stream %s in chunks of %zu bytes: status %d (%d expected), %u of %u rows%s%s\n", ok ? "ok" : "FAIL", filename, chunk<size ? chunk : size, status, expected, row, size_Y, status ? ", " : "", status ? jpeg_stream_error_message(s) : "");
+
+	jpeg_stream_destroy(s);
+	free(rgb);
+	free(data);
+	return ok;
+}
+
+//at 1/2, 1/4 and 1/8 the picture is the size divided and rounded up. At 1/8 each sample is the DC value of its
+//block, the mean of the block's samples at full size, which can differ by the rounding of the IDCT and, with
+//color, of the color conversion: compared on the blocks that lie entirely within the picture, for pictures without
+//subsampled chroma (with it, the chroma of a sample is the mean over a larger block)
+static bool check_scaled(char const * const filename, const bool subsampled, const unsigned max_error)
+{
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	options.idct_method=IDCT_FLOAT;
+	uint32_t size_X, size_Y;
+	uint8_t * const full=decode_with(filename, &options, &size_X, &size_Y);
+	bool ok=full!=NULL;
+	unsigned denom;
+
+	for(denom=2; full && denom<=8; denom*=2)
+	{
+		options.scale_denom=denom;
+		uint32_t scaled_X, scaled_Y;
+		uint8_t * const scaled=decode_with(filename, &options, &scaled_X, &scaled_Y);
+		uint32_t const expected_X=(size_X+denom-1)/denom, expected_Y=(size_Y+denom-1)/denom;
+		bool const size_ok=scaled && scaled_X==expected_X && scaled_Y==expected_Y;
+		printf("%-4s %s 1/%u: %u x %u (%u x %u expected)\n", size_ok ? "ok" : "FAIL", filename, denom, scaled_X, scaled_Y, expected_X, expected_Y);
+		ok&=size_ok;
+
+		if(size_ok && denom==8 && !subsampled)
+		{
+			unsigned error=0;
+			uint32_t bx, by, x, y, k;
+			for(by=0; by<size_Y/8; by++)
+				for(bx=0; bx<size_X/8; bx++)
+					for(k=0; k<3; k++)
+					{
+						unsigned sum=0;
+						for(y=0; y<8; y++)
+							for(x=0; x<8; x++)
+								sum+=full[((size_t)(by*8+y)*size_X+bx*8+x)*3+k];
+						unsigned const e=abs((int)((sum+32)/64)-scaled[((size_t)by*scaled_X+bx)*3+k]);
+						if(e>error)
+							error=e;
+					}
+			bool const dc_ok=error<=max_error;
+			printf("%-4s %s 1/8 against the mean of each block: max error %u (bound %u)\n", dc_ok ? "ok" : "FAIL", filename, error, max_error);
+			ok&=dc_ok;
+		}
+		free(scaled);
+	}
+
+	free(full);
+	return ok;
+}
+
+//the four layouts with MCU loops of their own, and two without
+static char const * const layout_fixtures[]={"test_images/gray.jpg", "test_images/444.jpg", "test_images/422.jpg", "test_images/420.jpg", "test_images/440.jpg", "test_images/3x1.jpg"};
+
+//the specialized MCU loops against the generic ones (JPEG_MCU_LAYOUT=generic), which must give the same samples
+//at full and half scale and with both upsamplings
+static bool check_MCU_layout(char const * const filename)
+{
+	bool ok=true;
+	unsigned scale, u;
+
+	for(scale=1; scale<=2; scale++)
+		for(u=UPSAMPLE_NEAREST; u<=UPSAMPLE_FANCY; u++)
+		{
+			jpeg_options_t options;
+			jpeg_default_options(&options);
+			options.scale_denom=scale;
+			options.upsampling=u;
+
+			uint32_t size_X, size_Y, generic_X, generic_Y;
+			uint8_t * const specialized=decode_with(filename, &options, &size_X, &size_Y);
+			setenv("JPEG_MCU_LAYOUT", "generic", 1);
+			uint8_t * const generic=decode_with(filename, &options, &generic_X, &generic_Y);
+			unsetenv("JPEG_MCU_LAYOUT");
+
+			bool const same=specialized && generic && size_X==generic_X && size_Y==generic_Y && !memcmp(specialized, generic, (size_t)size_X*size_Y*3);
+			printf("%-4s %s 1/%u %s: %s\n", same ? "ok" : "FAIL", filename, scale, u==UPSAMPLE_FANCY ? "fancy" : "nearest", same ? "generic MCU loops give the same samples" : "generic MCU loops differ");
+			ok&=same;
+			free(specialized);
+			free(generic);
+		}
+	return ok;
+}
+
+typedef struct
+{
+	char const * name; //in test_images/
+	bool progressive;
+	uint8_t nb_components;
+	jpeg_color_space_t color_space;
+	uint8_t sampling[4]; //H and V of each component as 0xHV
+	uint8_t quant_table[4];
+	uint16_t restart_interval;
+	uint8_t quant_tables_defined;
+	uint32_t nb_scans;
+	uint32_t nb_restart_markers;
+} probe_fixture_t;
+
+//all 61 x 45. In restart.jpg the 12 MCUs in intervals of 3 have 3 restart markers. progressive.jpg has libjpeg's 10
+//scans with a restart interval of one MCU row: 2 markers in its 4 x 3 MCU DC scans and chroma scans, 5 in the 8 x 6
+//block luma scans, 32 in all
+static const probe_fixture_t probe_fixtures[]=
+{
+	{"gray", false, 1, JPEG_COLOR_GRAY, {0x11}, {0}, 0, 0x1, 1, 0},
+	{"444", false, 3, JPEG_COLOR_YCBCR, {0x11, 0x11, 0x11}, {0, 1, 1}, 0, 0x3, 1, 0},
+	{"422", false, 3, JPEG_COLOR_YCBCR, {0x21, 0x11, 0x11}, {0, 1, 1}, 0, 0x3, 1, 0},
+	{"420", false, 3, JPEG_COLOR_YCBCR, {0x22, 0x11, 0x11}, {0, 1, 1}, 0, 0x3, 1, 0},
+	{"440", false, 3, JPEG_COLOR_YCBCR, {0x12, 0x11, 0x11}, {0, 1, 1}, 0, 0x3, 1, 0},
+	{"3x1", false, 3, JPEG_COLOR_YCBCR, {0x31, 0x11, 0x11}, {0, 1, 1}, 0, 0x3, 1, 0},
+	{"restart", false, 3, JPEG_COLOR_YCBCR, {0x22, 0x11, 0x11}, {0, 1, 1}, 3, 0x3, 1, 3},
+	{"progressive", true, 3, JPEG_COLOR_YCBCR, {0x22, 0x11, 0x11}, {0, 1, 1}, 4, 0x3, 10, 32},
+	{"rgb", false, 3, JPEG_COLOR_RGB, {0x11, 0x11, 0x11}, {0, 0, 0}, 0, 0x1, 1, 0},
+	{"cmyk", false, 4, JPEG_COLOR_CMYK, {0x11, 0x11, 0x11, 0x11}, {0, 0, 0, 0}, 0, 0x1, 1, 0},
+	{"ycck", false, 4, JPEG_COLOR_YCCK, {0x22, 0x11, 0x11, 0x22}, {0, 1, 1, 0}, 0, 0x3, 1, 0},
+	{"tables", false, 4, JPEG_COLOR_CMYK, {0x11, 0x11, 0x11, 0x11}, {0, 1, 2, 3}, 0, 0xF, 4, 0},
+};
+
+//what the probe finds in the headers, and with validate_scan in the scans, against what make_fixtures.py wrote
+static bool check_probe(probe_fixture_t const * const fixture)
+{
+	char filename[64];
+	snprintf(filename, sizeof(filename), "test_images/%s.jpg", fixture->name);
+
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	bool ok=true;
+	unsigned scan;
+	for(scan=0; scan<=1; scan++)
+	{
+		jpeg_info_t info;
+		jpeg_status_t const status=jpeg_probe_file(dec, filename, scan, &info);
+		if(status!=JPEG_OK)
+		{
+			printf("FAIL %s: probe %d, %s\n", filename, status, jpeg_error_message(dec));
+			ok=false;
+			continue;
+		}
+
+		char const * wrong=NULL;
+		unsigned c;
+		if(info.width!=61 || info.height!=45)
+			wrong="size";
+		else if(info.progressive!=fixture->progressive)
+			wrong="progressive flag";
+		else if(info.nb_components!=fixture->nb_components || info.color_space!=fixture->color_space)
+			wrong="components";
+		else if(info.restart_interval!=fixture->restart_interval)
+			wrong="restart interval";
+		else if(info.quant_tables_defined!=fixture->quant_tables_defined)
+			wrong="quantization tables defined";
+		else if(info.scan_offset==0)
+			wrong="scan offset";
+		else if(scan && (info.nb_scans!=fixture->nb_scans || info.nb_restart_markers!=fixture->nb_restart_markers || info.scan_length==0))
+			wrong="scans";
+		for(c=0; !wrong && c<info.nb_components; c++)
+			if(info.components[c].H!=fixture->sampling[c]>>4 || info.components[c].V!=(fixture->sampling[c]&15))
+				wrong="sampling factors";
+			else if(info.components[c].quant_table!=fixture->quant_table[c])
+				wrong="quantization table numbers";
+
+		printf("%-4s %s: probe%s, %s\n", wrong ? "FAIL" : "ok", filename, scan ? " with scan" : "", wrong ? wrong : "as written");
+		if(wrong)
+		{
+			printf("     %u x %u%s, %u components, color space %d, restart interval %u, tables %#x, %u scans, %u restart markers\n", info.width, info.height, info.progressive ? " progressive" : "", info.nb_components, info.color_space, info.restart_interval, info.quant_tables_defined, info.nb_scans, info.nb_restart_markers);
+			ok=false;
+		}
+	}
+
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+//the quantization tables of tables.jpg up to its first scan, in natural order: make_fixtures.py's luma and chroma
+//tables (3 and 20 at both ends), half its luma table (1 and 10) and all 99
+static bool check_probe_tables(void)
+{
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+
+	jpeg_info_t info;
+	bool ok=jpeg_probe_file(dec, "test_images/tables.jpg", false, &info)==JPEG_OK;
+	ok&=info.quant_tables[0][0]==3 && info.quant_tables[0][63]==20 && info.quant_tables[1][0]==3 && info.quant_tables[1][63]==20 && info.quant_tables[2][0]==1 && info.quant_tables[2][63]==10;
+	unsigned k;
+	for(k=0; ok && k<64; k++)
+		ok=info.quant_tables[3][k]==99;
+	printf("%-4s test_images/tables.jpg: quantization tables %u..%u, %u..%u, %u..%u, %u..%u\n", ok ? "ok" : "FAIL", info.quant_tables[0][0], info.quant_tables[0][63], info.quant_tables[1][0], info.quant_tables[1][63], info.quant_tables[2][0], info.quant_tables[2][63], info.quant_tables[3][0], info.quant_tables[3][63]);
+
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+//the keys of main's -json output, and the stages of jpeg_benchmark_stages after the whole decode
+static char const * const bench_keys[]={"kernels", "idct", "upsample", "scale_denom", "threads", "warmup", "iterations", "images", "name", "bytes", "width", "height", "MCUs", "scans", "stages"};
+static char const * const bench_stages[]={"decode", "markers", "destuff", "huffman", "dequant", "idct", "upsample", "color", "output"};
+
+//main -bench on one picture: it has to succeed and write a JSON file with all keys, and times, rates and cycle
+//counts that are not negative for the whole decode and every stage
+static bool check_bench(char const * const program)
+{
+	char json[]="/tmp/jpeg_test_bench_XXXXXX";
+	int const fd=mkstemp(json);
+	if(fd<0)
+		err(1, "mkstemp");
+	close(fd);
+
+	char command[256];
+	snprintf(command, sizeof(command), "%s -bench 2 -warmup 0 -json %s test_images/420.jpg >/dev/null", program, json);
+	int const status=system(command);
+	size_t size=0;
+	uint8_t * const data=status==0 ? read_file(json, &size) : NULL;
+	unlink(json);
+	if(!data)
+	{
+		printf("FAIL %s: system() returned %d, no results\n", command, status);
+		return false;
+	}
+
+	//NUL-terminated for strstr
+	char * const text=realloc(data, size+1);
+	if(!text)
+		err(1, "realloc");
+	text[size]='\0';
+
+	char const * missing=NULL;
+	char key[32];
+	unsigned i;
+	for(i=0; !missing && i<sizeof(bench_keys)/sizeof(bench_keys[0]); i++)
+	{
+		snprintf(key, sizeof(key), "\"%s\": ", bench_keys[i]);
+		if(!strstr(text, key))
+			missing=bench_keys[i];
+	}
+
+	for(i=0; !missing && i<sizeof(bench_stages)/sizeof(bench_stages[0]); i++)
+	{
+		snprintf(key, sizeof(key), "\"%s\": {", bench_stages[i]);
+		char const * const stage=strstr(text, key);
+		double ns, ns_min, ns_per_MCU, MB_per_s, cycles=0;
+		if(!stage || sscanf(stage+strlen(key), "\"ns\": %lf, \"ns_min\": %lf, \"ns_per_MCU\": %lf, \"MB_per_s\": %lf, \"cycles\": %lf", &ns, &ns_min, &ns_per_MCU, &MB_per_s, &cycles)<(i ? 5 : 4) || ns<0 || ns_min<0 || ns_per_MCU<0 || MB_per_s<0 || cycles<0)
+			missing=bench_stages[i];
+	}
+
+	unsigned width=0, height=0;
+	char const * const image=strstr(text, "\"width\": ");
+	if(!missing && (!image || sscanf(image, "\"width\": %u, \"height\": %u", &width, &height)!=2 || width!=61 || height!=45))
+		missing="size";
+
+	printf("%-4s %s -bench: %s%s\n", missing ? "FAIL" : "ok", program, missing ? "wrong or missing " : "all keys and stage times", missing ? missing : "");
+	free(text);
+	return !missing;
+}
+
+//false if the integer IDCT is off by more than its bounds, or if its samples differ from the scalar kernels' ones.
+//The first call for a method and picture (with scalar kernels) keeps its samples in *scalar
+static bool compare_idct(char const * const filename, uint8_t const * const reference, const size_t size, const idct_bound_t * const bound, char const * const kernel_set, uint8_t ** const scalar)
+{
+	uint32_t size_X, size_Y;
+	char const * kernels;
+	uint8_t * const rgb=decode_rgb(filename, bound->method, &size_X, &size_Y, &kernels);
+	if(!rgb)
+		return false;
+	if((size_t)size_X*size_Y*3!=size)
+	{
+		printf("FAIL %s %s: size differs from the float IDCT's\n", filename, bound->name);
+		free(rgb);
+		return false;
+	}
+
+	unsigned max_error=0;
+	uint64_t sum=0;
+	size_t i;
+	for(i=0; i<size; i++)
+	{
+		unsigned const e=abs(rgb[i]-reference[i]);
+		sum+=e;
+		if(e>max_error)
+			max_error=e;
+	}
+
+	bool const same=!*scalar || !memcmp(rgb, *scalar, size);
+	if(*scalar)
+		free(rgb);
+	else
+		*scalar=rgb;
+
+	double const mean_error=(double)sum/size;
+	bool const ok=same && max_error<=bound->max_error && mean_error<=bound->mean_error;
+	printf("%-4s %s %-6s (%s kernels): max error %u (bound %u), mean %.4f (bound %.2f)%s\n", ok ? "ok" : "FAIL", filename, bound->name, kernels, max_error, bound->max_error, mean_error, bound->mean_error, same ? "" : ", differs from scalar");
+
+	if(strcmp(kernels, kernel_set))
+		printf("     %s kernels asked for, not supported by this CPU\n", kernel_set);
+	return ok;
+}
+
+//marker segments whose length does not match their contents, each ending the data right after the segment
+typedef struct
+{
+	char const * name;
+	size_t size;
+	uint8_t data[32];
+} malformed_t;
+
+static const malformed_t malformed[]=
+{
+	{"SOF with Lf 8 and 3 components", 12, {0xFF,0xD8, 0xFF,0xC0, 0,8, 8, 0,8, 0,8, 3}},
+	{"SOS with Ls 6 and 3 components", 29, {0xFF,0xD8, 0xFF,0xC0, 0,17, 8, 0,8, 0,8, 3, 1,0x11,0, 2,0x11,0, 3,0x11,0, 0xFF,0xDA, 0,6, 3, 1,0x00, 2}},
+	{"SOS with Ls 2", 25, {0xFF,0xD8, 0xFF,0xC0, 0,17, 8, 0,8, 0,8, 3, 1,0x11,0, 2,0x11,0, 3,0x11,0, 0xFF,0xDA, 0,2}},
+	{"APP0 with a thumbnail past its end", 20, {0xFF,0xD8, 0xFF,0xE0, 0,16, 'J','F','I','F',0, 1,1, 0, 0,1, 0,1, 16,16}},
+	{"APP14 with Lp 1", 6, {0xFF,0xD8, 0xFF,0xEE, 0,1}},
+	{"APP1 with Lp 0", 6, {0xFF,0xD8, 0xFF,0xE1, 0,0}},
+};
+
+//the decoder and the probe have to reject these as corrupt without reading past them, the data is copied to a
+//buffer of its exact size for the address sanitizer to see any read beyond it
+static bool check_malformed(const malformed_t * const m)
+{
+	jpeg_options_t options;
+	jpeg_default_options(&options);
+	jpeg_decoder_t * const dec=jpeg_decoder_create(&options);
+	if(!dec)
+		err(1, "jpeg_decoder_create");
+	
+	uint8_t * const data=malloc(m->size);
+	if(!data)
+		err(1, "malloc");
+	memcpy(data, m->data, m->size);
+	
+	jpeg_info_t info;
+	jpeg_status_t const decoded=jpeg_decode_memory(dec, data, m->size);
+	jpeg_status_t const probed=jpeg_probe_memory(dec, data, m->size, false, &info);
+	jpeg_status_t const scanned=jpeg_probe_memory(dec, data, m->size, true, &info);
+	
+	bool const ok=decoded==JPEG_ERROR_CORRUPT && probed==JPEG_ERROR_CORRUPT && scanned==JPEG_ERROR_CORRUPT;
+	printf("%-4s %s: decode %d, probe %d, probe with scan %d (%d expected)\n", ok ? "ok" : "FAIL", m->name, decoded, probed, scanned, JPEG_ERROR_CORRUPT);
+	
+	free(data);
+	jpeg_decoder_destroy(dec);
+	return ok;
+}
+
+int main(int argc, char ** argv)
+{
+	bool ok=true;
+	unsigned i, k, b;
+
+	for(i=0; i<sizeof(test_images)/sizeof(test_images[0]); i++)
+	{
+		uint32_t size_X, size_Y;
+		char const * kernels;
+		uint8_t * const reference=decode_rgb(test_images[i], IDCT_FLOAT, &size_X, &size_Y, &kernels);
+		if(!reference)
+		{
+			ok=false;
+			continue;
+		}
+
+		//JPEG_SIMD caps the kernels of the decoders created after it is set
+		uint8_t * scalar[sizeof(idct_bounds)/sizeof(idct_bounds[0])]={NULL};
+		for(k=0; k<sizeof(kernel_sets)/sizeof(kernel_sets[0]); k++)
+		{
+			setenv("JPEG_SIMD", kernel_sets[k], 1);
+			for(b=0; b<sizeof(idct_bounds)/sizeof(idct_bounds[0]); b++)
+				ok&=compare_idct(test_images[i], reference, (size_t)size_X*size_Y*3, &idct_bounds[b], kernel_sets[k], &scalar[b]);
+		}
+		unsetenv("JPEG_SIMD");
+
+		for(b=0; b<sizeof(idct_bounds)/sizeof(idct_bounds[0]); b++)
+			free(scalar[b]);
+
+		free(reference);
+	}
+
+	for(i=0; i<sizeof(malformed)/sizeof(malformed[0]); i++)
+		ok&=check_malformed(&malformed[i]);
+	for(i=0; i<sizeof(probe_fixtures)/sizeof(probe_fixtures[0]); i++)
+		ok&=check_probe(&probe_fixtures[i]);
+	ok&=check_probe_tables();
+
+	ok&=check_progressive();
+	for(i=0; i<sizeof(color_fixtures)/sizeof(color_fixtures[0]); i++)
+		ok&=check_color_fixture(&color_fixtures[i]);
+	ok&=check_crops("test_images/restart.jpg");
+	ok&=check_transforms();
+	ok&=check_scaled("test_images/gray.jpg", false, 1);
+	ok&=check_scaled("test_images/444.jpg", false, 2);
+	ok&=check_scaled("test_images/420.jpg", true, 0);
+	for(i=0; i<sizeof(stream_chunks)/sizeof(stream_chunks[0]); i++)
+	{
+		ok&=check_stream("test_images/420.jpg", stream_chunks[i], JPEG_OK);
+		ok&=check_stream("test_images/restart.jpg", stream_chunks[i], JPEG_OK);
+		ok&=check_stream("test_images/progressive.jpg", stream_chunks[i], JPEG_ERROR_UNSUPPORTED);
+	}
+	for(i=0; i<sizeof(layout_fixtures)/sizeof(layout_fixtures[0]); i++)
+		ok&=check_MCU_layout(layout_fixtures[i]);
+	ok&=check_bench(argc>1 ? argv[1] : "./main");
+	
+	printf("%s\n", ok ? "all tests passed" : "some tests FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,367 @@
+# Generates the test.c fixtures in this directory: small pictures of one synthetic scene, encoded by libjpeg
+# (through Pillow) or by the minimal baseline encoder below for what Pillow cannot write (YCCK, other samplings,
+# 16 bit and redefined tables), and libjpeg's decode of some of them as references.
+# The files are checked in, rerun this only to change them: python3 make_fixtures.py (needs Pillow)
+import io
+import math
+import os
+import sys
+
+from PIL import Image
+
+WIDTH = 61
+HEIGHT = 45
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def scene(x, y):
+    # gradients, a disc with a hard edge and some texture, so that every coefficient gets used
+    r = 40 + 170 * x / WIDTH
+    g = 30 + 180 * y / HEIGHT
+    b = 128 + 90 * math.sin(x * 0.35) * math.cos(y * 0.23)
+    if (x - 22) ** 2 + (y - 20) ** 2 < 130:
+        r, g, b = 230, 200 - 2 * y, 40
+    if (x // 4 + y // 4) % 7 == 0:
+        b = 255 - b
+    return [max(0, min(255, int(v))) for v in (r, g, b)]
+
+
+def scene_rgb():
+    return [scene(x, y) for y in range(HEIGHT) for x in range(WIDTH)]
+
+
+def scene_cmyk():
+    # Adobe CMYK as stored, 255 for no ink: the naive render is (C*K/255, M*K/255, Y*K/255)
+    return [(r, g, b, 255 - (x + 2 * y) % 61) for (r, g, b), (x, y) in zip(scene_rgb(), ((x, y) for y in range(HEIGHT) for x in range(WIDTH)))]
+
+
+def pillow_image(mode):
+    im = Image.new(mode, (WIDTH, HEIGHT))
+    if mode == "L":
+        im.putdata([int(0.299 * r + 0.587 * g + 0.114 * b + 0.5) for r, g, b in scene_rgb()])
+    elif mode == "CMYK":
+        # Pillow's CMYK is ink (0 for none), it writes it inverted as Adobe does
+        im.putdata([tuple(255 - v for v in p) for p in scene_cmyk()])
+    else:
+        im.putdata([tuple(p) for p in scene_rgb()])
+    return im
+
+
+def save(name, data):
+    with open(os.path.join(HERE, name), "wb") as f:
+        f.write(data)
+
+
+def save_pillow(name, im, **options):
+    out = io.BytesIO()
+    im.save(out, "JPEG", **options)
+    save(name, out.getvalue())
+
+
+# reference: libjpeg's decode (islow, fancy upsampling) as binary PPM, CMYK rendered as the decoder does
+def mul_div255(a, b):
+    t = a * b + 128
+    return (t + (t >> 8)) >> 8
+
+
+def save_reference(name, jpeg_name):
+    im = Image.open(os.path.join(HERE, jpeg_name))
+    im.load()
+    if im.mode == "CMYK":
+        pixels = []
+        for c, m, y, k in im.getdata():
+            c, m, y, k = 255 - c, 255 - m, 255 - y, 255 - k
+            pixels += [mul_div255(c, k), mul_div255(m, k), mul_div255(y, k)]
+    else:
+        pixels = [v for p in im.convert("RGB").getdata() for v in p]
+    save(name, b"P6\n%d %d\n255\n" % im.size + bytes(pixels))
+
+
+# minimal baseline/extended sequential encoder
+ZIGZAG = [0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63]
+
+# Annex K tables, scaled to about quality 90
+LUMA_Q = [16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+          18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99]
+CHROMA_Q = [17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99] + [99] * 32
+LUMA_Q = [max(1, (v * 20 + 50) // 100) for v in LUMA_Q]
+CHROMA_Q = [max(1, (v * 20 + 50) // 100) for v in CHROMA_Q]
+
+DC_LUMA = ([0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0], list(range(12)))
+DC_CHROMA = ([0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0], list(range(12)))
+AC_LUMA = ([0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d], bytes.fromhex(
+    "01020300041105122131410613516107227114328191a1082342b1c11552d1f02433627282090a161718191a25262728292a3435363738393a43"
+    "4445464748494a535455565758595a636465666768696a737475767778797a838485868788898a92939495969798999aa2a3a4a5a6a7a8a9aab2"
+    "b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4f5f6f7f8f9fa"))
+AC_CHROMA = ([0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77], bytes.fromhex(
+    "000102031104052131061241510761711322328108144291a1b1c109233352f0156272d10a162434e125f11718191a262728292a35363738393a"
+    "434445464748494a535455565758595a636465666768696a737475767778797a82838485868788898a92939495969798999aa2a3a4a5a6a7a8a9"
+    "aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae2e3e4e5e6e7e8e9eaf2f3f4f5f6f7f8f9fa"))
+
+DCT = [[(math.sqrt(0.5) if u == 0 else 1) * math.cos((2 * x + 1) * u * math.pi / 16) / 2 for x in range(8)] for u in range(8)]
+
+
+def huffman_codes(table):
+    bits, values = table
+    codes = {}
+    code = 0
+    k = 0
+    for length in range(1, 17):
+        for _ in range(bits[length - 1]):
+            codes[values[k]] = (code, length)
+            k += 1
+            code += 1
+        code <<= 1
+    return codes
+
+
+class BitWriter:
+    def __init__(self):
+        self.acc = 0
+        self.nbits = 0
+        self.data = bytearray()
+
+    def put(self, code, length):
+        self.acc = (self.acc << length) | code
+        self.nbits += length
+        while self.nbits >= 8:
+            self.nbits -= 8
+            byte = (self.acc >> self.nbits) & 0xFF
+            self.data.append(byte)
+            if byte == 0xFF:
+                self.data.append(0)
+        self.acc &= (1 << self.nbits) - 1
+
+    def flush(self):
+        if self.nbits:
+            self.put((1 << (8 - self.nbits)) - 1, 8 - self.nbits)
+
+
+def magnitude(v):
+    if v == 0:
+        return 0, 0
+    size = abs(v).bit_length()
+    return size, v if v > 0 else v + (1 << size) - 1
+
+
+class Encoder:
+    # planes: full resolution component samples, sampling: (H, V) per component
+    def __init__(self, planes, sampling, ids):
+        self.planes = planes
+        self.sampling = sampling
+        self.ids = ids
+        self.Hmax = max(h for h, v in sampling)
+        self.Vmax = max(v for h, v in sampling)
+        self.MCUs_X = (WIDTH + 8 * self.Hmax - 1) // (8 * self.Hmax)
+        self.MCUs_Y = (HEIGHT + 8 * self.Vmax - 1) // (8 * self.Vmax)
+        self.quant = [None] * 4
+        self.huffman = {}
+        self.out = bytearray(b"\xff\xd8")
+
+    def segment(self, marker, payload):
+        self.out += bytes([0xFF, marker]) + (len(payload) + 2).to_bytes(2, "big") + payload
+
+    def app14(self, transform):
+        self.segment(0xEE, b"Adobe" + bytes([0, 100, 0, 0, 0, 0, transform]))
+
+    def dqt(self, slot, table, sixteen_bits=False):
+        self.quant[slot] = table
+        if sixteen_bits:
+            self.segment(0xDB, bytes([0x10 | slot]) + b"".join(table[ZIGZAG[k]].to_bytes(2, "big") for k in range(64)))
+        else:
+            self.segment(0xDB, bytes([slot]) + bytes(table[ZIGZAG[k]] for k in range(64)))
+
+    def dht(self, tc, slot, table):
+        self.huffman[(tc, slot)] = huffman_codes(table)
+        self.segment(0xC4, bytes([(tc << 4) | slot]) + bytes(table[0]) + bytes(table[1]))
+
+    def sof(self, marker, quant_slots):
+        self.quant_slots = quant_slots
+        payload = bytes([8]) + HEIGHT.to_bytes(2, "big") + WIDTH.to_bytes(2, "big") + bytes([len(self.planes)])
+        for c in range(len(self.planes)):
+            payload += bytes([self.ids[c], (self.sampling[c][0] << 4) | self.sampling[c][1], quant_slots[c]])
+        self.segment(marker, payload)
+
+    def dri(self, interval):
+        self.restart_interval = interval
+        self.segment(0xDD, interval.to_bytes(2, "big"))
+
+    def sample(self, c, x, y):
+        # box filter down to the component's resolution, edges replicated
+        fx = self.Hmax // self.sampling[c][0]
+        fy = self.Vmax // self.sampling[c][1]
+        s = 0
+        for dy in range(fy):
+            for dx in range(fx):
+                s += self.planes[c][min(y * fy + dy, HEIGHT - 1) * WIDTH + min(x * fx + dx, WIDTH - 1)]
+        return s / (fx * fy)
+
+    def block(self, c, bx, by):
+        # quantized with the table the component has when its scan starts, zigzag order
+        samples = [[self.sample(c, bx * 8 + x, by * 8 + y) - 128 for x in range(8)] for y in range(8)]
+        rows = [[sum(DCT[u][x] * samples[y][x] for x in range(8)) for u in range(8)] for y in range(8)]
+        quant = self.quant[self.quant_slots[c]]
+        coefs = [0] * 64
+        for v in range(8):
+            for u in range(8):
+                coefs[v * 8 + u] = int(round(sum(DCT[v][y] * rows[y][u] for y in range(8)) / quant[v * 8 + u]))
+        return [coefs[ZIGZAG[k]] for k in range(64)]
+
+    def encode_block(self, bw, c, bx, by, tables, predictors):
+        zz = self.block(c, bx, by)
+        dc_codes = self.huffman[(0, tables[0])]
+        ac_codes = self.huffman[(1, tables[1])]
+        size, bits = magnitude(zz[0] - predictors[c])
+        predictors[c] = zz[0]
+        bw.put(*dc_codes[size])
+        if size:
+            bw.put(bits, size)
+        last = max([k for k in range(1, 64) if zz[k]] + [0])
+        run = 0
+        for k in range(1, last + 1):
+            if not zz[k]:
+                run += 1
+                continue
+            while run > 15:
+                bw.put(*ac_codes[0xF0])
+                run -= 16
+            size, bits = magnitude(zz[k])
+            bw.put(*ac_codes[(run << 4) | size])
+            bw.put(bits, size)
+            run = 0
+        if last < 63:
+            bw.put(*ac_codes[0])
+
+    def sos(self, components, tables):
+        # tables: (DC slot, AC slot) per scan component
+        payload = bytes([len(components)])
+        for c, (td, ta) in zip(components, tables):
+            payload += bytes([self.ids[c], (td << 4) | ta])
+        self.segment(0xDA, payload + bytes([0, 63, 0]))
+
+        units = []
+        if len(components) > 1:
+            for my in range(self.MCUs_Y):
+                for mx in range(self.MCUs_X):
+                    units.append([(i, mx * self.sampling[c][0] + dx, my * self.sampling[c][1] + dy)
+                                  for i, c in enumerate(components) for dy in range(self.sampling[c][1]) for dx in range(self.sampling[c][0])])
+        else:
+            c = components[0]
+            w = (WIDTH * self.sampling[c][0] + self.Hmax - 1) // self.Hmax
+            h = (HEIGHT * self.sampling[c][1] + self.Vmax - 1) // self.Vmax
+            units = [[(0, bx, by)] for by in range((h + 7) // 8) for bx in range((w + 7) // 8)]
+
+        bw = BitWriter()
+        predictors = [0] * 4
+        interval = getattr(self, "restart_interval", 0)
+        for n, unit in enumerate(units):
+            if interval and n and n % interval == 0:
+                bw.flush()
+                bw.data += bytes([0xFF, 0xD0 + (n // interval - 1) % 8])
+                predictors = [0] * 4
+            for i, bx, by in unit:
+                self.encode_block(bw, components[i], bx, by, tables[i], predictors)
+        bw.flush()
+        self.out += bw.data
+
+    def finish(self):
+        return bytes(self.out + b"\xff\xd9")
+
+
+def ycbcr_planes():
+    rgb = scene_rgb()
+    return [[0.299 * r + 0.587 * g + 0.114 * b for r, g, b in rgb],
+            [-0.168736 * r - 0.331264 * g + 0.5 * b + 128 for r, g, b in rgb],
+            [0.5 * r - 0.418688 * g - 0.081312 * b + 128 for r, g, b in rgb]]
+
+
+def encode_ycbcr(sampling):
+    e = Encoder(ycbcr_planes(), sampling, [1, 2, 3])
+    e.dqt(0, LUMA_Q)
+    e.dqt(1, CHROMA_Q)
+    e.sof(0xC0, [0, 1, 1])
+    e.dht(0, 0, DC_LUMA)
+    e.dht(1, 0, AC_LUMA)
+    e.dht(0, 1, DC_CHROMA)
+    e.dht(1, 1, AC_CHROMA)
+    e.sos([0, 1, 2], [(0, 0), (1, 1), (1, 1)])
+    return e.finish()
+
+
+def encode_ycck():
+    # libjpeg's cmyk_ycck_convert: the YCbCr of (255-C, 255-M, 255-Y), K as it is
+    cmyk = scene_cmyk()
+    planes = [[0.299 * (255 - c) + 0.587 * (255 - m) + 0.114 * (255 - y) for c, m, y, k in cmyk],
+              [-0.168736 * (255 - c) - 0.331264 * (255 - m) + 0.5 * (255 - y) + 128 for c, m, y, k in cmyk],
+              [0.5 * (255 - c) - 0.418688 * (255 - m) - 0.081312 * (255 - y) + 128 for c, m, y, k in cmyk],
+              [k for c, m, y, k in cmyk]]
+    e = Encoder(planes, [(2, 2), (1, 1), (1, 1), (2, 2)], [1, 2, 3, 4])
+    e.app14(2)
+    e.dqt(0, LUMA_Q)
+    e.dqt(1, CHROMA_Q)
+    e.sof(0xC0, [0, 1, 1, 0])
+    e.dht(0, 0, DC_LUMA)
+    e.dht(1, 0, AC_LUMA)
+    e.dht(0, 1, DC_CHROMA)
+    e.dht(1, 1, AC_CHROMA)
+    e.sos([0, 1, 2, 3], [(0, 0), (1, 1), (1, 1), (0, 0)])
+    return e.finish()
+
+
+def encode_tables():
+    # CMYK in four scans, extended sequential (SOF1): a quantization and a Huffman table slot per component, the
+    # last quantization table 16 bit. Tables are redefined between the scans, the component of a later scan has to
+    # be decoded with the new ones
+    e = Encoder([list(p) for p in zip(*scene_cmyk())], [(1, 1)] * 4, [1, 2, 3, 4])
+    e.app14(0)
+    e.dqt(0, LUMA_Q)
+    e.dqt(1, CHROMA_Q)
+    e.dqt(2, [max(1, v // 2) for v in LUMA_Q])
+    e.dqt(3, [99] * 64)
+    e.sof(0xC1, [0, 1, 2, 3])
+    e.dht(0, 0, DC_LUMA)
+    e.dht(1, 0, AC_LUMA)
+    e.dht(0, 2, DC_CHROMA)
+    e.dht(1, 2, AC_CHROMA)
+    e.dht(0, 3, DC_LUMA)
+    e.dht(1, 3, AC_LUMA)
+    e.sos([0], [(0, 0)])
+    e.dht(0, 0, DC_CHROMA)
+    e.dht(1, 0, AC_CHROMA)
+    e.sos([1], [(0, 0)])
+    e.sos([2], [(2, 2)])
+    e.dqt(3, [2 + k // 4 for k in range(64)], sixteen_bits=True)
+    e.sos([3], [(3, 3)])
+    return e.finish()
+
+
+def main():
+    rgb = pillow_image("RGB")
+
+    # the specialized MCU layouts, and two that go through the generic loops
+    save_pillow("gray.jpg", pillow_image("L"), quality=90)
+    save_pillow("444.jpg", rgb, quality=90, subsampling=0)
+    save_pillow("422.jpg", rgb, quality=90, subsampling=1)
+    save_pillow("420.jpg", rgb, quality=90, subsampling=2)
+    save("440.jpg", encode_ycbcr([(1, 2), (1, 1), (1, 1)]))
+    save("3x1.jpg", encode_ycbcr([(3, 1), (1, 1), (1, 1)]))
+
+    # progressive with refinement scans (libjpeg's default script) and a restart marker every MCU row, the
+    # coefficients are the ones of 420.jpg
+    save_pillow("progressive.jpg", rgb, quality=90, subsampling=2, progressive=True, restart_marker_rows=1)
+    # a restart interval that does not divide the 4 MCUs of a row
+    save_pillow("restart.jpg", rgb, quality=90, subsampling=2, restart_marker_blocks=3)
+
+    # 1, 3 and 4 components in the other color spaces
+    save_pillow("rgb.jpg", rgb, quality=90, subsampling=0, keep_rgb=True)
+    save_pillow("cmyk.jpg", pillow_image("CMYK"), quality=90)
+    save("ycck.jpg", encode_ycck())
+    save("tables.jpg", encode_tables())
+    for name in ("440", "3x1", "gray", "rgb", "cmyk", "ycck", "tables"):
+        save_reference(name + ".ppm", name + ".jpg")
+
+
+if __name__ == "__main__":
+    sys.exit(main())